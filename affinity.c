@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "stream.h"
+#include "affinity.h"
+
+/*
+ * Placement of background jobs. The units a job is pinned to are read from sysfs: the
+ * physical cores (the hyperthreads of a core stay together) or the NUMA nodes, limited
+ * to the CPUs the shell itself may run on. A new job goes to the unit running the
+ * fewest of the shell's jobs; ties go to the unit that was least busy since the last
+ * placement according to /proc/stat.
+ */
+
+#define SYS_CPU "/sys/devices/system/cpu"
+#define SYS_NODE "/sys/devices/system/node"
+
+SpreadMode spreadMode = SPREAD_OFF;
+
+static unsigned long long lastBusy[CPU_SETSIZE];    // busy ticks per CPU at the last placement
+
+/**
+ * The function parseCpuList parses a CPU list such as "0-3,8,10-11", as used by sysfs
+ * and taskset -c.
+ * @return a bool denoting whether \param s is a valid, non-empty CPU list.
+ */
+bool parseCpuList(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s != '\0' && *s != '\n') {
+        char *endptr;
+        long first = strtol(s, &endptr, 10), last = first;
+        if (endptr == s || first < 0)
+            return false;
+        s = endptr;
+        if (*s == '-') {
+            last = strtol(s + 1, &endptr, 10);
+            if (endptr == s + 1 || last < first)
+                return false;
+            s = endptr;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*s == ',')
+            s++;
+        else if (*s != '\0' && *s != '\n')
+            return false;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * The function formatCpuList prints \param set as a CPU list into \param buf.
+ * @return the length of the list.
+ */
+int formatCpuList(const cpu_set_t *set, char *buf, size_t size) {
+    int n = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        n += snprintf(buf + n, n < (int)size ? size - n : 0, last == cpu ? "%s%d" : "%s%d-%d",
+                      n ? "," : "", cpu, last);
+        cpu = last;
+    }
+    return n;
+}
+
+static bool readCpuList(const char *path, cpu_set_t *set) {
+    char line[4096];
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+        return false;
+    bool ok = fgets(line, sizeof(line), f) != NULL && parseCpuList(line, set);
+    fclose(f);
+    return ok;
+}
+
+/**
+ * The function findUnits splits the CPUs in \param allowed into the units jobs are
+ * spread over: physical cores or NUMA nodes.
+ * @return the number of units.
+ */
+static int findUnits(const cpu_set_t *allowed, cpu_set_t *units) {
+    static cpu_set_t seen;
+    char path[PATH_MAX];
+    int count = 0;
+    CPU_ZERO(&seen);
+
+    if (spreadMode == SPREAD_NODES) {
+        cpu_set_t nodes;
+        if (readCpuList(SYS_NODE "/online", &nodes)) {
+            for (int node = 0; node < CPU_SETSIZE; node++) {
+                if (!CPU_ISSET(node, &nodes))
+                    continue;
+                snprintf(path, sizeof(path), SYS_NODE "/node%d/cpulist", node);
+                if (readCpuList(path, &units[count])) {
+                    CPU_AND(&units[count], &units[count], allowed);
+                    if (CPU_COUNT(&units[count]) > 0)
+                        count++;
+                }
+            }
+        }
+        if (count == 0) {                   // no NUMA: a single node
+            units[0] = *allowed;
+            count = 1;
+        }
+        return count;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, allowed) || CPU_ISSET(cpu, &seen))
+            continue;
+        snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/core_cpus_list", cpu);
+        if (!readCpuList(path, &units[count])) {
+            snprintf(path, sizeof(path), SYS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+            if (!readCpuList(path, &units[count])) {
+                CPU_ZERO(&units[count]);
+                CPU_SET(cpu, &units[count]);
+            }
+        }
+        CPU_AND(&units[count], &units[count], allowed);
+        CPU_SET(cpu, &units[count]);
+        CPU_OR(&seen, &seen, &units[count]);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * The function sampleBusy reads the busy ticks of every CPU from /proc/stat and
+ * stores, in \param delta, how many passed since the previous sample.
+ */
+static void sampleBusy(unsigned long long *delta) {
+    char line[512];
+    memset(delta, 0, CPU_SETSIZE * sizeof(*delta));
+    FILE *f = fopen("/proc/stat", "re");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int cpu;
+        unsigned long long user, nice, system, irq, softirq, steal;
+        if (sscanf(line, "cpu%d %llu %llu %llu %*u %*u %llu %llu %llu",
+                   &cpu, &user, &nice, &system, &irq, &softirq, &steal) != 7 || cpu < 0 || cpu >= CPU_SETSIZE)
+            continue;
+        unsigned long long busy = user + nice + system + irq + softirq + steal;
+        delta[cpu] = busy - lastBusy[cpu];
+        lastBusy[cpu] = busy;
+    }
+    fclose(f);
+}
+
+/**
+ * The function chooseCpus picks the unit a new background job is pinned to.
+ * @param jobs the CPUs of the running background jobs.
+ * @param count the number of running background jobs.
+ * @param chosen receives the CPUs of the unit.
+ * @return a bool denoting whether a unit was chosen.
+ */
+bool chooseCpus(const cpu_set_t *jobs, int count, cpu_set_t *chosen) {
+    static cpu_set_t units[CPU_SETSIZE];
+    static unsigned long long busy[CPU_SETSIZE];
+    cpu_set_t allowed, common;
+
+    if (spreadMode == SPREAD_OFF || sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        return false;
+    int unitCount = findUnits(&allowed, units);
+    sampleBusy(busy);
+
+    int best = -1;
+    double bestLoad = 0, bestBusy = 0;
+    for (int u = 0; u < unitCount; u++) {
+        int cpus = CPU_COUNT(&units[u]), running = 0;
+        unsigned long long ticks = 0;
+        for (int j = 0; j < count; j++) {
+            CPU_AND(&common, &units[u], &jobs[j]);
+            running += CPU_COUNT(&common) > 0;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &units[u]))
+                ticks += busy[cpu];
+        }
+        double load = (double)running / cpus, perCpu = (double)ticks / cpus;
+        if (best == -1 || load < bestLoad || (load == bestLoad && perCpu < bestBusy)) {
+            best = u;
+            bestLoad = load;
+            bestBusy = perCpu;
+        }
+    }
+    if (best == -1)
+        return false;
+    *chosen = units[best];
+    return true;
+}
+
+/**
+ * The function command_spread is one of the built-in commands of the shell.
+ *
+ *     spread [cores | nodes | off]
+ *
+ * Sets how background jobs without a pin prefix are placed, or prints the mode.
+ * @return the exit code of the command.
+ */
+int command_spread(int argc, char **argv) {
+    static char *modeNames[] = { "off", "cores", "nodes", NULL };
+    if (argc < 2) {
+        shellPrintf("Spreading background jobs: %s\n", modeNames[spreadMode]);
+        return 0;
+    }
+    for (int i = 0; modeNames[i] != NULL; i++) {
+        if (argc == 2 && strcmp(argv[1], modeNames[i]) == 0) {
+            spreadMode = (SpreadMode)i;
+            return 0;
+        }
+    }
+    shellPrintf("Error: usage: spread [cores | nodes | off]!\n");
+    return 2;
+}
@@ -0,0 +1,25 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sched.h>
+
+/*
+ * How background jobs without a "pin" prefix are placed: left to the scheduler, or
+ * pinned to the least loaded physical core or NUMA node of the CPUs the shell may use.
+ */
+typedef enum SpreadMode {
+    SPREAD_OFF,
+    SPREAD_CORES,
+    SPREAD_NODES
+} SpreadMode;
+
+extern SpreadMode spreadMode;
+
+bool parseCpuList(const char *s, cpu_set_t *set);
+int formatCpuList(const cpu_set_t *set, char *buf, size_t size);
+bool chooseCpus(const cpu_set_t *jobs, int count, cpu_set_t *chosen);
+int command_spread(int argc, char **argv);
+
+#endif
@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include "scanner.h"
+#include "shell.h"
+#include "vars.h"
+#include "arith.h"
+
+typedef enum ArithOp {
+    A_PUSH,             // push value
+    A_LOAD,             // push the variable name
+    A_PARAM,            // push positional parameter value
+    A_COUNT,            // push $#
+    A_STATUS,           // push $?
+    A_STORE,            // assign the top of the stack to the variable name
+    A_POP,
+    A_NEG, A_NOT, A_BITNOT, A_BOOL,
+    A_MUL, A_DIV, A_MOD, A_POW, A_ADD, A_SUB, A_SHL, A_SHR,
+    A_LT, A_LE, A_GT, A_GE, A_EQ, A_NE, A_AND, A_XOR, A_OR,
+    A_JUMP,             // to value
+    A_JUMP_IF_ZERO,     // pops the condition
+    A_JUMP_IF_NONZERO
+} ArithOp;
+
+typedef struct ArithInstruction {
+    ArithOp op;
+    int64_t value;
+    char *name;
+} ArithInstruction;
+
+typedef struct Expression {
+    char *text;
+    ArithInstruction *code;
+    int length;
+} Expression;
+
+typedef struct ArithCompiler {
+    const char *p;
+    Expression *expression;
+    int capacity;
+    int depth;              // of the stack when the code emitted so far has run
+    int nesting;            // of parentheses, unary operators and assignments
+    bool failed;
+} ArithCompiler;
+
+typedef struct BinaryOperator {
+    const char *token;
+    int precedence;
+    ArithOp op;
+} BinaryOperator;
+
+// Longer tokens first, so that "<<" is not taken for "<".
+static const BinaryOperator binaryOperators[] = {
+    { "||", 1, A_OR }, { "&&", 2, A_AND }, { "==", 6, A_EQ }, { "!=", 6, A_NE },
+    { "<=", 7, A_LE }, { ">=", 7, A_GE }, { "<<", 8, A_SHL }, { ">>", 8, A_SHR },
+    { "**", 11, A_POW }, { "|", 3, A_OR }, { "^", 4, A_XOR }, { "&", 5, A_AND },
+    { "<", 7, A_LT }, { ">", 7, A_GT }, { "+", 9, A_ADD }, { "-", 9, A_SUB },
+    { "*", 10, A_MUL }, { "/", 10, A_DIV }, { "%", 10, A_MOD }, { NULL, 0, A_PUSH }
+};
+
+static const BinaryOperator assignOperators[] = {
+    { "<<=", 0, A_SHL }, { ">>=", 0, A_SHR }, { "+=", 0, A_ADD }, { "-=", 0, A_SUB },
+    { "*=", 0, A_MUL }, { "/=", 0, A_DIV }, { "%=", 0, A_MOD }, { "&=", 0, A_AND },
+    { "^=", 0, A_XOR }, { "|=", 0, A_OR }, { "=", 0, A_PUSH }, { NULL, 0, A_PUSH }
+};
+
+static Expression *cache[ARITH_CACHE_SLOTS];
+static int cacheCount = 0;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool isNameStart(char c) {
+    return isalpha((unsigned char)c) || c == '_';
+}
+
+static bool isNameCharacter(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+static void skipSpaces(ArithCompiler *c) {
+    while (isspace((unsigned char)*c->p))
+        c->p++;
+}
+
+static void syntaxError(ArithCompiler *c) {
+    if (!c->failed && *c->p == '\0')
+        printf("Error: arithmetic expression \"%s\" ends too soon!\n", c->expression->text);
+    else if (!c->failed)
+        printf("Error: syntax error in arithmetic expression \"%s\" near \"%s\"!\n", c->expression->text, c->p);
+    c->failed = true;
+}
+
+/**
+ * The function emit appends an instruction and keeps track of the depth of the stack.
+ * @return the position of the instruction.
+ */
+static int emit(ArithCompiler *c, ArithOp op, int64_t value, char *name) {
+    Expression *e = c->expression;
+    if (e->length == c->capacity) {
+        c->capacity = c->capacity == 0 ? 16 : 2 * c->capacity;
+        e->code = realloc(e->code, c->capacity * sizeof(*e->code));
+        assert(e->code != NULL);
+    }
+    ArithInstruction in = { op, value, name };
+    e->code[e->length] = in;
+
+    if (op <= A_STATUS)
+        c->depth++;
+    else if (op == A_POP || op >= A_MUL)        // binary operators and conditional jumps
+        c->depth -= op == A_JUMP ? 0 : 1;
+    if (c->depth > ARITH_STACK_SIZE) {
+        if (!c->failed)
+            printf("Error: arithmetic expression \"%s\" is too complex!\n", e->text);
+        c->failed = true;
+    }
+    return e->length++;
+}
+
+static void patch(ArithCompiler *c, int at) {
+    c->expression->code[at].value = c->expression->length;
+}
+
+static char *takeName(ArithCompiler *c) {
+    const char *start = c->p;
+    while (isNameCharacter(*c->p))
+        c->p++;
+    char *name = strndup(start, c->p - start);
+    assert(name != NULL);
+    return name;
+}
+
+static void compileComma(ArithCompiler *c);
+static void compileAssignment(ArithCompiler *c);
+static void compileTernary(ArithCompiler *c);
+static void compileUnary(ArithCompiler *c);
+
+/**
+ * The function compileVariable compiles $name, ${name}, $0-$9, $# and $?.
+ */
+static void compileVariable(ArithCompiler *c) {
+    c->p++;
+    if (*c->p == '{') {
+        c->p++;
+        if (!isNameStart(*c->p)) {
+            syntaxError(c);
+            return;
+        }
+        char *name = takeName(c);
+        emit(c, A_LOAD, 0, name);
+        if (*c->p != '}')
+            syntaxError(c);
+        else
+            c->p++;
+    } else if (isNameStart(*c->p)) {
+        emit(c, A_LOAD, 0, takeName(c));
+    } else if (isdigit((unsigned char)*c->p)) {
+        emit(c, A_PARAM, *c->p++ - '0', NULL);
+    } else if (*c->p == '#' || *c->p == '?') {
+        emit(c, *c->p++ == '#' ? A_COUNT : A_STATUS, 0, NULL);
+    } else {
+        syntaxError(c);
+    }
+}
+
+static void compilePrimary(ArithCompiler *c) {
+    skipSpaces(c);
+    if (*c->p == '(') {
+        if (++c->nesting > ARITH_STACK_SIZE) {
+            syntaxError(c);
+            return;
+        }
+        c->p++;
+        compileComma(c);
+        skipSpaces(c);
+        if (*c->p != ')') {
+            syntaxError(c);
+            return;
+        }
+        c->p++;
+        c->nesting--;
+    } else if (isdigit((unsigned char)*c->p)) {
+        char *end;
+        errno = 0;
+        uint64_t value = strtoull(c->p, &end, 0);     // decimal, 0x hex and 0 octal
+        if (errno != 0 || isNameCharacter(*end)) {
+            syntaxError(c);
+            return;
+        }
+        c->p = end;
+        emit(c, A_PUSH, (int64_t)value, NULL);
+    } else if (*c->p == '$') {
+        compileVariable(c);
+    } else if (isNameStart(*c->p)) {
+        emit(c, A_LOAD, 0, takeName(c));
+    } else {
+        syntaxError(c);
+    }
+}
+
+static void compileUnary(ArithCompiler *c) {
+    skipSpaces(c);
+    char op = *c->p;
+    if (op == '-' || op == '+' || op == '!' || op == '~') {
+        if (++c->nesting > ARITH_STACK_SIZE) {
+            syntaxError(c);
+            return;
+        }
+        c->p++;
+        compileUnary(c);
+        c->nesting--;
+        if (op != '+')
+            emit(c, op == '-' ? A_NEG : op == '!' ? A_NOT : A_BITNOT, 0, NULL);
+    } else {
+        compilePrimary(c);
+    }
+}
+
+/**
+ * The function matchBinary finds the binary operator at the current position; an
+ * assignment operator such as "+=" is not one.
+ */
+static const BinaryOperator *matchBinary(ArithCompiler *c) {
+    skipSpaces(c);
+    for (const BinaryOperator *b = binaryOperators; b->token != NULL; b++) {
+        size_t n = strlen(b->token);
+        if (strncmp(c->p, b->token, n) == 0)
+            return b->token[n - 1] != '=' && c->p[n] == '=' ? NULL : b;
+    }
+    return NULL;
+}
+
+/**
+ * The function compileBinary compiles the operators of at least \param minimum
+ * precedence by precedence climbing. && and || only evaluate their right side when
+ * needed, so they become jumps.
+ */
+static void compileBinary(ArithCompiler *c, int minimum) {
+    compileUnary(c);
+    const BinaryOperator *b;
+    while (!c->failed && (b = matchBinary(c)) != NULL && b->precedence >= minimum) {
+        c->p += strlen(b->token);
+        if (b->precedence <= 2) {
+            int skip = emit(c, b->precedence == 1 ? A_JUMP_IF_NONZERO : A_JUMP_IF_ZERO, 0, NULL);
+            compileBinary(c, b->precedence + 1);
+            emit(c, A_BOOL, 0, NULL);
+            int done = emit(c, A_JUMP, 0, NULL);
+            c->depth--;                             // the other branch pushes its own result
+            patch(c, skip);
+            emit(c, A_PUSH, b->precedence == 1, NULL);
+            patch(c, done);
+        } else {
+            // ** is right associative, the others are left associative.
+            compileBinary(c, b->op == A_POW ? b->precedence : b->precedence + 1);
+            emit(c, b->op, 0, NULL);
+        }
+    }
+}
+
+static void compileTernary(ArithCompiler *c) {
+    compileBinary(c, 1);
+    skipSpaces(c);
+    if (c->failed || *c->p != '?')
+        return;
+    c->p++;
+    int otherwise = emit(c, A_JUMP_IF_ZERO, 0, NULL);
+    compileAssignment(c);
+    skipSpaces(c);
+    if (*c->p != ':') {
+        syntaxError(c);
+        return;
+    }
+    c->p++;
+    int done = emit(c, A_JUMP, 0, NULL);
+    c->depth--;
+    patch(c, otherwise);
+    compileTernary(c);
+    patch(c, done);
+}
+
+static void compileAssignment(ArithCompiler *c) {
+    skipSpaces(c);
+    const char *start = c->p;
+    if (isNameStart(*c->p)) {
+        while (isNameCharacter(*c->p))
+            c->p++;
+        const char *end = c->p;
+        skipSpaces(c);
+        for (const BinaryOperator *a = assignOperators; a->token != NULL; a++) {
+            size_t n = strlen(a->token);
+            if (strncmp(c->p, a->token, n) != 0 || (a->op == A_PUSH && c->p[1] == '='))
+                continue;                           // "==" is a comparison
+            if (++c->nesting > ARITH_STACK_SIZE) {
+                syntaxError(c);
+                return;
+            }
+            c->p += n;
+            char *name = strndup(start, end - start);
+            assert(name != NULL);
+            if (a->op != A_PUSH)
+                emit(c, A_LOAD, 0, strndup(start, end - start));
+            compileAssignment(c);
+            c->nesting--;
+            if (a->op != A_PUSH)
+                emit(c, a->op, 0, NULL);
+            emit(c, A_STORE, 0, name);
+            return;
+        }
+    }
+    c->p = start;
+    compileTernary(c);
+}
+
+static void compileComma(ArithCompiler *c) {
+    compileAssignment(c);
+    skipSpaces(c);
+    while (!c->failed && *c->p == ',') {
+        c->p++;
+        emit(c, A_POP, 0, NULL);
+        compileAssignment(c);
+        skipSpaces(c);
+    }
+}
+
+static void freeExpression(Expression *e) {
+    for (int i = 0; i < e->length; i++)
+        free(e->code[i].name);
+    free(e->code);
+    free(e->text);
+    free(e);
+}
+
+/**
+ * The function compileExpression compiles \param text for the stack machine.
+ * @return the expression, or NULL after a syntax error.
+ */
+static Expression *compileExpression(const char *text) {
+    Expression *e = calloc(1, sizeof(*e));
+    assert(e != NULL);
+    e->text = strdup(text);
+    assert(e->text != NULL);
+    ArithCompiler c = { text, e, 0, 0, 0, false };
+
+    skipSpaces(&c);
+    if (*c.p == '\0')
+        emit(&c, A_PUSH, 0, NULL);                  // $(( )) is 0
+    else
+        compileComma(&c);
+    skipSpaces(&c);
+    if (*c.p != '\0')
+        syntaxError(&c);
+    if (c.failed) {
+        freeExpression(e);
+        return NULL;
+    }
+    return e;
+}
+
+static unsigned long hashText(const char *s) {
+    unsigned long h = 5381;
+    while (*s != '\0')
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+/**
+ * The function findExpression looks \param text up in the cache and compiles it when
+ * it is not there. Cached expressions are never freed; once the cache is full, new
+ * expressions are compiled for every evaluation.
+ * @param cached set to whether the result is owned by the cache.
+ * @return the expression, or NULL after a syntax error.
+ */
+static Expression *findExpression(const char *text, bool *cached) {
+    unsigned long i = hashText(text) & (ARITH_CACHE_SLOTS - 1);
+    pthread_mutex_lock(&cacheLock);
+    while (cache[i] != NULL && strcmp(cache[i]->text, text) != 0)
+        i = (i + 1) & (ARITH_CACHE_SLOTS - 1);
+    Expression *e = cache[i];
+    pthread_mutex_unlock(&cacheLock);
+    *cached = e != NULL;
+    if (e != NULL)
+        return e;
+
+    e = compileExpression(text);
+    if (e == NULL)
+        return NULL;
+    pthread_mutex_lock(&cacheLock);
+    if (4 * (cacheCount + 1) <= 3 * ARITH_CACHE_SLOTS) {
+        i = hashText(text) & (ARITH_CACHE_SLOTS - 1);
+        while (cache[i] != NULL && strcmp(cache[i]->text, text) != 0)
+            i = (i + 1) & (ARITH_CACHE_SLOTS - 1);
+        if (cache[i] == NULL) {             // another thread may have added it meanwhile
+            cache[i] = e;
+            cacheCount++;
+            *cached = true;
+        }
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return e;
+}
+
+static bool evaluate(const char *text, int64_t *result, int recursion);
+
+/**
+ * The function valueOf turns the value of a variable into a number. An unset or empty
+ * variable is 0; a value that is not a number is evaluated as an expression.
+ */
+static bool valueOf(const char *s, int64_t *value, int recursion) {
+    if (s == NULL) {
+        *value = 0;
+        return true;
+    }
+    while (isspace((unsigned char)*s))
+        s++;
+    char *end;
+    errno = 0;
+    *value = (int64_t)strtoll(s, &end, 0);
+    while (isspace((unsigned char)*end))
+        end++;
+    if (*end == '\0' && errno == 0)
+        return true;
+    if (recursion >= ARITH_MAX_RECURSION) {
+        printf("Error: arithmetic expression \"%s\" nests too deeply!\n", s);
+        return false;
+    }
+    return evaluate(s, value, recursion + 1);
+}
+
+static int64_t power(int64_t base, int64_t exponent) {
+    uint64_t result = 1, b = (uint64_t)base;
+    for (; exponent > 0; exponent >>= 1) {
+        if (exponent & 1)
+            result *= b;
+        b *= b;
+    }
+    return (int64_t)result;
+}
+
+/**
+ * The function run executes the code of \param e.
+ * @return a bool denoting whether it ran without errors such as division by zero.
+ */
+static bool run(const Expression *e, int64_t *result, int recursion) {
+    int64_t stack[ARITH_STACK_SIZE + 1];
+    int sp = 0;
+    char number[24];
+    for (int pc = 0; pc < e->length; pc++) {
+        const ArithInstruction *in = &e->code[pc];
+        int64_t a = sp >= 2 ? stack[sp - 2] : 0, b = sp >= 1 ? stack[sp - 1] : 0;
+        switch (in->op) {
+        case A_PUSH:
+            stack[sp++] = in->value;
+            continue;
+        case A_LOAD:
+            if (!valueOf(getVariable(in->name), &stack[sp++], recursion))
+                return false;
+            continue;
+        case A_PARAM:
+            if (!valueOf(positionalParameter((int)in->value), &stack[sp++], recursion))
+                return false;
+            continue;
+        case A_COUNT:
+            stack[sp++] = positionalCount();
+            continue;
+        case A_STATUS:
+            stack[sp++] = exitCode;
+            continue;
+        case A_STORE:
+            snprintf(number, sizeof(number), "%lld", (long long)b);
+            setVariable(in->name, number);
+            continue;
+        case A_POP:
+            sp--;
+            continue;
+        case A_NEG:
+            stack[sp - 1] = (int64_t)(0 - (uint64_t)b);
+            continue;
+        case A_NOT:
+            stack[sp - 1] = !b;
+            continue;
+        case A_BITNOT:
+            stack[sp - 1] = ~b;
+            continue;
+        case A_BOOL:
+            stack[sp - 1] = b != 0;
+            continue;
+        case A_JUMP:
+            pc = (int)in->value - 1;
+            continue;
+        case A_JUMP_IF_ZERO:
+        case A_JUMP_IF_NONZERO:
+            sp--;
+            if ((b == 0) == (in->op == A_JUMP_IF_ZERO))
+                pc = (int)in->value - 1;
+            continue;
+        default:
+            break;
+        }
+
+        int64_t r = 0;
+        switch (in->op) {
+        case A_MUL: r = (int64_t)((uint64_t)a * (uint64_t)b); break;
+        case A_ADD: r = (int64_t)((uint64_t)a + (uint64_t)b); break;
+        case A_SUB: r = (int64_t)((uint64_t)a - (uint64_t)b); break;
+        case A_DIV:
+        case A_MOD:
+            if (b == 0) {
+                printf("Error: division by zero in \"%s\"!\n", e->text);
+                return false;
+            }
+            if (b == -1)                            // INT64_MIN / -1 overflows
+                r = in->op == A_DIV ? (int64_t)(0 - (uint64_t)a) : 0;
+            else
+                r = in->op == A_DIV ? a / b : a % b;
+            break;
+        case A_POW:
+            if (b < 0) {
+                printf("Error: negative exponent in \"%s\"!\n", e->text);
+                return false;
+            }
+            r = power(a, b);
+            break;
+        case A_SHL: r = (int64_t)((uint64_t)a << (b & 63)); break;
+        case A_SHR: r = a >> (b & 63); break;
+        case A_LT: r = a < b; break;
+        case A_LE: r = a <= b; break;
+        case A_GT: r = a > b; break;
+        case A_GE: r = a >= b; break;
+        case A_EQ: r = a == b; break;
+        case A_NE: r = a != b; break;
+        case A_AND: r = a & b; break;
+        case A_XOR: r = a ^ b; break;
+        case A_OR: r = a | b; break;
+        default: break;
+        }
+        stack[--sp - 1] = r;
+    }
+    *result = stack[sp - 1];
+    return true;
+}
+
+static bool evaluate(const char *text, int64_t *result, int recursion) {
+    bool cached;
+    Expression *e = findExpression(text, &cached);
+    if (e == NULL)
+        return false;
+    bool ok = run(e, result, recursion);
+    if (!cached)
+        freeExpression(e);
+    return ok;
+}
+
+/**
+ * The function evaluateArithmetic evaluates the expression of $((\param text)).
+ * @param result set to the value of the expression.
+ * @return a bool denoting whether the expression was valid; an error has been printed
+ * when it was not.
+ */
+bool evaluateArithmetic(const char *text, int64_t *result) {
+    return evaluate(text, result, 0);
+}
@@ -0,0 +1,23 @@
+#ifndef ARITH_H
+#define ARITH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ARITH_STACK_SIZE 64         // deepest evaluation stack of an expression
+#define ARITH_CACHE_SLOTS 1024      // compiled expressions kept, by text
+#define ARITH_MAX_RECURSION 8       // variables whose value is an expression
+
+/*
+ * $((expression)) is evaluated with 64-bit signed integers that wrap around, with the
+ * operators of C (without ++ and --), ** for powers, and the assignments = += -= *= /=
+ * %= <<= >>= &= ^= |=. Names stand for shell variables, as do $name, ${name}, $0-$9,
+ * $# and $?; a variable whose value is not a number is evaluated as an expression.
+ *
+ * An expression is compiled once into code for a small stack machine and kept in a
+ * cache by its text, so a loop evaluates it again without parsing it.
+ */
+
+bool evaluateArithmetic(const char *text, int64_t *result);
+
+#endif
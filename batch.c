@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "scanner.h"
+#include "shell.h"
+#include "spawn.h"
+#include "stream.h"
+#include "batch.h"
+
+/*
+ * batch reads items (one per line, or separated by '\0' with -0) and runs a command
+ * with as many items appended to its arguments as the kernel accepts in one exec:
+ * ARG_MAX, less the environment, the fixed arguments and room for the path of the
+ * executable. Batches run one after the other, or up to -P at a time.
+ */
+
+#define BATCH_READ_SIZE (64 * 1024)
+#define MAX_PARALLEL 64
+
+typedef struct Batch {
+    char **fixed;               // command and its own arguments
+    int fixedCount;
+    size_t limit;               // bytes available for items in one exec
+    long maxItems;              // -n, 0 for no limit
+    int parallel;
+    int outFd;
+    int nullFd;
+
+    char *text;                 // items of the batch being collected, '\0'-terminated
+    size_t textLength;
+    size_t textCapacity;
+    size_t itemStart;           // start of the item being read
+    size_t *offsets;            // offsets of the collected items in text
+    long itemCount;
+    long offsetCapacity;
+    size_t size;                // exec cost of the collected items
+
+    char **argv;                // reused for every launch
+    long argvCapacity;
+
+    pid_t pgid;
+    pid_t pids[MAX_PARALLEL];
+    int pidfds[MAX_PARALLEL];
+    int running;
+
+    unsigned long items;
+    unsigned long launches;
+    size_t largest;
+    int status;
+    bool stop;                  // a command was interrupted or could not be started
+} Batch;
+
+static size_t itemCost(size_t length) {
+    return length + 1 + sizeof(char *);
+}
+
+/**
+ * The function recordStatus folds the exit status of a batch into the exit code of
+ * the builtin, like xargs: 123 if a command failed, 125 if one was killed by a
+ * signal, 127 if the command could not be run.
+ */
+static void recordStatus(Batch *b, int status) {
+    if (WIFSIGNALED(status)) {
+        b->status = 125;
+        b->stop = true;
+    } else if (WEXITSTATUS(status) == 127) {
+        b->status = 127;
+        b->stop = true;
+    } else if (WEXITSTATUS(status) != 0 && b->status == 0) {
+        b->status = 123;
+    }
+}
+
+/**
+ * The function waitOne waits until one of the running batches has finished. The
+ * batches are watched through pidfds, so only the builtin's own children are
+ * reaped and the exit of background jobs is left to the shell.
+ */
+static void waitOne(Batch *b) {
+    int done = 0;
+    struct pollfd fds[MAX_PARALLEL];
+    bool polled = true;
+    for (int i = 0; i < b->running; i++) {
+        fds[i].fd = b->pidfds[i];
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+        polled = polled && b->pidfds[i] != -1;
+    }
+    if (polled) {
+        while (poll(fds, b->running, -1) == -1 && errno == EINTR)
+            ;
+        while (done < b->running - 1 && fds[done].revents == 0)
+            done++;
+    }
+
+    int status;
+    while (waitpid(b->pids[done], &status, 0) == -1 && errno == EINTR)
+        ;
+    recordStatus(b, status);
+    if (b->pidfds[done] != -1)
+        close(b->pidfds[done]);
+    b->running--;
+    b->pids[done] = b->pids[b->running];
+    b->pidfds[done] = b->pidfds[b->running];
+}
+
+/**
+ * The function launch runs the command with the collected items, after waiting for a
+ * free slot. The items are copied into the child, so the buffers are reused at once.
+ */
+static void launch(Batch *b) {
+    if (b->itemCount == 0 || b->stop)
+        return;
+    while (b->running == b->parallel)
+        waitOne(b);
+    if (b->stop)
+        return;
+
+    long argc = b->fixedCount + b->itemCount;
+    if (argc + 1 > b->argvCapacity) {
+        b->argvCapacity = 2 * (argc + 1);
+        b->argv = realloc(b->argv, b->argvCapacity * sizeof(*b->argv));
+        assert(b->argv != NULL);
+    }
+    memcpy(b->argv, b->fixed, b->fixedCount * sizeof(*b->argv));
+    for (long i = 0; i < b->itemCount; i++)
+        b->argv[b->fixedCount + i] = b->text + b->offsets[i];
+    b->argv[argc] = NULL;
+
+    SpawnSpec spec = { b->argv, b->nullFd, b->outFd, STDERR_FILENO, b->pgid };
+    pid_t pid = spawnCommand(&spec);
+    if (pid == -1) {
+        perror("fork");
+        b->status = 126;
+        b->stop = true;
+        return;
+    }
+    if (b->pgid == 0) {
+        b->pgid = pid;
+        if (foregroundPID == -1)
+            foregroundPID = pid;            // Ctrl+C reaches the batches
+    }
+    setpgid(pid, b->pgid);
+    b->pids[b->running] = pid;
+    b->pidfds[b->running] = (int)syscall(SYS_pidfd_open, pid, 0);
+    b->running++;
+
+    b->launches++;
+    b->items += b->itemCount;
+    if (b->size > b->largest)
+        b->largest = b->size;
+}
+
+/**
+ * The function finishItem ends the item that is being read. When it does not fit in
+ * the current batch any more, the batch is launched first and the item moves to the
+ * start of the buffer.
+ */
+static void finishItem(Batch *b) {
+    size_t length = b->textLength - b->itemStart;
+    if (length == 0)
+        return;
+    if (length + 1 > MAX_ARGUMENT_LENGTH || itemCost(length) > b->limit) {
+        shellPrintf("Error: item of %zu bytes is too long for a command line!\n", length);
+        b->status = 2;
+        b->textLength = b->itemStart;
+        return;
+    }
+    if (b->size + itemCost(length) > b->limit || (b->maxItems > 0 && b->itemCount == b->maxItems)) {
+        launch(b);
+        memmove(b->text, b->text + b->itemStart, length);
+        b->itemStart = 0;
+        b->textLength = length;
+        b->itemCount = 0;
+        b->size = 0;
+    }
+    if (b->itemCount == b->offsetCapacity) {
+        b->offsetCapacity = b->offsetCapacity == 0 ? 1024 : 2 * b->offsetCapacity;
+        b->offsets = realloc(b->offsets, b->offsetCapacity * sizeof(*b->offsets));
+        assert(b->offsets != NULL);
+    }
+    b->offsets[b->itemCount++] = b->itemStart;
+    b->size += itemCost(length);
+    b->text[b->textLength++] = '\0';        // room is reserved by appendText
+    b->itemStart = b->textLength;
+}
+
+static void appendText(Batch *b, const char *s, size_t n) {
+    if (b->textLength + n + 1 > b->textCapacity) {
+        while (b->textLength + n + 1 > b->textCapacity)
+            b->textCapacity = b->textCapacity == 0 ? BATCH_READ_SIZE : 2 * b->textCapacity;
+        b->text = realloc(b->text, b->textCapacity);
+        assert(b->text != NULL);
+    }
+    memcpy(b->text + b->textLength, s, n);
+    b->textLength += n;
+}
+
+/**
+ * The function readItems reads the items from \param in and launches the batches as
+ * they fill up, so the first commands start while the input is still being read.
+ */
+static void readItems(Batch *b, Stream *in, char separator) {
+    char *chunk = malloc(BATCH_READ_SIZE);
+    assert(chunk != NULL);
+    ssize_t n;
+    while (!b->stop && (n = streamRead(in, chunk, BATCH_READ_SIZE)) > 0) {
+        char *p = chunk, *end = chunk + n;
+        while (p < end) {
+            char *sep = memchr(p, separator, end - p);
+            appendText(b, p, (sep == NULL ? end : sep) - p);
+            if (sep == NULL)
+                break;
+            finishItem(b);
+            p = sep + 1;
+        }
+    }
+    finishItem(b);
+    free(chunk);
+}
+
+static bool parseCount(char *s, long max, long *value) {
+    char *endptr;
+    *value = s == NULL ? -1 : strtol(s, &endptr, 10);
+    return s != NULL && *endptr == '\0' && *value >= 0 && *value <= max;
+}
+
+/**
+ * The function command_batch is one of the built-in commands of the shell.
+ *
+ *     batch [-0] [-a file] [-n max] [-P n] [-v] [command [argument...]]
+ *
+ * Runs the command (default echo) over the items read from stdin or from the file,
+ * packing as many items into every exec as fit. -n caps the items per exec, -P runs up
+ * to n batches at a time (0: one per CPU) and -v reports the batches on stderr.
+ * @return the exit code of the command.
+ */
+int command_batch(int argc, char **argv) {
+    static char *defaultCommand[] = { "echo", NULL };
+    Batch b;
+    memset(&b, 0, sizeof(b));
+    b.parallel = 1;
+    char separator = '\n';
+    char *file = NULL;
+    bool verbose = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        long value;
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-0") == 0) {
+            separator = '\0';
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            file = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && parseCount(argv[i + 1], LONG_MAX, &value) && value > 0) {
+            b.maxItems = value;
+            i++;
+        } else if (strcmp(argv[i], "-P") == 0 && parseCount(argv[i + 1], MAX_PARALLEL, &value)) {
+            b.parallel = value == 0 ? (int)sysconf(_SC_NPROCESSORS_ONLN) : (int)value;
+            b.parallel = b.parallel < 1 ? 1 : b.parallel > MAX_PARALLEL ? MAX_PARALLEL : b.parallel;
+            i++;
+        } else {
+            shellPrintf("Error: usage: batch [-0] [-a file] [-n max] [-P n] [-v] [command [argument...]]!\n");
+            return 2;
+        }
+    }
+    b.fixed = i < argc ? argv + i : defaultCommand;
+    b.fixedCount = i < argc ? argc - i : 1;
+
+    if (shellOut->kind != STREAM_FD) {
+        shellPrintf("Error: batch cannot write into a builtin!\n");
+        return 2;
+    }
+    b.outFd = shellOut->fd;
+
+    size_t fixedSize = 0;
+    for (int j = 0; j < b.fixedCount; j++)
+        fixedSize += itemCost(strlen(b.fixed[j]));
+    size_t available = argumentLimit();
+    fixedSize += PATH_MAX;                  // the kernel also copies the path of the executable
+    b.limit = available > fixedSize ? available - fixedSize : 0;
+
+    Stream input = *shellIn;
+    if (file != NULL) {
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            shellPrintf("Error: cannot open %s!\n", file);
+            return 2;
+        }
+        input = fdStream(fd, false);
+    }
+    b.nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // The batches are reaped here; keep the SIGCHLD handler of the shell from taking them.
+    sigset_t blockChild, saved;
+    sigemptyset(&blockChild);
+    sigaddset(&blockChild, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &blockChild, &saved);
+
+    readItems(&b, &input, separator);
+    launch(&b);
+    while (b.running > 0)
+        waitOne(&b);
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (b.pgid != 0 && foregroundPID == b.pgid)
+        foregroundPID = -1;
+
+    if (verbose)
+        fprintf(stderr, "batch: %lu items in %lu launches, largest batch %zu of %zu bytes\n",
+                b.items, b.launches, b.largest, b.limit);
+    if (file != NULL)
+        streamClose(&input);
+    if (b.nullFd != -1)
+        close(b.nullFd);
+    free(b.text);
+    free(b.offsets);
+    free(b.argv);
+    return b.status;
+}
@@ -0,0 +1,6 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+int command_batch(int argc, char **argv);
+
+#endif
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+/*
+ * A compiled script is stored as one flat file that is mapped back as a whole:
+ *
+ *     CacheHeader | CachedInstruction[length] | uint32_t tokens[tokenCount]
+ *                 | uint32_t words[wordCount] | char strings[stringsSize]
+ *
+ * tokens and words hold offsets into strings (the script path comes first). The
+ * tokens of a command are consecutive, a word list ends with NO_STRING. Loading only
+ * allocates three arrays that point into the mapping, whatever the size of the script.
+ */
+
+#define CACHE_MAGIC 0x43424853              // "SHBC"
+#define CACHE_VERSION 4
+#define NO_STRING UINT32_MAX
+
+typedef struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t hash;
+    uint32_t length;
+    uint32_t forSlots;
+    uint32_t caseSlots;
+    uint32_t tokenCount;
+    uint32_t wordCount;
+    uint32_t stringsSize;
+} CacheHeader;
+
+typedef struct CachedInstruction {
+    uint32_t op;
+    int32_t target;
+    int32_t slot;
+    uint32_t command;                       // index of the first token
+    uint32_t commandLength;
+    uint32_t words;                         // index of the first word, or NO_STRING
+    uint32_t name;                          // offset of the name, or NO_STRING
+} CachedInstruction;
+
+typedef struct Buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static uint64_t hashBytes(uint64_t h, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;              // 64-bit FNV-1a
+    }
+    return h;
+}
+
+#define HASH_SEED 14695981039346656037ULL
+
+/**
+ * The function cacheDirectory finds the directory of the script cache: $SHELL_CACHE_DIR,
+ * $XDG_CACHE_HOME/shell or ~/.cache/shell.
+ * @return a bool denoting whether there is a cache directory.
+ */
+static bool cacheDirectory(char *dir, size_t size) {
+    char *s;
+    int n;
+    if ((s = getenv("SHELL_CACHE_DIR")) != NULL)
+        n = snprintf(dir, size, "%s", s);
+    else if ((s = getenv("XDG_CACHE_HOME")) != NULL && *s != '\0')
+        n = snprintf(dir, size, "%s/shell", s);
+    else if ((s = getenv("HOME")) != NULL && *s != '\0')
+        n = snprintf(dir, size, "%s/.cache/shell", s);
+    else
+        return false;
+    return n > 0 && (size_t)n < size;
+}
+
+/**
+ * The function makeScriptKey fills in the key of a script.
+ * @param st the status of the script file.
+ * @param text the contents of the script, st->st_size bytes.
+ */
+void makeScriptKey(ScriptKey *key, const char *path, const struct stat *st, const char *text) {
+    if (realpath(path, key->path) == NULL)
+        snprintf(key->path, sizeof(key->path), "%s", path);
+    key->size = st->st_size;
+    key->mtimeSec = st->st_mtim.tv_sec;
+    key->mtimeNsec = st->st_mtim.tv_nsec;
+    key->hash = hashBytes(HASH_SEED, text, st->st_size);
+
+    char dir[PATH_MAX - 32];
+    key->cacheFile[0] = '\0';
+    if (cacheDirectory(dir, sizeof(dir))) {
+        unsigned long long name = hashBytes(HASH_SEED, key->path, strlen(key->path));
+        snprintf(key->cacheFile, sizeof(key->cacheFile), "%s/%016llx.shc", dir, name);
+    }
+}
+
+static void *append(Buffer *b, const void *data, size_t n) {
+    if (b->length + n > b->capacity) {
+        while (b->length + n > b->capacity)
+            b->capacity = b->capacity == 0 ? 4096 : 2 * b->capacity;
+        b->data = realloc(b->data, b->capacity);
+        assert(b->data != NULL);
+    }
+    void *p = b->data + b->length;
+    memcpy(p, data, n);
+    b->length += n;
+    return p;
+}
+
+typedef struct StringTable {                // strings of a cache file, each stored once
+    Buffer data;
+    uint32_t *slots;                        // offset + 1 of the string in data, 0 if empty
+    size_t slotCount;
+    size_t used;
+} StringTable;
+
+static uint32_t *findString(StringTable *t, const char *s, size_t n) {
+    size_t i = hashBytes(HASH_SEED, s, n) & (t->slotCount - 1);
+    while (t->slots[i] != 0 && strcmp(t->data.data + t->slots[i] - 1, s) != 0)
+        i = (i + 1) & (t->slotCount - 1);
+    return &t->slots[i];
+}
+
+/**
+ * The function appendString adds \param s to the strings of a cache file, unless it is
+ * there already; scripts repeat the same words over and over.
+ * @return the offset of the string.
+ */
+static uint32_t appendString(StringTable *t, const char *s) {
+    if (2 * (t->used + 1) > t->slotCount) {
+        uint32_t *old = t->slots;
+        size_t oldCount = t->slotCount;
+        t->slotCount = oldCount == 0 ? 1024 : 2 * oldCount;
+        t->slots = calloc(t->slotCount, sizeof(*t->slots));
+        assert(t->slots != NULL);
+        for (size_t i = 0; i < oldCount; i++) {
+            if (old[i] != 0) {
+                char *o = t->data.data + old[i] - 1;
+                *findString(t, o, strlen(o)) = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t n = strlen(s);
+    uint32_t *slot = findString(t, s, n);
+    if (*slot == 0) {
+        *slot = t->data.length + 1;
+        append(&t->data, s, n + 1);
+        t->used++;
+    }
+    return *slot - 1;
+}
+
+static void appendIndex(Buffer *b, uint32_t index) {
+    append(b, &index, sizeof(index));
+}
+
+static void makeDirectories(char *dir) {
+    for (char *p = dir + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(dir, 0700);
+            *p = '/';
+        }
+    }
+    mkdir(dir, 0700);
+}
+
+/**
+ * The function saveCachedProgram stores \param program in the cache. The file is written
+ * under a temporary name and renamed, so a concurrent run maps either the old or the new
+ * file and never a partial one. Failing to write the cache is not an error.
+ */
+void saveCachedProgram(const ScriptKey *key, Program *program) {
+    if (key->cacheFile[0] == '\0')
+        return;
+
+    Buffer code = {0}, tokens = {0}, words = {0};
+    StringTable strings = {{0}};
+    CacheHeader header = { CACHE_MAGIC, CACHE_VERSION, key->size, key->mtimeSec, key->mtimeNsec, key->hash,
+                           program->length, program->forSlots, program->caseSlots, 0, 0, 0 };
+    appendString(&strings, key->path);
+
+    for (int i = 0; i < program->length; i++) {
+        Instruction *in = &program->code[i];
+        CachedInstruction ci = { in->op, in->target, in->slot, tokens.length / sizeof(uint32_t), 0, NO_STRING, NO_STRING };
+        for (List l = in->command; l != NULL; l = l->next) {
+            appendIndex(&tokens, appendString(&strings, l->t));
+            ci.commandLength++;
+        }
+        if (in->words != NULL) {
+            ci.words = words.length / sizeof(uint32_t);
+            for (int j = 0; in->words[j] != NULL; j++)
+                appendIndex(&words, appendString(&strings, in->words[j]));
+            appendIndex(&words, NO_STRING);
+        }
+        if (in->name != NULL)
+            ci.name = appendString(&strings, in->name);
+        append(&code, &ci, sizeof(ci));
+    }
+    header.tokenCount = tokens.length / sizeof(uint32_t);
+    header.wordCount = words.length / sizeof(uint32_t);
+    header.stringsSize = strings.data.length;
+
+    char dir[PATH_MAX], temp[PATH_MAX + 32];
+    snprintf(dir, sizeof(dir), "%s", key->cacheFile);
+    *strrchr(dir, '/') = '\0';
+    makeDirectories(dir);
+    snprintf(temp, sizeof(temp), "%s.%d", key->cacheFile, (int)getpid());
+
+    FILE *file = fopen(temp, "we");
+    if (file != NULL) {
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+                  && fwrite(code.data, 1, code.length, file) == code.length
+                  && fwrite(tokens.data, 1, tokens.length, file) == tokens.length
+                  && fwrite(words.data, 1, words.length, file) == words.length
+                  && fwrite(strings.data.data, 1, strings.data.length, file) == strings.data.length;
+        if (fclose(file) == 0 && ok)
+            rename(temp, key->cacheFile);
+        else
+            unlink(temp);
+    }
+    free(code.data);
+    free(tokens.data);
+    free(words.data);
+    free(strings.data.data);
+    free(strings.slots);
+}
+
+/**
+ * The function buildProgram turns a mapped cache file into a program. Every index and
+ * offset is checked, so a damaged file is rejected instead of being run.
+ * @return the program, or NULL if the file is not valid.
+ */
+static Program *buildProgram(char *base, const CacheHeader *h) {
+    CachedInstruction *code = (CachedInstruction *)(base + sizeof(*h));
+    uint32_t *tokens = (uint32_t *)(code + h->length);
+    uint32_t *words = tokens + h->tokenCount;
+    char *strings = (char *)(words + h->wordCount);
+
+    if (h->stringsSize == 0 || strings[h->stringsSize - 1] != '\0')
+        return NULL;
+
+    Program *p = calloc(1, sizeof(*p));
+    assert(p != NULL);
+    p->code = calloc(h->length + 1, sizeof(*p->code));
+    p->nodes = calloc(h->tokenCount + 1, sizeof(*p->nodes));
+    p->wordTable = calloc(h->wordCount + 1, sizeof(*p->wordTable));
+    assert(p->code != NULL && p->nodes != NULL && p->wordTable != NULL);
+    p->length = p->capacity = h->length;
+    p->forSlots = h->forSlots;
+    p->caseSlots = h->caseSlots;
+
+    bool ok = true;
+    for (uint32_t i = 0; i < h->tokenCount && ok; i++) {
+        ok = tokens[i] < h->stringsSize;
+        p->nodes[i].t = strings + tokens[i];
+    }
+    for (uint32_t i = 0; i < h->wordCount && ok; i++) {
+        ok = words[i] == NO_STRING || words[i] < h->stringsSize;
+        p->wordTable[i] = words[i] == NO_STRING ? NULL : strings + words[i];
+    }
+    for (uint32_t i = 0; i < h->length && ok; i++) {
+        CachedInstruction *ci = &code[i];
+        Instruction *in = &p->code[i];
+        bool loopSlot = ci->op == OP_FOR_INIT || ci->op == OP_FOR_NEXT || ci->op == OP_SAVE_STATUS
+                        || ci->op == OP_LOAD_STATUS;
+        uint32_t slots = loopSlot ? h->forSlots : h->caseSlots;
+        ok = ci->op <= OP_LOAD_STATUS && ci->target >= 0 && (uint32_t)ci->target <= h->length
+             && ci->slot >= 0 && (ci->slot == 0 || (uint32_t)ci->slot < slots)
+             && ci->command <= h->tokenCount && ci->commandLength <= h->tokenCount - ci->command
+             && (ci->words == NO_STRING || ci->words < h->wordCount)
+             && (ci->name == NO_STRING || ci->name < h->stringsSize);
+        if (!ok)
+            break;
+
+        in->op = ci->op;
+        in->target = ci->target;
+        in->slot = ci->slot;
+        if (ci->commandLength > 0) {
+            in->command = &p->nodes[ci->command];
+            for (uint32_t j = 0; j + 1 < ci->commandLength; j++)
+                in->command[j].next = &in->command[j + 1];
+        }
+        if (ci->words != NO_STRING) {
+            in->words = &p->wordTable[ci->words];
+            uint32_t j = ci->words;
+            while (j < h->wordCount && words[j] != NO_STRING)
+                j++;
+            ok = j < h->wordCount;
+        }
+        in->name = ci->name == NO_STRING ? NULL : strings + ci->name;
+    }
+    if (!ok) {
+        free(p->code);
+        free(p->nodes);
+        free(p->wordTable);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * The function loadCachedProgram maps the cached program of the script of \param key.
+ * The mapping is private and writable, as expanding a word briefly modifies it.
+ * @return the program, or NULL if the cache does not hold the current version of the script.
+ */
+Program *loadCachedProgram(const ScriptKey *key) {
+    if (key->cacheFile[0] == '\0')
+        return NULL;
+    int fd = open(key->cacheFile, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    CacheHeader *h = (CacheHeader *)base;
+    uint64_t expected = sizeof(*h) + (uint64_t)h->length * sizeof(CachedInstruction)
+                        + ((uint64_t)h->tokenCount + h->wordCount) * sizeof(uint32_t) + h->stringsSize;
+    char *path = base + st.st_size - h->stringsSize;       // first of the strings
+    Program *program = NULL;
+    if (h->magic == CACHE_MAGIC && h->version == CACHE_VERSION && expected == (uint64_t)st.st_size
+        && h->size == key->size && h->mtimeSec == key->mtimeSec && h->mtimeNsec == key->mtimeNsec
+        && h->hash == key->hash && strnlen(path, h->stringsSize) < h->stringsSize && strcmp(path, key->path) == 0)
+        program = buildProgram(base, h);
+    if (program == NULL) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    program->mapping = base;
+    program->mappingSize = st.st_size;
+    return program;
+}
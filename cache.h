@@ -0,0 +1,26 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "script.h"
+
+/*
+ * Identifies the contents of a script: a cached program is only used when the path,
+ * size, modification time and hash of the contents all match.
+ */
+typedef struct ScriptKey {
+    char path[PATH_MAX];            // absolute path of the script
+    char cacheFile[PATH_MAX];       // empty when there is no cache directory
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t hash;
+} ScriptKey;
+
+void makeScriptKey(ScriptKey *key, const char *path, const struct stat *st, const char *text);
+Program *loadCachedProgram(const ScriptKey *key);
+void saveCachedProgram(const ScriptKey *key, Program *program);
+
+#endif
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include "stream.h"
+#include "capture.h"
+
+typedef struct CapturedJob {
+    int index;                  // job index, 0 for a free slot
+    int fd;                     // read end of the pipe, -1 once every writer closed it
+    char *ring;                 // CAPTURE_RING_SIZE bytes of a memfd, mapped twice in a row
+    uint64_t head;              // bytes captured so far
+} CapturedJob;
+
+bool captureOutput = false;
+
+static CapturedJob capturedJobs[MAX_CAPTURED_JOBS];
+static pthread_mutex_t captureLock = PTHREAD_MUTEX_INITIALIZER;
+static int epollFd = -1;
+
+/**
+ * The function mapRing maps a memfd of CAPTURE_RING_SIZE bytes twice, back to back.
+ * Any CAPTURE_RING_SIZE bytes starting inside the first mapping are contiguous, so the
+ * pipe is read straight into the ring and the ring is shown without wrapping around.
+ * @return the start of the ring, or NULL if it could not be mapped.
+ */
+static char *mapRing() {
+    int fd = memfd_create("job-output", MFD_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    char *base = MAP_FAILED;
+    if (ftruncate(fd, CAPTURE_RING_SIZE) == 0)
+        base = mmap(NULL, 2 * CAPTURE_RING_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED
+        && (mmap(base, CAPTURE_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+            || mmap(base + CAPTURE_RING_SIZE, CAPTURE_RING_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        munmap(base, 2 * CAPTURE_RING_SIZE);
+        base = MAP_FAILED;
+    }
+    close(fd);
+    return base == MAP_FAILED ? NULL : base;
+}
+
+static void closeCapture(CapturedJob *job) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, job->fd, NULL);
+    close(job->fd);
+    job->fd = -1;
+}
+
+/**
+ * The function drainJob moves what is in the pipe of \param job into its ring, which
+ * drops the oldest output once it is full. Called with captureLock held.
+ */
+static void drainJob(CapturedJob *job) {
+    if (job->fd == -1)
+        return;
+    ssize_t n = read(job->fd, job->ring + job->head % CAPTURE_RING_SIZE, CAPTURE_RING_SIZE);
+    if (n > 0)
+        job->head += n;
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        closeCapture(job);
+}
+
+static void *drainCaptures(void *arg) {
+    struct epoll_event events[MAX_CAPTURED_JOBS];
+    while (true) {
+        int n = epoll_wait(epollFd, events, MAX_CAPTURED_JOBS, -1);
+        for (int i = 0; i < n; i++) {
+            pthread_mutex_lock(&captureLock);
+            drainJob(&capturedJobs[events[i].data.u32]);
+            pthread_mutex_unlock(&captureLock);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The function startDrainThread starts the thread that drains the pipes of all
+ * captured jobs. It blocks every signal, so SIGCHLD and SIGINT stay with the shell.
+ */
+static bool startDrainThread() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+        return false;
+    for (int i = 0; i < MAX_CAPTURED_JOBS; i++)
+        capturedJobs[i].fd = -1;                // no slot is in use yet
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    pthread_t thread;
+    bool started = pthread_create(&thread, NULL, drainCaptures, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (!started) {
+        close(epollFd);
+        epollFd = -1;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/**
+ * The function chooseSlot finds a slot for a new captured job: a free one, or else the
+ * one of the oldest job that has finished writing.
+ */
+static CapturedJob *chooseSlot() {
+    CapturedJob *oldest = NULL;
+    for (int i = 0; i < MAX_CAPTURED_JOBS; i++) {
+        CapturedJob *job = &capturedJobs[i];
+        if (job->index == 0)
+            return job;
+        if (job->fd == -1 && (oldest == NULL || job->index < oldest->index))
+            oldest = job;
+    }
+    return oldest;
+}
+
+/**
+ * The function startCapture starts capturing the output of background job \param index.
+ * @return the write end of the pipe to give the job as stdout and stderr (close-on-exec,
+ * the caller closes it once the job has been started), or -1 if the output cannot be
+ * captured, in which case the job writes to the terminal.
+ */
+int startCapture(int index) {
+    pthread_mutex_lock(&captureLock);
+    CapturedJob *job = chooseSlot();
+    int pipefd[2] = { -1, -1 };
+    if (job == NULL)
+        printf("Error: more than %d jobs are writing captured output!\n", MAX_CAPTURED_JOBS);
+    else if ((epollFd == -1 && !startDrainThread())
+             || (job->ring == NULL && (job->ring = mapRing()) == NULL)
+             || pipe2(pipefd, O_CLOEXEC) == -1)
+        perror("capture");
+    else {
+        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);      // the job's end stays blocking
+        struct epoll_event event = { EPOLLIN, { .u32 = (uint32_t)(job - capturedJobs) } };
+        job->index = index;
+        job->fd = pipefd[0];
+        job->head = 0;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, pipefd[0], &event) == -1) {
+            perror("capture");
+            closeCapture(job);
+            job->index = 0;
+            close(pipefd[1]);
+            pipefd[1] = -1;
+        }
+    }
+    pthread_mutex_unlock(&captureLock);
+    return pipefd[1];
+}
+
+static CapturedJob *findCapture(int index) {
+    for (int i = 0; i < MAX_CAPTURED_JOBS && index > 0; i++) {
+        if (capturedJobs[i].index == index)     // a free slot has index 0
+            return &capturedJobs[i];
+    }
+    return NULL;
+}
+
+/**
+ * The function dropCapture stops capturing for a job that could not be started.
+ */
+void dropCapture(int index) {
+    pthread_mutex_lock(&captureLock);
+    CapturedJob *job = findCapture(index);
+    if (job != NULL) {
+        if (job->fd != -1)
+            closeCapture(job);
+        job->index = 0;
+    }
+    pthread_mutex_unlock(&captureLock);
+}
+
+/**
+ * The function command_capture is one of the built-in commands of the shell.
+ *
+ *     capture [on | off]
+ *
+ * Sets whether the output of background jobs started from now on is captured, or
+ * prints the setting.
+ * @return the exit code of the command.
+ */
+int command_capture(int argc, char **argv) {
+    if (argc < 2) {
+        shellPrintf("Capturing output of background jobs: %s\n", captureOutput ? "on" : "off");
+        return 0;
+    }
+    if (argc == 2 && (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0)) {
+        captureOutput = strcmp(argv[1], "on") == 0;
+        return 0;
+    }
+    shellPrintf("Error: usage: capture [on | off]!\n");
+    return 2;
+}
+
+/**
+ * The function command_output is one of the built-in commands of the shell.
+ *
+ *     output [%index]
+ *
+ * Prints the captured output of a background job (the last CAPTURE_RING_SIZE bytes),
+ * or lists the jobs whose output is captured.
+ * @return the exit code of the command.
+ */
+int command_output(int argc, char **argv) {
+    if (argc < 2) {
+        pthread_mutex_lock(&captureLock);
+        for (int i = 0; i < MAX_CAPTURED_JOBS; i++) {
+            CapturedJob *job = &capturedJobs[i];
+            if (job->index != 0)
+                shellPrintf("Job %d: %llu bytes of output%s\n", job->index, (unsigned long long)job->head,
+                            job->fd == -1 ? ", done" : "");
+        }
+        pthread_mutex_unlock(&captureLock);
+        return 0;
+    }
+    char *s = argv[1][0] == '%' ? argv[1] + 1 : argv[1], *end;
+    long index = strtol(s, &end, 10);
+    if (argc > 2 || *s == '\0' || *end != '\0' || index < 1) {
+        shellPrintf("Error: usage: output [%%index]!\n");
+        return 2;
+    }
+
+    char *text = malloc(CAPTURE_RING_SIZE);
+    if (text == NULL) {
+        perror("output");
+        return 1;
+    }
+    uint64_t total = 0, length = 0;
+    pthread_mutex_lock(&captureLock);
+    CapturedJob *job = findCapture((int)index);
+    if (job != NULL) {
+        drainJob(job);                          // include what the job wrote just now
+        total = job->head;
+        length = total < CAPTURE_RING_SIZE ? total : CAPTURE_RING_SIZE;
+        memcpy(text, job->ring + (total - length) % CAPTURE_RING_SIZE, length);
+    }
+    pthread_mutex_unlock(&captureLock);
+    if (job == NULL) {
+        free(text);
+        shellPrintf("Error: no captured output for job %ld!\n", index);
+        return 1;
+    }
+    if (total > length)
+        shellPrintf("[%llu earlier bytes dropped]\n", (unsigned long long)(total - length));
+    shellPrintf("%.*s", (int)length, text);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+
+#define CAPTURE_RING_SIZE (64 * 1024)   // per job, a multiple of the page size
+#define MAX_CAPTURED_JOBS 16
+
+/*
+ * With capturing on, the stdout and stderr of a background job go into a pipe that a
+ * thread of the shell drains into a ring buffer of its own, keeping the last
+ * CAPTURE_RING_SIZE bytes. The job never waits for the terminal, and its output does
+ * not interleave with that of the shell or of other jobs; "output N" shows it.
+ */
+extern bool captureOutput;
+
+int startCapture(int index);
+void dropCapture(int index);
+int command_capture(int argc, char **argv);
+int command_output(int argc, char **argv);
+
+#endif
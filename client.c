@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+
+/*
+ * shell-client sends one input line to a shell running in server mode and exits
+ * with the exit code of that line. The client's stdin, stdout and stderr are
+ * passed along, so the command behaves as if it was started from here.
+ *
+ * Usage: shell-client [-s socket] -c "input line"
+ *        shell-client [-s socket] word...
+ */
+
+static void usage() {
+    fprintf(stderr, "Usage: shell-client [-s socket] -c \"input line\" | word...\n");
+    exit(2);
+}
+
+static bool writeFully(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * The function joinWords joins the command line arguments into one input line.
+ */
+static char *joinWords(int count, char **words) {
+    size_t length = 1;
+    for (int i = 0; i < count; i++)
+        length += strlen(words[i]) + 1;
+
+    char *line = malloc(length);
+    if (line == NULL)
+        return NULL;
+    line[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0)
+            strcat(line, " ");
+        strcat(line, words[i]);
+    }
+    return line;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    defaultSocketPath(addr.sun_path, sizeof(addr.sun_path));
+
+    char *line = NULL;
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            line = argv[++i];
+        } else {
+            break;
+        }
+    }
+    if (line == NULL) {
+        if (i >= argc)
+            usage();
+        line = joinWords(argc - i, argv + i);
+    } else if (i < argc) {
+        usage();
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("shell-client: connect");
+        return 1;
+    }
+
+    RequestHeader header = { SERVER_PROTOCOL_VERSION, strlen(line) };
+    if (header.length > MAX_REQUEST_LENGTH) {
+        fprintf(stderr, "shell-client: input line too long\n");
+        return 2;
+    }
+
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(header) || !writeFully(sock, line, header.length)) {
+        perror("shell-client: send");
+        return 1;
+    }
+
+    ResponseMessage response;
+    size_t got = 0;
+    while (got < sizeof(response)) {
+        ssize_t n = read(sock, (char *)&response + got, sizeof(response) - got);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "shell-client: no exit code received\n");
+            return 1;
+        }
+        got += n;
+    }
+    close(sock);
+    return response.exitCode;
+}
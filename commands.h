@@ -4,6 +4,6 @@
 #include "scanner.h"
 #include "shell.h"
 
-int cd(List *lp);
+int cd(int argc, char **argv);
 
 #endif
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "scanner.h"
+#include "shell.h"
+#include "complete.h"
+
+/*
+ * Executables found on PATH are kept in a prefix trie. The trie is built on
+ * the first completion request and refreshed per directory afterwards: a
+ * PATH directory is only rescanned when its modification time changes, so
+ * a completion normally costs one stat per PATH entry plus a walk of the
+ * prefix, independent of the number of executables.
+ */
+
+typedef struct TrieNode {
+    struct TrieNode *child;     // first child, children are sorted by character
+    struct TrieNode *sibling;
+    unsigned int refs;          // number of PATH directories providing the word ending here
+    unsigned int words;         // number of distinct words in this subtree
+    char c;
+} TrieNode;
+
+typedef struct PathDir {
+    char *path;
+    struct stat st;             // dev/ino/mtime at the time of the last scan
+    bool scanned;
+    bool seen;
+    char **names;
+    int nameCount;
+} PathDir;
+
+static TrieNode trieRoot;
+static PathDir *pathDirs = NULL;
+static int pathDirCount = 0;
+static char *indexedPath = NULL;
+
+/**
+ * The function trieChild looks up the child of \param node for character \param c.
+ * @param node parent node.
+ * @param c character of the edge.
+ * @param create whether a missing child should be created.
+ * @return the child node, or NULL if it does not exist and \param create is false.
+ */
+static TrieNode *trieChild(TrieNode *node, char c, bool create) {
+    TrieNode **link = &node->child;
+    while (*link != NULL && (unsigned char)(*link)->c < (unsigned char)c)
+        link = &(*link)->sibling;
+    if (*link != NULL && (*link)->c == c)
+        return *link;
+    if (!create)
+        return NULL;
+
+    TrieNode *n = calloc(1, sizeof(*n));
+    assert(n != NULL);
+    n->c = c;
+    n->sibling = *link;
+    *link = n;
+    return n;
+}
+
+/**
+ * The function trieFind returns the node reached by walking \param s from the root.
+ * @param s the prefix to look up.
+ * @return the node, or NULL when no word starts with \param s.
+ */
+static TrieNode *trieFind(const char *s) {
+    TrieNode *node = &trieRoot;
+    for (; *s != '\0' && node != NULL; s++)
+        node = trieChild(node, *s, false);
+    return node;
+}
+
+/**
+ * The function trieAdjust adds \param delta to the word count of every node on the path of \param s.
+ */
+static void trieAdjust(const char *s, int delta) {
+    TrieNode *node = &trieRoot;
+    node->words += delta;
+    for (; *s != '\0'; s++) {
+        node = trieChild(node, *s, false);
+        node->words += delta;
+    }
+}
+
+static void trieInsert(const char *s) {
+    TrieNode *node = &trieRoot;
+    for (const char *p = s; *p != '\0'; p++)
+        node = trieChild(node, *p, true);
+    if (node->refs++ == 0)
+        trieAdjust(s, 1);
+}
+
+static void trieRemove(const char *s) {
+    TrieNode *node = trieFind(s);
+    if (node == NULL || node->refs == 0)
+        return;
+    if (--node->refs == 0)
+        trieAdjust(s, -1);
+}
+
+static void trieFree(TrieNode *node) {
+    while (node != NULL) {
+        TrieNode *next = node->sibling;
+        trieFree(node->child);
+        free(node);
+        node = next;
+    }
+}
+
+/**
+ * The function unindexDir removes the executables of a PATH directory from the trie.
+ * @param dir the directory whose names are removed.
+ */
+static void unindexDir(PathDir *dir) {
+    for (int i = 0; i < dir->nameCount; i++) {
+        trieRemove(dir->names[i]);
+        free(dir->names[i]);
+    }
+    free(dir->names);
+    dir->names = NULL;
+    dir->nameCount = 0;
+    dir->scanned = false;
+}
+
+/**
+ * The function indexDir scans a PATH directory and adds its executables to the trie.
+ * @param dir the directory to scan.
+ */
+static void indexDir(PathDir *dir) {
+    DIR *d = opendir(dir->path);
+    if (d == NULL)
+        return;
+
+    int capacity = 64;
+    dir->names = malloc(capacity * sizeof(*dir->names));
+    assert(dir->names != NULL);
+
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR)
+            continue;
+        if (fstatat(dirfd(d), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || (st.st_mode & 0111) == 0)
+            continue;
+        if (dir->nameCount >= capacity) {
+            capacity *= 2;
+            dir->names = realloc(dir->names, capacity * sizeof(*dir->names));
+            assert(dir->names != NULL);
+        }
+        dir->names[dir->nameCount] = strdup(entry->d_name);
+        assert(dir->names[dir->nameCount] != NULL);
+        trieInsert(dir->names[dir->nameCount++]);
+    }
+    closedir(d);
+    dir->scanned = true;
+}
+
+/**
+ * The function syncPathDirs makes the directory table match the entries of \param path.
+ * Directories that left PATH are unindexed, new ones are added unscanned.
+ */
+static void syncPathDirs(const char *path) {
+    for (int i = 0; i < pathDirCount; i++)
+        pathDirs[i].seen = false;
+
+    char *copy = strdup(path);
+    assert(copy != NULL);
+    char *rest = copy;
+    char *entry;
+    while ((entry = strsep(&rest, ":")) != NULL) {
+        const char *dirName = *entry == '\0' ? "." : entry;
+        int i;
+        for (i = 0; i < pathDirCount && strcmp(pathDirs[i].path, dirName) != 0; i++)
+            ;
+        if (i < pathDirCount) {
+            pathDirs[i].seen = true;
+            continue;
+        }
+        pathDirs = realloc(pathDirs, (pathDirCount + 1) * sizeof(*pathDirs));
+        assert(pathDirs != NULL);
+        memset(&pathDirs[pathDirCount], 0, sizeof(*pathDirs));
+        pathDirs[pathDirCount].path = strdup(dirName);
+        pathDirs[pathDirCount].seen = true;
+        pathDirCount++;
+    }
+    free(copy);
+
+    int kept = 0;
+    for (int i = 0; i < pathDirCount; i++) {
+        if (pathDirs[i].seen) {
+            pathDirs[kept++] = pathDirs[i];
+        } else {
+            unindexDir(&pathDirs[i]);
+            free(pathDirs[i].path);
+        }
+    }
+    pathDirCount = kept;
+
+    free(indexedPath);
+    indexedPath = strdup(path);
+}
+
+/**
+ * The function refreshExecutableIndex brings the trie up to date with PATH.
+ * Only directories that changed since they were last scanned are rescanned.
+ */
+static void refreshExecutableIndex() {
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "";
+    if (indexedPath == NULL || strcmp(indexedPath, path) != 0)
+        syncPathDirs(path);
+
+    struct stat st;
+    for (int i = 0; i < pathDirCount; i++) {
+        PathDir *dir = &pathDirs[i];
+        if (stat(dir->path, &st) != 0) {
+            if (dir->scanned)
+                unindexDir(dir);
+            continue;
+        }
+        if (dir->scanned && st.st_dev == dir->st.st_dev && st.st_ino == dir->st.st_ino
+            && st.st_mtim.tv_sec == dir->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == dir->st.st_mtim.tv_nsec)
+            continue;
+        if (dir->scanned)
+            unindexDir(dir);
+        dir->st = st;
+        indexDir(dir);
+    }
+}
+
+/**
+ * The function freeExecutableIndex releases the trie and the PATH directory table.
+ */
+void freeExecutableIndex() {
+    for (int i = 0; i < pathDirCount; i++) {
+        unindexDir(&pathDirs[i]);
+        free(pathDirs[i].path);
+    }
+    free(pathDirs);
+    pathDirs = NULL;
+    pathDirCount = 0;
+    free(indexedPath);
+    indexedPath = NULL;
+    trieFree(trieRoot.child);
+    memset(&trieRoot, 0, sizeof(trieRoot));
+}
+
+/**
+ * The function mergePrefix shortens the common prefix of \param c so that it is also a prefix of \param s.
+ */
+static void mergePrefix(Completion *c, const char *s) {
+    if (c->prefix == NULL) {
+        c->prefix = strdup(s);
+        assert(c->prefix != NULL);
+        return;
+    }
+    int i = 0;
+    while (c->prefix[i] != '\0' && c->prefix[i] == s[i])
+        i++;
+    c->prefix[i] = '\0';
+}
+
+static void addItem(Completion *c, const char *s) {
+    if (c->count >= MAX_COMPLETION_ITEMS)
+        return;
+    c->items[c->count] = strdup(s);
+    assert(c->items[c->count] != NULL);
+    c->count++;
+}
+
+static void addCandidate(Completion *c, const char *s, bool isDirectory) {
+    mergePrefix(c, s);
+    addItem(c, s);
+    c->isDirectory = c->total == 0 && isDirectory;
+    c->total++;
+}
+
+/**
+ * The function trieCollect adds the words below \param node to the listing of \param c,
+ * stopping as soon as the listing is full.
+ * @param buf holds the word spelled so far, \param len characters long.
+ */
+static void trieCollect(TrieNode *node, char *buf, int len, Completion *c) {
+    if (node->refs > 0) {
+        buf[len] = '\0';
+        addItem(c, buf);
+    }
+    for (TrieNode *child = node->child; child != NULL && c->count < MAX_COMPLETION_ITEMS; child = child->sibling) {
+        if (child->words == 0 || len + 1 >= PATH_MAX)
+            continue;
+        buf[len] = child->c;
+        trieCollect(child, buf, len + 1, c);
+    }
+}
+
+/**
+ * The function addExecutables adds the executables on PATH that start with \param word.
+ * The common prefix follows the chain of single children below the prefix node, so the
+ * cost does not depend on how many executables match.
+ */
+static void addExecutables(const char *word, Completion *c) {
+    refreshExecutableIndex();
+
+    TrieNode *node = trieFind(word);
+    if (node == NULL || node->words == 0)
+        return;
+
+    char buf[PATH_MAX];
+    int len = strlen(word);
+    if (len >= PATH_MAX)
+        return;
+    memcpy(buf, word, len);
+
+    int prefixLen = len;
+    TrieNode *walk = node;
+    while (walk->refs == 0 && prefixLen + 1 < PATH_MAX) {
+        TrieNode *only = NULL;
+        int live = 0;
+        for (TrieNode *child = walk->child; child != NULL; child = child->sibling) {
+            if (child->words > 0) {
+                only = child;
+                live++;
+            }
+        }
+        if (live != 1)
+            break;
+        buf[prefixLen++] = only->c;
+        walk = only;
+    }
+    buf[prefixLen] = '\0';
+    mergePrefix(c, buf);
+
+    trieCollect(node, buf, len, c);
+    c->total += node->words;
+}
+
+/**
+ * The function addBuiltIns adds the builtins (or prefixes) in \param names that start with \param word, skipping
+ * those that are already listed because an executable with the same name exists.
+ */
+static void addBuiltIns(const char *word, char **names, Completion *c) {
+    size_t len = strlen(word);
+    for (int i = 0; names[i] != NULL; i++) {
+        if (strncmp(names[i], word, len) != 0)
+            continue;
+        TrieNode *node = trieFind(names[i]);
+        if (node != NULL && node->refs > 0)
+            continue;
+        addCandidate(c, names[i], false);
+    }
+}
+
+/**
+ * The function addFileNames adds the entries of the directory part of \param word whose
+ * names start with its last component. Directories get a trailing slash.
+ */
+static void addFileNames(const char *word, Completion *c) {
+    const char *slash = strrchr(word, '/');
+    const char *base = slash == NULL ? word : slash + 1;
+    int dirLen = slash == NULL ? 0 : (int)(slash - word) + 1;
+
+    char dirName[PATH_MAX];
+    if (dirLen >= PATH_MAX)
+        return;
+    if (dirLen == 0) {
+        strcpy(dirName, ".");
+    } else {
+        memcpy(dirName, word, dirLen);
+        dirName[dirLen] = '\0';
+    }
+
+    DIR *d = opendir(dirName);
+    if (d == NULL)
+        return;
+
+    size_t baseLen = strlen(base);
+    char candidate[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (entry->d_name[0] == '.' && base[0] != '.')
+            continue;
+        if (strncmp(entry->d_name, base, baseLen) != 0)
+            continue;
+
+        bool isDirectory = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+            isDirectory = fstatat(dirfd(d), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+
+        if (snprintf(candidate, sizeof(candidate), "%.*s%s%s", dirLen, word, entry->d_name, isDirectory ? "/" : "") >= (int)sizeof(candidate))
+            continue;
+        addCandidate(c, candidate, isDirectory);
+    }
+    closedir(d);
+}
+
+/**
+ * The function completeWord computes the completions of \param word.
+ * In command position, words without a slash complete to builtins and executables
+ * on PATH; everything else completes to file names.
+ * @param word the (partial) word under the cursor.
+ * @param commandPosition whether the word is the first word of a command.
+ * @param c the completion result, to be released with freeCompletion.
+ */
+void completeWord(const char *word, bool commandPosition, Completion *c) {
+    memset(c, 0, sizeof(*c));
+    c->items = malloc(MAX_COMPLETION_ITEMS * sizeof(*c->items));
+    assert(c->items != NULL);
+
+    if (commandPosition && strchr(word, '/') == NULL) {
+        addExecutables(word, c);
+        addBuiltIns(word, builtinNames, c);
+        addBuiltIns(word, prefixNames, c);
+        c->isDirectory = false;
+    } else {
+        addFileNames(word, c);
+    }
+}
+
+/**
+ * The function freeCompletion releases the memory held by a completion result.
+ */
+void freeCompletion(Completion *c) {
+    for (int i = 0; i < c->count; i++)
+        free(c->items[i]);
+    free(c->items);
+    free(c->prefix);
+    memset(c, 0, sizeof(*c));
+}
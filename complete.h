@@ -0,0 +1,20 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+#include <stdbool.h>
+
+#define MAX_COMPLETION_ITEMS 200
+
+typedef struct Completion {
+    char *prefix;           // longest common prefix of all candidates
+    char **items;           // at most MAX_COMPLETION_ITEMS candidates, for listing
+    int count;              // number of entries in items
+    int total;              // total number of candidates (may exceed count)
+    bool isDirectory;       // the single candidate is a directory
+} Completion;
+
+void completeWord(const char *word, bool commandPosition, Completion *c);
+void freeCompletion(Completion *c);
+void freeExecutableIndex();
+
+#endif
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "scanner.h"
+#include "shell.h"
+#include "spawn.h"
+#include "stream.h"
+#include "record.h"
+#include "dag.h"
+
+/*
+ * dag runs the tasks of a task file as soon as the tasks they depend on have finished,
+ * up to -j at a time. A task file looks like a makefile without files:
+ *
+ *     # comment
+ *     name: dependency ...
+ *         command
+ *         command
+ *
+ * The commands of a task run in one /bin/sh -c with set -e, as make runs a recipe.
+ * When a task fails, the tasks that depend on it are skipped; the others go on.
+ */
+
+typedef enum TaskState {
+    TASK_WAITING,
+    TASK_RUNNING,
+    TASK_DONE,
+    TASK_FAILED,
+    TASK_SKIPPED
+} TaskState;
+
+typedef struct Task {
+    char *name;
+    char **needNames;           // dependencies as written, resolved into needs
+    int *needs;
+    int needCount;
+    int *dependents;
+    int dependentCount;
+    char *script;               // NULL for a task without commands
+    size_t scriptLength;
+
+    TaskState state;
+    int waiting;                // dependencies that have not finished yet
+    int height;                 // tasks on the longest chain that starts here
+    int status;
+    pid_t pid;
+    int pidfd;
+    int64_t start;
+    int64_t duration;
+    int64_t pathTime;           // longest chain of durations ending with this task
+    int pathPrevious;           // the dependency on that chain, -1 at its start
+} Task;
+
+typedef struct Dag {
+    Task *tasks;
+    int count;
+    int capacity;
+    int workers;
+    int running;
+    int outFd;
+    int nullFd;
+    pid_t pgid;
+    bool stop;                  // interrupted, or a task could not be started
+} Dag;
+
+static void *growArray(void *p, int count, size_t size) {
+    p = realloc(p, (count + 1) * size);
+    assert(p != NULL);
+    return p;
+}
+
+static int findTask(Dag *d, const char *name) {
+    for (int i = 0; i < d->count; i++) {
+        if (strcmp(d->tasks[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * The function addCommand appends a command line to the script of \param task.
+ */
+static void addCommand(Task *task, const char *line) {
+    static const char prologue[] = "set -e\n";
+    size_t n = strlen(line);
+    if (task->script == NULL) {
+        task->script = strdup(prologue);
+        assert(task->script != NULL);
+        task->scriptLength = strlen(prologue);
+    }
+    task->script = realloc(task->script, task->scriptLength + n + 2);
+    assert(task->script != NULL);
+    memcpy(task->script + task->scriptLength, line, n);
+    task->scriptLength += n;
+    task->script[task->scriptLength++] = '\n';
+    task->script[task->scriptLength] = '\0';
+}
+
+/**
+ * The function addTask reads a line "name: dependency ..." into a new task.
+ * @return a bool denoting whether the line was valid.
+ */
+static bool addTask(Dag *d, char *line, int lineNumber) {
+    char *colon = strchr(line, ':');
+    if (colon == NULL) {
+        shellPrintf("Error: line %d: expected \"name: dependencies\"!\n", lineNumber);
+        return false;
+    }
+    *colon = '\0';
+    char *name = strtok(line, " \t");
+    if (name == NULL || strtok(NULL, " \t") != NULL) {
+        shellPrintf("Error: line %d: a task needs one name!\n", lineNumber);
+        return false;
+    }
+    if (findTask(d, name) != -1) {
+        shellPrintf("Error: line %d: task %s is defined twice!\n", lineNumber, name);
+        return false;
+    }
+    if (d->count == d->capacity) {
+        d->capacity = d->capacity == 0 ? 16 : 2 * d->capacity;
+        d->tasks = realloc(d->tasks, d->capacity * sizeof(*d->tasks));
+        assert(d->tasks != NULL);
+    }
+    Task *task = &d->tasks[d->count++];
+    memset(task, 0, sizeof(*task));
+    task->name = strdup(name);
+    assert(task->name != NULL);
+    task->pidfd = -1;
+    task->pathPrevious = -1;
+    for (char *need = strtok(colon + 1, " \t"); need != NULL; need = strtok(NULL, " \t")) {
+        task->needNames = growArray(task->needNames, task->needCount, sizeof(char *));
+        task->needNames[task->needCount] = strdup(need);
+        assert(task->needNames[task->needCount] != NULL);
+        task->needCount++;
+    }
+    return true;
+}
+
+/**
+ * The function readTaskFile reads the tasks of \param path.
+ * @return a bool denoting whether the file could be read and was valid.
+ */
+static bool readTaskFile(Dag *d, const char *path) {
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        shellPrintf("Error: cannot open %s!\n", path);
+        return false;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int lineNumber = 0;
+    bool valid = true;
+    while (valid && (length = getline(&line, &capacity, f)) != -1) {
+        lineNumber++;
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        char *text = line;
+        while (isspace((unsigned char)*text))
+            text++;
+        if (*text == '\0' || *text == '#')
+            continue;
+        if (text == line)
+            valid = addTask(d, line, lineNumber);
+        else if (d->count == 0) {
+            shellPrintf("Error: line %d: command outside of a task!\n", lineNumber);
+            valid = false;
+        } else
+            addCommand(&d->tasks[d->count - 1], text);
+    }
+    free(line);
+    fclose(f);
+    return valid;
+}
+
+/**
+ * The function linkTasks resolves the dependencies, rejects cycles and computes the
+ * height of every task, which orders the tasks that are ready to run: the task that
+ * starts the longest chain goes first.
+ * @return a bool denoting whether the tasks form a DAG.
+ */
+static bool linkTasks(Dag *d) {
+    for (int i = 0; i < d->count; i++) {
+        Task *task = &d->tasks[i];
+        task->needs = growArray(NULL, task->needCount, sizeof(int));
+        for (int j = 0; j < task->needCount; j++) {
+            int need = findTask(d, task->needNames[j]);
+            if (need == -1) {
+                shellPrintf("Error: task %s needs unknown task %s!\n", task->name, task->needNames[j]);
+                return false;
+            }
+            task->needs[j] = need;
+            Task *other = &d->tasks[need];
+            other->dependents = growArray(other->dependents, other->dependentCount, sizeof(int));
+            other->dependents[other->dependentCount++] = i;
+        }
+        task->waiting = task->needCount;
+    }
+
+    // Kahn's algorithm; the order is kept to compute the heights backwards.
+    int *order = growArray(NULL, d->count, sizeof(int));
+    int *waiting = growArray(NULL, d->count, sizeof(int));
+    int sorted = 0;
+    for (int i = 0; i < d->count; i++) {
+        waiting[i] = d->tasks[i].needCount;
+        if (waiting[i] == 0)
+            order[sorted++] = i;
+    }
+    for (int k = 0; k < sorted; k++) {
+        Task *task = &d->tasks[order[k]];
+        for (int j = 0; j < task->dependentCount; j++) {
+            if (--waiting[task->dependents[j]] == 0)
+                order[sorted++] = task->dependents[j];
+        }
+    }
+    for (int i = 0; sorted < d->count && i < d->count; i++) {
+        if (waiting[i] > 0) {
+            shellPrintf("Error: task %s is part of a dependency cycle!\n", d->tasks[i].name);
+            break;
+        }
+    }
+    for (int k = sorted - 1; k >= 0 && sorted == d->count; k--) {
+        Task *task = &d->tasks[order[k]];
+        task->height = 1;
+        for (int j = 0; j < task->dependentCount; j++) {
+            int height = d->tasks[task->dependents[j]].height + 1;
+            task->height = height > task->height ? height : task->height;
+        }
+    }
+    free(order);
+    free(waiting);
+    return sorted == d->count;
+}
+
+/**
+ * The function skipDependents marks every task that depends on \param index, directly
+ * or not, as skipped.
+ */
+static void skipDependents(Dag *d, int index) {
+    Task *task = &d->tasks[index];
+    for (int j = 0; j < task->dependentCount; j++) {
+        Task *dependent = &d->tasks[task->dependents[j]];
+        if (dependent->state != TASK_WAITING)
+            continue;
+        dependent->state = TASK_SKIPPED;
+        shellPrintf("dag: skipping %s, it needs %s\n", dependent->name, task->name);
+        skipDependents(d, task->dependents[j]);
+    }
+}
+
+/**
+ * The function finishTask records the end of a task and releases its dependents.
+ */
+static void finishTask(Dag *d, int index, int status) {
+    Task *task = &d->tasks[index];
+    task->duration = monotonicNow() - task->start;
+    task->status = status;
+    task->pathTime = task->duration;
+    for (int j = 0; j < task->needCount; j++) {
+        Task *need = &d->tasks[task->needs[j]];
+        if (need->pathTime + task->duration > task->pathTime) {
+            task->pathTime = need->pathTime + task->duration;
+            task->pathPrevious = task->needs[j];
+        }
+    }
+    if (status == 0) {
+        task->state = TASK_DONE;
+        for (int j = 0; j < task->dependentCount; j++)
+            d->tasks[task->dependents[j]].waiting--;
+        return;
+    }
+    task->state = TASK_FAILED;
+    if (status > 128)
+        d->stop = true;                     // interrupted: start nothing new
+    shellPrintf("dag: task %s failed with exit code %d\n", task->name, status);
+    skipDependents(d, index);
+}
+
+/**
+ * The function startTask runs the commands of a task. A task without commands is
+ * done at once.
+ */
+static void startTask(Dag *d, int index) {
+    Task *task = &d->tasks[index];
+    task->start = monotonicNow();
+    if (task->script == NULL) {
+        finishTask(d, index, 0);
+        return;
+    }
+    // The tasks share a process group, so Ctrl+C reaches all of them. A task that is not
+    // reaped yet keeps the group alive; once none runs, the next task leads a new one.
+    char *argv[] = { "/bin/sh", "-c", task->script, NULL };
+    SpawnSpec spec = { argv, d->nullFd, d->outFd, STDERR_FILENO, d->running > 0 ? d->pgid : 0, NULL };
+    pid_t pid = spawnCommand(&spec);
+    if (pid == -1) {
+        perror("fork");
+        d->stop = true;
+        finishTask(d, index, 126);
+        return;
+    }
+    // Also done by the child: EACCES means it has joined the group and exec'd already.
+    if (spec.pgid == 0 || (setpgid(pid, spec.pgid) == -1 && (errno == EPERM || errno == ESRCH))) {
+        setpgid(pid, pid);
+        if (foregroundPID == -1 || foregroundPID == d->pgid)
+            foregroundPID = pid;
+        d->pgid = pid;
+    }
+    task->state = TASK_RUNNING;
+    task->pid = pid;
+    task->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    d->running++;
+}
+
+/**
+ * The function waitTask waits until one of the running tasks has finished. The tasks
+ * are watched through pidfds, so background jobs are left to the shell.
+ */
+static void waitTask(Dag *d) {
+    struct pollfd fds[MAX_DAG_WORKERS];
+    int indices[MAX_DAG_WORKERS];
+    int n = 0, done = -1;
+    for (int i = 0; i < d->count && n < MAX_DAG_WORKERS; i++) {
+        if (d->tasks[i].state != TASK_RUNNING)
+            continue;
+        if (d->tasks[i].pidfd == -1 && done == -1)
+            done = i;                       // no pidfd: reap it blocking
+        fds[n].fd = d->tasks[i].pidfd;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        indices[n++] = i;
+    }
+    if (done == -1) {
+        while (poll(fds, n, -1) == -1 && errno == EINTR)
+            ;
+        for (int i = 0; i < n && done == -1; i++) {
+            if (fds[i].revents != 0)
+                done = indices[i];
+        }
+    }
+
+    Task *task = &d->tasks[done];
+    int status;
+    while (waitpid(task->pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (task->pidfd != -1)
+        close(task->pidfd);
+    task->pidfd = -1;
+    d->running--;
+    finishTask(d, done, WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+}
+
+/**
+ * The function nextReadyTask picks the waiting task with all dependencies done that
+ * starts the longest chain.
+ * @return its index, or -1 if no task is ready.
+ */
+static int nextReadyTask(Dag *d) {
+    int best = -1;
+    for (int i = 0; i < d->count; i++) {
+        Task *task = &d->tasks[i];
+        if (task->state == TASK_WAITING && task->waiting == 0 && (best == -1 || task->height > d->tasks[best].height))
+            best = i;
+    }
+    return best;
+}
+
+/**
+ * The function printSummary prints how the tasks ended, the time they took and the
+ * critical path: the chain of dependent tasks that took longest, which bounds the
+ * run time however many workers there are.
+ */
+static void printSummary(Dag *d, int64_t wall) {
+    int counts[TASK_SKIPPED + 1] = { 0 };
+    int64_t busy = 0;
+    int last = -1;
+    for (int i = 0; i < d->count; i++) {
+        Task *task = &d->tasks[i];
+        counts[task->state]++;
+        if (task->state == TASK_DONE || task->state == TASK_FAILED) {
+            busy += task->duration;
+            if (last == -1 || task->pathTime > d->tasks[last].pathTime)
+                last = i;
+        }
+    }
+    shellPrintf("dag: %d tasks, %d done, %d failed, %d skipped in %.2fs (task time %.2fs, %.1fx parallel)\n",
+                d->count, counts[TASK_DONE], counts[TASK_FAILED], counts[TASK_SKIPPED] + counts[TASK_WAITING],
+                wall / 1e9, busy / 1e9, wall > 0 ? (double)busy / wall : 0.0);
+    if (last == -1)
+        return;
+
+    int *chain = growArray(NULL, d->count, sizeof(int));
+    int length = 0;
+    for (int i = last; i != -1; i = d->tasks[i].pathPrevious)
+        chain[length++] = i;
+    shellPrintf("critical path:");
+    for (int k = length - 1; k >= 0; k--)
+        shellPrintf(" %s %.2fs%s", d->tasks[chain[k]].name, d->tasks[chain[k]].duration / 1e9, k > 0 ? " ->" : "");
+    shellPrintf(" = %.2fs\n", d->tasks[last].pathTime / 1e9);
+    free(chain);
+}
+
+static void freeDag(Dag *d) {
+    for (int i = 0; i < d->count; i++) {
+        Task *task = &d->tasks[i];
+        for (int j = 0; j < task->needCount; j++)
+            free(task->needNames[j]);
+        free(task->needNames);
+        free(task->needs);
+        free(task->dependents);
+        free(task->script);
+        free(task->name);
+    }
+    free(d->tasks);
+}
+
+/**
+ * The function command_dag is one of the built-in commands of the shell.
+ *
+ *     dag [-j workers] taskfile
+ *
+ * Runs the tasks of the task file in dependency order, up to -j at a time (default:
+ * one per CPU), and prints a summary with the critical path.
+ * @return 0 if every task succeeded, 1 if a task failed, 130 if interrupted, 2 for an
+ * invalid task file.
+ */
+int command_dag(int argc, char **argv) {
+    Dag d;
+    memset(&d, 0, sizeof(d));
+    d.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        char *end;
+        long workers = strtol(argv[2], &end, 10);
+        d.workers = *end != '\0' || workers < 0 ? -1 : workers == 0 ? d.workers : (int)workers;
+        i = 3;
+    }
+    if (i != argc - 1 || d.workers < 1) {
+        shellPrintf("Error: usage: dag [-j workers] taskfile!\n");
+        return 2;
+    }
+    d.workers = d.workers > MAX_DAG_WORKERS ? MAX_DAG_WORKERS : d.workers;
+    if (shellOut->kind != STREAM_FD) {
+        shellPrintf("Error: dag cannot write into a builtin!\n");
+        return 2;
+    }
+    d.outFd = shellOut->fd;
+    if (!readTaskFile(&d, argv[i]) || !linkTasks(&d)) {
+        freeDag(&d);
+        return 2;
+    }
+    d.nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // The tasks are reaped here; keep the SIGCHLD handler of the shell from taking them.
+    sigset_t blockChild, saved;
+    sigemptyset(&blockChild);
+    sigaddset(&blockChild, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &blockChild, &saved);
+
+    int64_t start = monotonicNow();
+    while (true) {
+        int next;
+        while (!d.stop && d.running < d.workers && (next = nextReadyTask(&d)) != -1)
+            startTask(&d, next);
+        if (d.running == 0)
+            break;
+        waitTask(&d);
+    }
+    int64_t wall = monotonicNow() - start;
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (d.pgid != 0 && foregroundPID == d.pgid)
+        foregroundPID = -1;
+    if (d.nullFd != -1)
+        close(d.nullFd);
+
+    printSummary(&d, wall);
+    int result = 0;
+    for (int j = 0; j < d.count; j++) {
+        if (d.tasks[j].state == TASK_FAILED)
+            result = d.stop && d.tasks[j].status > 128 ? 130 : result == 0 ? 1 : result;
+    }
+    freeDag(&d);
+    return result;
+}
@@ -0,0 +1,8 @@
+#ifndef DAG_H
+#define DAG_H
+
+#define MAX_DAG_WORKERS 64
+
+int command_dag(int argc, char **argv);
+
+#endif
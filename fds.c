@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "stream.h"
+#include "fds.h"
+
+#define MAX_LISTED_FDS 4096
+
+/**
+ * The function closeDescriptorsFrom closes every descriptor from \param lowfd up,
+ * with close_range where the kernel has it.
+ */
+void closeDescriptorsFrom(int lowfd) {
+    if (syscall(SYS_close_range, lowfd, ~0U, 0) == 0)
+        return;
+    long max = sysconf(_SC_OPEN_MAX);
+    for (int fd = lowfd; fd < max; fd++)
+        close(fd);
+}
+
+/**
+ * The function openDescriptors reads the open descriptors of the shell from /proc.
+ * @param fds receives at most \param max descriptors, in increasing order.
+ * @return the number of descriptors, or -1 if /proc could not be read.
+ */
+static int openDescriptors(int *fds, int max) {
+    DIR *d = opendir("/proc/self/fd");
+    if (d == NULL)
+        return -1;
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && count < max) {
+        char *end;
+        long fd = strtol(entry->d_name, &end, 10);
+        if (entry->d_name[0] != '.' && *end == '\0' && fd != dirfd(d))
+            fds[count++] = (int)fd;
+    }
+    closedir(d);
+    // /proc lists them in order already; make sure of it.
+    for (int i = 1; i < count; i++) {
+        int fd = fds[i], j = i;
+        for (; j > 0 && fds[j - 1] > fd; j--)
+            fds[j] = fds[j - 1];
+        fds[j] = fd;
+    }
+    return count;
+}
+
+static bool isPipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/**
+ * The function closeOtherPipes closes the pipes above stderr in a forked copy of the
+ * shell, except those in \param keep: the ends of other stages, builtin threads and
+ * pipe taps it inherited, which would keep their readers from seeing EOF.
+ */
+void closeOtherPipes(const int *keep, int keepCount) {
+    static int fds[MAX_LISTED_FDS];
+    int count = openDescriptors(fds, MAX_LISTED_FDS);
+    if (count == -1) {
+        count = 0;
+        long max = sysconf(_SC_OPEN_MAX);
+        for (int fd = STDERR_FILENO + 1; fd < max && count < MAX_LISTED_FDS; fd++) {
+            if (fcntl(fd, F_GETFD) != -1)
+                fds[count++] = fd;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        bool kept = fds[i] <= STDERR_FILENO;
+        for (int j = 0; !kept && j < keepCount; j++)
+            kept = keep[j] == fds[i];
+        if (!kept && isPipe(fds[i]))
+            close(fds[i]);
+    }
+}
+
+/**
+ * The function command_fds is one of the built-in commands of the shell. It lists the
+ * open descriptors of the shell with their access mode, flags and what they refer to.
+ * A descriptor above stderr without close-on-exec would be inherited by commands, if
+ * the child did not close it, and is marked.
+ * @return 0, or 1 if /proc/self/fd could not be read.
+ */
+int command_fds(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    static int fds[MAX_LISTED_FDS];
+    int count = openDescriptors(fds, MAX_LISTED_FDS);
+    if (count == -1) {
+        shellPrintf("Error: cannot read /proc/self/fd!\n");
+        return 1;
+    }
+
+    int leaking = 0;
+    shellPrintf("%4s %-4s %-17s %s\n", "fd", "mode", "flags", "target");
+    for (int i = 0; i < count; i++) {
+        int fdFlags = fcntl(fds[i], F_GETFD);
+        int statusFlags = fcntl(fds[i], F_GETFL);
+        if (fdFlags == -1 || statusFlags == -1)
+            continue;           // closed meanwhile, by another thread
+
+        char path[64], target[PATH_MAX];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[i]);
+        ssize_t n = readlink(path, target, sizeof(target) - 1);
+        target[n == -1 ? 0 : n] = '\0';
+
+        int mode = statusFlags & O_ACCMODE;
+        char flags[32] = "";
+        if (fdFlags & FD_CLOEXEC)
+            strcat(flags, "cloexec ");
+        if (statusFlags & O_NONBLOCK)
+            strcat(flags, "nonblock ");
+        if (statusFlags & O_APPEND)
+            strcat(flags, "append ");
+        bool leaks = fds[i] > STDERR_FILENO && !(fdFlags & FD_CLOEXEC);
+        if (leaks)
+            leaking++;
+        shellPrintf("%4d %-4s %-17s %s%s\n", fds[i], mode == O_RDONLY ? "r" : mode == O_WRONLY ? "w" : "rw",
+                    flags, target, leaks ? "  (not close-on-exec)" : "");
+    }
+    shellPrintf("%d open, %d above stderr without close-on-exec\n", count, leaking);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef FDS_H
+#define FDS_H
+
+/*
+ * Every descriptor the shell opens for itself is close-on-exec, so commands only get
+ * stdin, stdout and stderr. Two things are left to sweep up: descriptors the shell
+ * inherited without the flag, which are closed in each child before its exec, and
+ * the pipe ends a forked copy of the shell (a builtin or function stage) inherits
+ * from other stages and builtin threads. Such a copy never execs, so close-on-exec
+ * does not help there; while it held a write end, the reader of that pipe would not
+ * see EOF when the producer exits.
+ */
+
+void closeDescriptorsFrom(int lowfd);
+void closeOtherPipes(const int *keep, int keepCount);
+int command_fds(int argc, char **argv);
+
+#endif
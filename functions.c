@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scanner.h"
+#include "shell.h"
+#include "vars.h"
+#include "stream.h"
+#include "functions.h"
+
+typedef struct Function {
+    char *name;
+    Program *program;       // holds a reference (see Program.references)
+    int entry;              // first instruction of the body
+} Function;
+
+typedef struct Alias {
+    char *name;
+    char *value;
+    List tokens;            // the value, tokenized once
+} Alias;
+
+static Function *functions = NULL;
+static int functionCount = 0;
+static int functionCapacity = 0;
+static int callDepth = 0;
+
+static Alias *aliases = NULL;
+static int aliasCount = 0;
+static int aliasCapacity = 0;
+
+static Function *findFunction(const char *name) {
+    for (int i = 0; i < functionCount; i++) {
+        if (strcmp(functions[i].name, name) == 0)
+            return &functions[i];
+    }
+    return NULL;
+}
+
+/**
+ * The function defineFunction defines (or redefines) function \param name, whose body
+ * starts at instruction \param entry of \param program. The program is kept alive as
+ * long as the function is defined.
+ */
+void defineFunction(const char *name, Program *program, int entry) {
+    program->references++;
+    Function *f = findFunction(name);
+    if (f != NULL) {
+        freeProgram(f->program);
+    } else {
+        if (functionCount == functionCapacity) {
+            functionCapacity = functionCapacity == 0 ? 16 : 2 * functionCapacity;
+            functions = realloc(functions, functionCapacity * sizeof(*functions));
+            assert(functions != NULL);
+        }
+        f = &functions[functionCount++];
+        f->name = strdup(name);
+        assert(f->name != NULL);
+    }
+    f->program = program;
+    f->entry = entry;
+}
+
+bool isFunction(const char *name) {
+    return findFunction(name) != NULL;
+}
+
+/**
+ * The function runFunction calls the function named by \param argv[0] in the shell
+ * itself. The arguments become $1 ... $n for the duration of the call.
+ * @return the exit code of the last command of the function, or of its return.
+ */
+int runFunction(int argc, char **argv) {
+    Function *f = findFunction(argv[0]);
+    if (f == NULL)
+        return 127;
+    if (callDepth >= MAX_FUNCTION_DEPTH) {
+        printf("Error: functions nested too deep!\n");
+        return 2;
+    }
+    Program *program = f->program;      // the function may be redefined while it runs
+    int entry = f->entry;
+    int savedCount = positionalCount();
+    char **savedValues = positionalValues();
+    program->references++;
+    setPositionalParameters(NULL, argc - 1, argv + 1);
+    callDepth++;
+    runProgramFrom(program, entry);
+    callDepth--;
+    setPositionalParameters(NULL, savedCount, savedValues);
+    freeProgram(program);
+    return exitCode;
+}
+
+static Alias *findAlias(const char *name) {
+    for (int i = 0; i < aliasCount; i++) {
+        if (strcmp(aliases[i].name, name) == 0)
+            return &aliases[i];
+    }
+    return NULL;
+}
+
+/**
+ * The function copyTokens copies the token list \param l.
+ * @param last set to the last node of the copy.
+ */
+static List copyTokens(List l, List *last) {
+    List head = NULL;
+    List *link = &head;
+    *last = NULL;
+    for (; l != NULL; l = l->next) {
+        List node = malloc(sizeof(*node));
+        assert(node != NULL);
+        node->t = strdup(l->t);
+        assert(node->t != NULL);
+        node->next = NULL;
+        *link = node;
+        link = &node->next;
+        *last = node;
+    }
+    return head;
+}
+
+/**
+ * The function startsCommand checks whether the token after \param t starts a command.
+ */
+static bool startsCommand(const char *t) {
+    return strcmp(t, ";") == 0 || strcmp(t, "&") == 0 || strcmp(t, "&&") == 0 || strcmp(t, "||") == 0
+           || strcmp(t, "|") == 0;
+}
+
+/**
+ * The function expandAliases replaces every alias that is the first word of a command
+ * in \param tokens by a copy of its tokens. The first word of the replacement is
+ * expanded again, unless it is an alias that has already been replaced there.
+ * @return the list after the replacements.
+ */
+List expandAliases(List tokens) {
+    List *link = &tokens;
+    bool commandStart = true;
+    while (*link != NULL) {
+        Alias *used[MAX_ALIAS_DEPTH];
+        int depth = 0;
+        while (commandStart && *link != NULL && depth < MAX_ALIAS_DEPTH) {
+            Alias *a = findAlias((*link)->t);
+            for (int i = 0; a != NULL && i < depth; i++) {
+                if (used[i] == a)
+                    a = NULL;
+            }
+            if (a == NULL)
+                break;
+            used[depth++] = a;
+            List node = *link, last;
+            List copy = copyTokens(a->tokens, &last);
+            if (copy == NULL) {
+                *link = node->next;
+            } else {
+                last->next = node->next;
+                *link = copy;
+            }
+            free(node->t);
+            free(node);
+        }
+        if (*link == NULL)
+            break;
+        commandStart = startsCommand((*link)->t);
+        link = &(*link)->next;
+    }
+    return tokens;
+}
+
+/**
+ * The function setAlias defines alias \param name with the words \param words.
+ */
+static void setAlias(const char *name, char **words, int count) {
+    size_t length = 1;
+    for (int i = 0; i < count; i++)
+        length += strlen(words[i]) + 1;
+    char *value = malloc(length);
+    assert(value != NULL);
+    value[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0)
+            strcat(value, " ");
+        strcat(value, words[i]);
+    }
+
+    Alias *a = findAlias(name);
+    if (a != NULL) {
+        free(a->value);
+        freeTokenList(a->tokens);
+    } else {
+        if (aliasCount == aliasCapacity) {
+            aliasCapacity = aliasCapacity == 0 ? 16 : 2 * aliasCapacity;
+            aliases = realloc(aliases, aliasCapacity * sizeof(*aliases));
+            assert(aliases != NULL);
+        }
+        a = &aliases[aliasCount++];
+        a->name = strdup(name);
+        assert(a->name != NULL);
+    }
+    a->value = value;
+    a->tokens = getTokenList(value);
+}
+
+static void removeAlias(Alias *a) {
+    free(a->name);
+    free(a->value);
+    freeTokenList(a->tokens);
+    *a = aliases[--aliasCount];
+}
+
+static bool isAliasName(const char *s) {
+    if (*s == '\0')
+        return false;
+    for (; *s != '\0'; s++) {
+        if (isspace((unsigned char)*s) || isOperatorCharacter(*s) || *s == '/' || *s == '$')
+            return false;
+    }
+    return true;
+}
+
+/**
+ * The function command_alias is one of the built-in commands of the shell.
+ *
+ *     alias                    lists the aliases
+ *     alias name...            shows the given aliases
+ *     alias name=word...       defines an alias, the value is the rest of the line
+ *
+ * @return 0, or 1 if an alias to show does not exist.
+ */
+int command_alias(int argc, char **argv) {
+    if (argc == 1) {
+        for (int i = 0; i < aliasCount; i++)
+            shellPrintf("alias %s=%s\n", aliases[i].name, aliases[i].value);
+        return 0;
+    }
+    char *eq = strchr(argv[1], '=');
+    if (eq != NULL) {
+        char *name = argv[1];
+        *eq = '\0';
+        if (!isAliasName(name)) {
+            *eq = '=';
+            shellPrintf("Error: invalid alias name!\n");
+            return 2;
+        }
+        argv[1] = eq + 1;                   // the first word of the value
+        setAlias(name, argv + 1, argc - 1);
+        argv[1] = name;
+        *eq = '=';
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        Alias *a = findAlias(argv[i]);
+        if (a != NULL) {
+            shellPrintf("alias %s=%s\n", a->name, a->value);
+        } else {
+            shellPrintf("Error: alias %s not found!\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * The function command_unalias is one of the built-in commands of the shell.
+ *
+ *     unalias -a | name...
+ *
+ * @return 0, or 1 if one of the aliases does not exist.
+ */
+int command_unalias(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "-a") == 0) {
+        while (aliasCount > 0)
+            removeAlias(&aliases[aliasCount - 1]);
+        return 0;
+    }
+    if (argc == 1) {
+        shellPrintf("Error: usage: unalias -a | name...!\n");
+        return 2;
+    }
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        Alias *a = findAlias(argv[i]);
+        if (a != NULL) {
+            removeAlias(a);
+        } else {
+            shellPrintf("Error: alias %s not found!\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
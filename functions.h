@@ -0,0 +1,27 @@
+#ifndef FUNCTIONS_H
+#define FUNCTIONS_H
+
+#include <stdbool.h>
+#include "scanner.h"
+#include "script.h"
+
+#define MAX_FUNCTION_DEPTH 256      // calls of functions that may be running at once
+#define MAX_ALIAS_DEPTH 16          // aliases that may expand into one another
+
+/*
+ * A function is a body of compiled code (see script.h): the program that defined it
+ * and the instruction where the body starts. A call runs that code in the shell
+ * itself, with the arguments as $1 ... $n, so it costs neither a fork nor parsing.
+ *
+ * An alias is kept as the token list of its value, which replaces the alias when it
+ * is the first word of a command on a line that is read.
+ */
+
+void defineFunction(const char *name, Program *program, int entry);
+bool isFunction(const char *name);
+int runFunction(int argc, char **argv);
+List expandAliases(List tokens);
+int command_alias(int argc, char **argv);
+int command_unalias(int argc, char **argv);
+
+#endif
@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "joblimits.h"
+
+#define CPU_PERIOD 100000                   // cpu.max period, microseconds
+
+static int jobCgroupCount = 0;
+
+void clearLimits(ResourceLimits *limits) {
+    limits->cpuSeconds = limits->addressSpace = limits->openFiles = NO_LIMIT;
+    limits->memoryMax = limits->cpuPercent = NO_LIMIT;
+    limits->nice = NO_NICE;
+    limits->cgroup[0] = '\0';
+    limits->pinned = false;
+}
+
+bool hasLimits(const ResourceLimits *limits) {
+    return limits->cpuSeconds != NO_LIMIT || limits->addressSpace != NO_LIMIT || limits->openFiles != NO_LIMIT
+           || limits->nice != NO_NICE || limits->memoryMax != NO_LIMIT || limits->cpuPercent != NO_LIMIT
+           || limits->pinned;
+}
+
+/**
+ * The function parseByteSize parses a size such as "4096", "64k", "512M" or "2G".
+ * @return the size in bytes, or -1 if \param s is not a valid size.
+ */
+long parseByteSize(const char *s) {
+    char *endptr;
+    long size = strtol(s, &endptr, 10);
+    if (endptr == s || size <= 0)
+        return -1;
+    switch (*endptr) {
+    case 'k': case 'K': size <<= 10; endptr++; break;
+    case 'm': case 'M': size <<= 20; endptr++; break;
+    case 'g': case 'G': size <<= 30; endptr++; break;
+    }
+    return *endptr == '\0' ? size : -1;
+}
+
+static bool writeFile(const char *dir, const char *name, const char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+    close(fd);
+    return ok;
+}
+
+static bool readFile(const char *dir, const char *name, char *buf, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n > 0;
+}
+
+/**
+ * The function findCgroupBase finds the cgroup v2 directory that job cgroups are created
+ * in: $SHELL_CGROUP, or else the cgroup of the shell itself in the cgroup2 mount.
+ * @return a bool denoting whether a directory was found.
+ */
+static bool findCgroupBase(char *base, size_t size) {
+    char *env = getenv("SHELL_CGROUP");
+    if (env != NULL && *env != '\0')
+        return snprintf(base, size, "%s", env) < (int)size;
+
+    char line[PATH_MAX + 64], mount[PATH_MAX] = "", own[PATH_MAX] = "";
+    FILE *f = fopen("/proc/self/mounts", "re");
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        char dir[PATH_MAX], type[64];
+        if (sscanf(line, "%*s %4095s %63s", dir, type) == 2 && strcmp(type, "cgroup2") == 0) {
+            strcpy(mount, dir);
+            break;
+        }
+    }
+    if (f != NULL)
+        fclose(f);
+    f = fopen("/proc/self/cgroup", "re");
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(own, sizeof(own), "%s", line + 3);
+            break;
+        }
+    }
+    if (f != NULL)
+        fclose(f);
+    return mount[0] != '\0' && own[0] != '\0' && snprintf(base, size, "%s%s", mount, strcmp(own, "/") == 0 ? "" : own) < (int)size;
+}
+
+/**
+ * The function createJobCgroup creates a cgroup for a job that has a memory or CPU
+ * bandwidth limit, and sets memory.max and cpu.max in it.
+ * @return a bool denoting whether the cgroup is ready (or was not needed).
+ */
+bool createJobCgroup(ResourceLimits *limits) {
+    limits->cgroup[0] = '\0';
+    if (limits->memoryMax == NO_LIMIT && limits->cpuPercent == NO_LIMIT)
+        return true;
+
+    char base[sizeof(limits->cgroup) - 32], controllers[256], value[64];
+    if (!findCgroupBase(base, sizeof(base))) {
+        printf("Error: no cgroup v2 hierarchy found (set SHELL_CGROUP)!\n");
+        return false;
+    }
+    // Fails with EBUSY if the base has processes of its own; then the controllers have to
+    // be enabled (and the shell moved into a leaf) by whoever delegated the subtree.
+    if (limits->memoryMax != NO_LIMIT)
+        writeFile(base, "cgroup.subtree_control", "+memory");
+    if (limits->cpuPercent != NO_LIMIT)
+        writeFile(base, "cgroup.subtree_control", "+cpu");
+    if (!readFile(base, "cgroup.subtree_control", controllers, sizeof(controllers))
+        || (limits->memoryMax != NO_LIMIT && strstr(controllers, "memory") == NULL)
+        || (limits->cpuPercent != NO_LIMIT && strstr(controllers, "cpu") == NULL)) {
+        printf("Error: the memory/cpu controllers are not available in %s!\n", base);
+        return false;
+    }
+
+    snprintf(limits->cgroup, sizeof(limits->cgroup), "%s/shell-%d-%d", base, (int)getpid(), ++jobCgroupCount);
+    if (mkdir(limits->cgroup, 0755) == -1) {
+        printf("Error: cannot create cgroup %s: %s!\n", limits->cgroup, strerror(errno));
+        limits->cgroup[0] = '\0';
+        return false;
+    }
+    bool ok = true;
+    if (limits->memoryMax != NO_LIMIT) {
+        snprintf(value, sizeof(value), "%ld", limits->memoryMax);
+        ok = writeFile(limits->cgroup, "memory.max", value);
+    }
+    if (ok && limits->cpuPercent != NO_LIMIT) {
+        snprintf(value, sizeof(value), "%ld %d", limits->cpuPercent * CPU_PERIOD / 100, CPU_PERIOD);
+        ok = writeFile(limits->cgroup, "cpu.max", value);
+    }
+    if (!ok) {
+        printf("Error: cannot set the limits of cgroup %s!\n", limits->cgroup);
+        removeJobCgroup(limits);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The function removeJobCgroup removes the cgroup of a job once its processes are gone.
+ * It only uses rmdir, so it may be called from a signal handler.
+ */
+void removeJobCgroup(const ResourceLimits *limits) {
+    if (limits->cgroup[0] != '\0')
+        rmdir(limits->cgroup);
+}
+
+static bool setLimit(int resource, long value) {
+    struct rlimit rl = { (rlim_t)value, (rlim_t)value };
+    return value == NO_LIMIT || setrlimit(resource, &rl) == 0;
+}
+
+/**
+ * The function applyLimits is called in a child before it execs: the child joins the
+ * cgroup of its job and sets its rlimits, nice value and CPU affinity. A job whose limits cannot be
+ * applied does not run; it leaves with _exit, since exit would flush the stdio buffers
+ * it shares with the shell.
+ */
+void applyLimits(const ResourceLimits *limits) {
+    if (limits->cgroup[0] != '\0' && !writeFile(limits->cgroup, "cgroup.procs", "0")) {
+        printf("Error: cannot join cgroup %s!\n", limits->cgroup);
+        _exit(126);
+    }
+    if (!setLimit(RLIMIT_CPU, limits->cpuSeconds) || !setLimit(RLIMIT_AS, limits->addressSpace)
+        || !setLimit(RLIMIT_NOFILE, limits->openFiles)) {
+        printf("Error: cannot set resource limits: %s!\n", strerror(errno));
+        _exit(126);
+    }
+    if (limits->nice != NO_NICE && setpriority(PRIO_PROCESS, 0, (int)limits->nice) == -1) {
+        printf("Error: cannot set nice value: %s!\n", strerror(errno));
+        _exit(126);
+    }
+    if (limits->pinned && sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) == -1) {
+        printf("Error: cannot set CPU affinity: %s!\n", strerror(errno));
+        _exit(126);
+    }
+}
+
+static int formatBytes(char *buf, size_t size, double bytes) {
+    const char *units = "BKMGT";
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    return snprintf(buf, size, unit == 0 ? "%.0f%c" : "%.1f%c", bytes, units[unit]);
+}
+
+/**
+ * The function describeLimits prints the limits of a job into \param buf.
+ * @return the length of the description.
+ */
+int describeLimits(const ResourceLimits *limits, char *buf, size_t size) {
+    int n = 0;
+    char bytes[32];
+    buf[0] = '\0';
+#define APPEND(...) n += snprintf(buf + n, n < (int)size ? size - n : 0, __VA_ARGS__)
+    if (limits->cpuSeconds != NO_LIMIT)
+        APPEND("%scpu time %lds", n ? ", " : "", limits->cpuSeconds);
+    if (limits->addressSpace != NO_LIMIT) {
+        formatBytes(bytes, sizeof(bytes), limits->addressSpace);
+        APPEND("%saddress space %s", n ? ", " : "", bytes);
+    }
+    if (limits->openFiles != NO_LIMIT)
+        APPEND("%sopen files %ld", n ? ", " : "", limits->openFiles);
+    if (limits->nice != NO_NICE)
+        APPEND("%snice %ld", n ? ", " : "", limits->nice);
+    if (limits->memoryMax != NO_LIMIT) {
+        formatBytes(bytes, sizeof(bytes), limits->memoryMax);
+        APPEND("%smemory.max %s", n ? ", " : "", bytes);
+    }
+    if (limits->cpuPercent != NO_LIMIT)
+        APPEND("%scpu.max %ld%%", n ? ", " : "", limits->cpuPercent);
+    if (limits->pinned) {
+        char cpus[256];
+        formatCpuList(&limits->cpus, cpus, sizeof(cpus));
+        APPEND("%scpus %s", n ? ", " : "", cpus);
+    }
+#undef APPEND
+    return n;
+}
+
+/**
+ * The function describeUsage prints the CPU time and memory a job has used so far into
+ * \param buf: from its cgroup when it has one, or else summed over its processes.
+ * @return the length of the description.
+ */
+int describeUsage(const ResourceLimits *limits, const pid_t *pids, int count, char *buf, size_t size) {
+    double cpu = 0, memory = 0;
+    char text[4096], bytes[32];
+
+    if (limits != NULL && limits->cgroup[0] != '\0') {
+        if (readFile(limits->cgroup, "memory.current", text, sizeof(text)))
+            memory = strtod(text, NULL);
+        char *usage;
+        if (readFile(limits->cgroup, "cpu.stat", text, sizeof(text)) && (usage = strstr(text, "usage_usec ")) != NULL)
+            cpu = strtod(usage + 11, NULL) / 1e6;
+    } else {
+        long ticks = sysconf(_SC_CLK_TCK), page = sysconf(_SC_PAGESIZE);
+        for (int i = 0; i < count; i++) {
+            char dir[32];
+            snprintf(dir, sizeof(dir), "/proc/%d", (int)pids[i]);
+            if (!readFile(dir, "stat", text, sizeof(text)))
+                continue;
+            char *p = strrchr(text, ')');           // the command name may contain spaces
+            unsigned long utime, stime;
+            long rss;
+            if (p != NULL && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                                    &utime, &stime, &rss) == 3) {
+                cpu += (double)(utime + stime) / ticks;
+                memory += (double)rss * page;
+            }
+        }
+    }
+    formatBytes(bytes, sizeof(bytes), memory);
+    return snprintf(buf, size, "cpu %.2fs, %s %s", cpu, limits != NULL && limits->cgroup[0] != '\0' ? "memory" : "rss", bytes);
+}
@@ -0,0 +1,37 @@
+#ifndef JOBLIMITS_H
+#define JOBLIMITS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "affinity.h"
+
+#define NO_LIMIT (-1L)
+#define NO_NICE (-1000L)        // -1 is a nice value, so unset is outside -20..19
+
+/*
+ * Resource limits of a job, set by the "limit" and "pin" prefixes. The rlimits, the nice
+ * value and the CPU affinity are applied in every process of the job before it execs; memory and CPU bandwidth
+ * need a cgroup v2 directory of their own, which the processes join first.
+ */
+typedef struct ResourceLimits {
+    long cpuSeconds;            // RLIMIT_CPU
+    long addressSpace;          // RLIMIT_AS, bytes
+    long openFiles;             // RLIMIT_NOFILE
+    long nice;                  // NO_NICE if not set
+    long memoryMax;             // cgroup memory.max, bytes
+    long cpuPercent;            // cgroup cpu.max, percent of one CPU
+    char cgroup[256];           // cgroup directory of the job, empty if none
+    bool pinned;                // whether cpus is set
+    cpu_set_t cpus;             // CPU affinity, see also spreadMode
+} ResourceLimits;
+
+void clearLimits(ResourceLimits *limits);
+bool hasLimits(const ResourceLimits *limits);
+long parseByteSize(const char *s);
+bool createJobCgroup(ResourceLimits *limits);
+void removeJobCgroup(const ResourceLimits *limits);
+void applyLimits(const ResourceLimits *limits);
+int describeLimits(const ResourceLimits *limits, char *buf, size_t size);
+int describeUsage(const ResourceLimits *limits, const pid_t *pids, int count, char *buf, size_t size);
+
+#endif
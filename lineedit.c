@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "scanner.h"
+#include "complete.h"
+#include "lineedit.h"
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+#define KEY_BACKSPACE 127
+#define KEY_ESCAPE 27
+
+typedef struct LineBuffer {
+    char *s;
+    int len;
+    int capacity;
+    int pos;            // cursor position
+    int lineStart;      // start of the physical line being edited (after a quoted newline)
+} LineBuffer;
+
+static struct termios savedTermios;
+
+/**
+ * The function enableRawMode switches the terminal to non-canonical mode without echo,
+ * so that keys are delivered one at a time.
+ * @return a bool denoting whether the terminal could be configured.
+ */
+static bool enableRawMode() {
+    if (tcgetattr(STDIN_FILENO, &savedTermios) == -1)
+        return false;
+
+    struct termios raw = savedTermios;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == 0;
+}
+
+static void disableRawMode() {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &savedTermios);
+}
+
+static void writeString(const char *s, int n) {
+    while (n > 0) {
+        ssize_t written = write(STDOUT_FILENO, s, n);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        s += written;
+        n -= written;
+    }
+}
+
+static int readKey() {
+    unsigned char c;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR)
+        ;
+    return n == 1 ? c : EOF;
+}
+
+static int terminalWidth() {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+        return 80;
+    return ws.ws_col;
+}
+
+/**
+ * The function refreshLine redraws the physical line being edited and places the cursor.
+ */
+static void refreshLine(LineBuffer *lb) {
+    char seq[32];
+    writeString("\r", 1);
+    writeString(lb->s + lb->lineStart, lb->len - lb->lineStart);
+    writeString("\x1b[K\r", 4);
+    if (lb->pos > lb->lineStart) {
+        int n = snprintf(seq, sizeof(seq), "\x1b[%dC", lb->pos - lb->lineStart);
+        writeString(seq, n);
+    }
+}
+
+static void insertText(LineBuffer *lb, const char *text, int n) {
+    if (lb->len + n >= lb->capacity) {
+        while (lb->len + n >= lb->capacity)
+            lb->capacity *= 2;
+        lb->s = realloc(lb->s, (lb->capacity + 1) * sizeof(*lb->s));
+        assert(lb->s != NULL);
+    }
+    memmove(lb->s + lb->pos + n, lb->s + lb->pos, lb->len - lb->pos);
+    memcpy(lb->s + lb->pos, text, n);
+    lb->len += n;
+    lb->pos += n;
+    lb->s[lb->len] = '\0';
+}
+
+static void deleteText(LineBuffer *lb, int from, int to) {
+    memmove(lb->s + from, lb->s + to, lb->len - to);
+    lb->len -= to - from;
+    lb->s[lb->len] = '\0';
+    if (lb->pos > to)
+        lb->pos -= to - from;
+    else if (lb->pos > from)
+        lb->pos = from;
+}
+
+/**
+ * The function hasOpenQuote checks whether the buffer contains an unterminated string.
+ */
+static bool hasOpenQuote(LineBuffer *lb) {
+    bool quoteStarted = false;
+    for (int i = 0; i < lb->len; i++) {
+        if (lb->s[i] == '\"')
+            quoteStarted = !quoteStarted;
+    }
+    return quoteStarted;
+}
+
+/**
+ * The function listCandidates prints the candidates of a completion in columns below the line.
+ */
+static void listCandidates(LineBuffer *lb, Completion *c) {
+    int width = 0;
+    for (int i = 0; i < c->count; i++) {
+        int len = strlen(c->items[i]);
+        if (len > width)
+            width = len;
+    }
+    width += 2;
+    int columns = terminalWidth() / width;
+    if (columns < 1)
+        columns = 1;
+
+    char line[PATH_MAX + 32];
+    writeString("\r\n", 2);
+    for (int i = 0; i < c->count; i++) {
+        int n = snprintf(line, sizeof(line), "%-*s", width, c->items[i]);
+        writeString(line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+        if ((i + 1) % columns == 0 || i == c->count - 1)
+            writeString("\r\n", 2);
+    }
+    if (c->total > c->count) {
+        int n = snprintf(line, sizeof(line), "... and %d more\r\n", c->total - c->count);
+        writeString(line, n);
+    }
+    refreshLine(lb);
+}
+
+/**
+ * The function completeLine performs tab completion on the word before the cursor.
+ * A unique candidate is inserted, an ambiguous one is extended to the common prefix,
+ * and a second tab lists the candidates.
+ * @param repeated whether the previous key was also a tab.
+ */
+static void completeLine(LineBuffer *lb, bool repeated) {
+    int start = lb->pos;
+    while (start > lb->lineStart && !isspace((unsigned char)lb->s[start - 1]) && !isOperatorCharacter(lb->s[start - 1]))
+        start--;
+
+    int before = start;
+    while (before > 0 && isspace((unsigned char)lb->s[before - 1]))
+        before--;
+    bool commandPosition = before == 0 || (isOperatorCharacter(lb->s[before - 1])
+                                           && lb->s[before - 1] != '<' && lb->s[before - 1] != '>');
+
+    int wordLen = lb->pos - start;
+    char *word = malloc(wordLen + 1);
+    assert(word != NULL);
+    memcpy(word, lb->s + start, wordLen);
+    word[wordLen] = '\0';
+
+    Completion c;
+    completeWord(word, commandPosition, &c);
+
+    if (c.total == 0) {
+        writeString("\a", 1);
+    } else {
+        int prefixLen = strlen(c.prefix);
+        if (prefixLen > wordLen)
+            insertText(lb, c.prefix + wordLen, prefixLen - wordLen);
+        if (c.total == 1 && !c.isDirectory)
+            insertText(lb, " ", 1);
+        if (c.total > 1 && prefixLen == wordLen) {
+            if (repeated)
+                listCandidates(lb, &c);
+            else
+                writeString("\a", 1);
+        }
+        refreshLine(lb);
+    }
+
+    freeCompletion(&c);
+    free(word);
+}
+
+/**
+ * The function handleEscape handles the arrow, home, end and delete key sequences.
+ */
+static void handleEscape(LineBuffer *lb) {
+    int first = readKey();
+    if (first != '[' && first != 'O')
+        return;
+    int key = readKey();
+    if (key >= '0' && key <= '9') {
+        if (readKey() == '~' && key == '3' && lb->pos < lb->len)
+            deleteText(lb, lb->pos, lb->pos + 1);
+    } else if (key == 'C' && lb->pos < lb->len) {
+        lb->pos++;
+    } else if (key == 'D' && lb->pos > lb->lineStart) {
+        lb->pos--;
+    } else if (key == 'H') {
+        lb->pos = lb->lineStart;
+    } else if (key == 'F') {
+        lb->pos = lb->len;
+    }
+    refreshLine(lb);
+}
+
+/**
+ * The function editLine reads an inputline from the terminal with line editing and tab
+ * completion. Newlines inside strings are accepted, like in readInputLine.
+ * @return a string containing the inputline, or NULL on end of input.
+ */
+char *editLine() {
+    LineBuffer lb = { NULL, 0, INITIAL_STRING_SIZE, 0, 0 };
+    lb.s = malloc((lb.capacity + 1) * sizeof(*lb.s));
+    assert(lb.s != NULL);
+    lb.s[0] = '\0';
+
+    if (!enableRawMode()) {
+        free(lb.s);
+        return NULL;
+    }
+
+    bool lastWasTab = false;
+    while (true) {
+        int c = readKey();
+        bool isTab = c == '\t';
+
+        if (c == EOF || (c == CTRL_KEY('D') && lb.len == 0)) {
+            disableRawMode();
+            if (lb.len > 0) {
+                writeString("\r\n", 2);
+                return lb.s;
+            }
+            free(lb.s);
+            return NULL;
+        }
+
+        switch (c) {
+        case '\r':
+        case '\n':
+            if (hasOpenQuote(&lb)) {
+                lb.pos = lb.len;
+                insertText(&lb, "\n", 1);
+                lb.lineStart = lb.len;
+                writeString("\r\n", 2);
+                break;
+            }
+            writeString("\r\n", 2);
+            disableRawMode();
+            return lb.s;
+        case '\t':
+            completeLine(&lb, lastWasTab);
+            break;
+        case CTRL_KEY('C'):
+            writeString("\r\n", 2);
+            disableRawMode();
+            raise(SIGINT);          // same behaviour as Ctrl+C at the prompt without line editing
+            enableRawMode();
+            lb.len = lb.pos = lb.lineStart = 0;
+            lb.s[0] = '\0';
+            break;
+        case CTRL_KEY('A'):
+            lb.pos = lb.lineStart;
+            refreshLine(&lb);
+            break;
+        case CTRL_KEY('E'):
+            lb.pos = lb.len;
+            refreshLine(&lb);
+            break;
+        case CTRL_KEY('B'):
+            if (lb.pos > lb.lineStart)
+                lb.pos--;
+            refreshLine(&lb);
+            break;
+        case CTRL_KEY('F'):
+            if (lb.pos < lb.len)
+                lb.pos++;
+            refreshLine(&lb);
+            break;
+        case CTRL_KEY('D'):
+            if (lb.pos < lb.len)
+                deleteText(&lb, lb.pos, lb.pos + 1);
+            refreshLine(&lb);
+            break;
+        case CTRL_KEY('H'):
+        case KEY_BACKSPACE:
+            if (lb.pos > lb.lineStart)
+                deleteText(&lb, lb.pos - 1, lb.pos);
+            refreshLine(&lb);
+            break;
+        case CTRL_KEY('K'):
+            deleteText(&lb, lb.pos, lb.len);
+            refreshLine(&lb);
+            break;
+        case CTRL_KEY('U'):
+            deleteText(&lb, lb.lineStart, lb.pos);
+            refreshLine(&lb);
+            break;
+        case KEY_ESCAPE:
+            handleEscape(&lb);
+            break;
+        default:
+            if (isprint(c)) {
+                char ch = c;
+                insertText(&lb, &ch, 1);
+                if (lb.pos == lb.len)
+                    writeString(&ch, 1);
+                else
+                    refreshLine(&lb);
+            }
+            break;
+        }
+        lastWasTab = isTab;
+    }
+}
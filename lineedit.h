@@ -0,0 +1,6 @@
+#ifndef LINEEDIT_H
+#define LINEEDIT_H
+
+char *editLine();
+
+#endif
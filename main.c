@@ -3,37 +3,86 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "scanner.h"
 #include "shell.h"
+#include "server.h"
+#include "script.h"
+#include "record.h"
+#include "memstats.h"
+#include "functions.h"
+#include "prefetch.h"
+
+/**
+ * The function readTerminalLine reads the next line of a compound command and appends
+ * it to the text of the command in \param context, so the recording holds all of it.
+ */
+static char *readTerminalLine(void *context)
+{
+    char **text = context;
+    char *line = readInputLine();
+    if (line != NULL) {
+        size_t length = strlen(*text);
+        char *joined = realloc(*text, length + strlen(line) + 2);
+        if (joined != NULL) {
+            joined[length] = '\n';
+            strcpy(joined + length + 1, line);
+            *text = joined;
+        }
+    }
+    return line;
+}
 
 int main(int argc, char const *argv[])
 {    
-    setbuf(stdout, NULL);
-    setbuf(stdout, NULL);
+    setbuf(stdout, NULL);       // error messages; builtins buffer their output (see shellPrintf)
     char *inputLine;
     List tokenList, tokenListCopy;
 
     setup_signal_handlers();
+    enableLeakReport();                             // see memstats.h
+
+    if (argc > 1 && strcmp(argv[1], "--server") == 0)
+        return runServer(argc > 2 ? argv[2] : NULL);
+
+    if (argc > 1)                                   // run a script, its arguments become $1 ... $n
+        return runScript((char *)argv[1], argc - 2, (char **)argv + 2);
+
+    openRecording(getenv(RECORD_ENV));              // see record.h, replayed by shell-replay
 
     while (true) {
         cleanupBackgroundProcesses();
+        MemSubsystem previous = memEnter(MEM_SCANNER);
         inputLine = readInputLine();
 
         if (inputLine == NULL || feof(stdin))       // checks EOF
             break;
 
-        tokenList = getTokenList(inputLine);        // getting the tokenList of inputLine
+        recordBegin();
+        tokenList = expandAliases(getTokenList(inputLine));    // getting the tokenList of inputLine
+        memEnter(MEM_PARSER);
+        if (startsBlock(tokenList)) {               // if/while/until/for/case: compiled, then run
+            runBlock(tokenList, readTerminalLine, &inputLine);
+            recordEnd(inputLine, exitCode);
+            free(inputLine);
+            memLeave(previous);
+            memLineDone();
+            continue;
+        }
+        prefetchLine(tokenList);                    // the other commands load while the first runs
         tokenListCopy = tokenList;                  // making a copy to the start of the tokenList
                                                     // to avoid memory leaks
         bool parse = parseInputLine(&tokenList);    // parsing the input line
 
         if (tokenList == NULL && parse) 
             printList(tokenList);
+        recordEnd(inputLine, exitCode);
 
         free(inputLine);
-        freeTokenList(tokenList); 
-        freeTokenList(tokenListCopy);
+        freeTokenList(tokenListCopy);               // tokenList points into it
+        memLeave(previous);
+        memLineDone();
     }
     
     return 0;
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+#include <unistd.h>
+#include "scanner.h"
+#include "shell.h"
+#include "stream.h"
+#include "memstats.h"
+
+/*
+ * The shell replaces malloc and friends (glibc supports this, see "Replacing malloc" in
+ * its manual) with thin wrappers around the glibc allocator. Each block gets a header
+ * with its size and the subsystem it was allocated for, so every allocation of the
+ * process is counted, including those made by libc for the shell (getline, strdup,
+ * fopen), and a block can be freed anywhere.
+ */
+
+typedef struct BlockHeader {
+    size_t size;                // bytes requested
+    uint32_t subsystem;
+    uint32_t offset;            // from the start of the glibc block, for aligned blocks
+} BlockHeader;                  // 16 bytes, so blocks keep the alignment of malloc
+
+typedef struct SubsystemStats {
+    long long bytes;
+    long long blocks;
+    long long allocations;
+} SubsystemStats;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *p);
+
+static const char *subsystemNames[MEM_SUBSYSTEMS] = {
+    "other", "scanner", "parser", "builtins", "scripts", "line editor", "streams"
+};
+
+static SubsystemStats stats[MEM_SUBSYSTEMS];
+static long long heapBytes, peakBytes, allocations;
+static __thread MemSubsystem currentSubsystem = MEM_OTHER;
+
+static long long lineCount, lineAllocations, maxLineAllocations, lastLineAllocations;
+static long long allocationsAtLine, bytesAtFirstLine;
+static pid_t leakReportPid = -1;
+
+/**
+ * The function memEnter makes the calling thread count its allocations for \param subsystem.
+ * @return the subsystem entered before, to be passed to memLeave.
+ */
+MemSubsystem memEnter(MemSubsystem subsystem) {
+    MemSubsystem previous = currentSubsystem;
+    currentSubsystem = subsystem;
+    return previous;
+}
+
+void memLeave(MemSubsystem previous) {
+    currentSubsystem = previous;
+}
+
+static void account(uint32_t subsystem, long long bytes, long long blocks, long long count) {
+    SubsystemStats *s = &stats[subsystem < MEM_SUBSYSTEMS ? subsystem : MEM_OTHER];
+    __atomic_add_fetch(&s->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->blocks, blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->allocations, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&allocations, count, __ATOMIC_RELAXED);
+    long long current = __atomic_add_fetch(&heapBytes, bytes, __ATOMIC_RELAXED);
+    long long peak = __atomic_load_n(&peakBytes, __ATOMIC_RELAXED);
+    while (current > peak && !__atomic_compare_exchange_n(&peakBytes, &peak, current, true,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void *track(BlockHeader *h, size_t size, size_t offset) {
+    if (h == NULL)
+        return NULL;
+    h->size = size;
+    h->subsystem = currentSubsystem;
+    h->offset = (uint32_t)offset;
+    account(h->subsystem, (long long)size, 1, 1);
+    return h + 1;
+}
+
+static BlockHeader *headerOf(void *p) {
+    return (BlockHeader *)p - 1;
+}
+
+void *malloc(size_t size) {
+    if (size > SIZE_MAX - sizeof(BlockHeader)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return track(__libc_malloc(size + sizeof(BlockHeader)), size, 0);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (size != 0 && count > (SIZE_MAX - sizeof(BlockHeader)) / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return track(__libc_calloc(1, count * size + sizeof(BlockHeader)), count * size, 0);
+}
+
+void free(void *p) {
+    if (p == NULL)
+        return;
+    BlockHeader *h = headerOf(p);
+    account(h->subsystem, -(long long)h->size, -1, 0);
+    __libc_free((char *)h - h->offset);
+}
+
+void *realloc(void *p, size_t size) {
+    if (p == NULL)
+        return malloc(size);
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+    BlockHeader *h = headerOf(p);
+    if (h->offset != 0 || size > SIZE_MAX - sizeof(BlockHeader)) {     // aligned: move it
+        void *q = malloc(size);
+        if (q != NULL) {
+            memcpy(q, p, h->size < size ? h->size : size);
+            free(p);
+        }
+        return q;
+    }
+    size_t old = h->size;
+    uint32_t subsystem = h->subsystem;
+    h = __libc_realloc(h, size + sizeof(BlockHeader));
+    if (h == NULL)
+        return NULL;
+    h->size = size;
+    account(subsystem, (long long)size - (long long)old, 0, 1);
+    return h + 1;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (alignment <= sizeof(BlockHeader))
+        return malloc(size);
+    if (size > SIZE_MAX - alignment || (alignment & (alignment - 1)) != 0) {
+        errno = alignment & (alignment - 1) ? EINVAL : ENOMEM;
+        return NULL;
+    }
+    char *raw = __libc_memalign(alignment, size + alignment);
+    if (raw == NULL)
+        return NULL;
+    return track((BlockHeader *)(raw + alignment) - 1, size, alignment - sizeof(BlockHeader));
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *p = memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *result = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *p) {
+    return p == NULL ? 0 : headerOf(p)->size;
+}
+
+/**
+ * The function memLineDone is called when an input line has been handled, to count
+ * the allocations per line and how the heap grows from line to line.
+ */
+void memLineDone() {
+    long long total = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    lastLineAllocations = total - allocationsAtLine;
+    allocationsAtLine = total;
+    if (lineCount++ == 0)
+        bytesAtFirstLine = __atomic_load_n(&heapBytes, __ATOMIC_RELAXED);
+    else
+        lineAllocations += lastLineAllocations;     // the first line includes startup
+    if (lastLineAllocations > maxLineAllocations)
+        maxLineAllocations = lastLineAllocations;
+}
+
+static void reportLeaks() {
+    if (getpid() != leakReportPid)
+        return;                             // a child of the shell exiting
+    fprintf(stderr, "memstats: still allocated at exit:\n");
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        if (stats[i].blocks != 0)
+            fprintf(stderr, "  %-12s %10lld bytes in %lld blocks\n", subsystemNames[i], stats[i].bytes, stats[i].blocks);
+    }
+}
+
+/**
+ * The function enableLeakReport reports the memory still allocated per subsystem when
+ * the shell exits, if $SHELL_LEAK_REPORT is set.
+ */
+void enableLeakReport() {
+    char *env = getenv(LEAK_REPORT_ENV);
+    if (env == NULL || *env == '\0' || leakReportPid != -1)
+        return;
+    leakReportPid = getpid();
+    atexit(reportLeaks);
+}
+
+/**
+ * The function command_memstats is one of the built-in commands of the shell.
+ * Prints the heap in use, its peak, the allocations per input line and the heap
+ * per subsystem.
+ * @return the exit code of the command.
+ */
+int command_memstats(int argc, char **argv) {
+    int jobEntries;
+    size_t jobBytes = jobTableSize(&jobEntries);
+    long long blocks = 0;
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++)
+        blocks += stats[i].blocks;
+
+    shellPrintf("Heap in use: %lld bytes in %lld blocks, peak %lld bytes\n", heapBytes, blocks, peakBytes);
+    shellPrintf("Allocations: %lld in total, %.1f per input line over %lld lines (last %lld, max %lld)\n",
+                allocations, lineCount > 1 ? (double)lineAllocations / (lineCount - 1) : 0.0,
+                lineCount, lastLineAllocations, maxLineAllocations);
+    if (lineCount > 0)
+        shellPrintf("Heap growth since the first line: %+lld bytes\n", heapBytes - bytesAtFirstLine);
+    shellPrintf("%-12s %12s %10s %12s\n", "subsystem", "bytes", "blocks", "allocations");
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++)
+        shellPrintf("%-12s %12lld %10lld %12lld\n", subsystemNames[i], stats[i].bytes, stats[i].blocks, stats[i].allocations);
+    shellPrintf("%-12s %12zu %10s %12s (static, %d jobs)\n", "job table", jobBytes, "-", "-", jobEntries);
+
+    struct mallinfo2 info = mallinfo2();
+    shellPrintf("malloc arenas: %zu bytes in use, %zu free, %zu mmapped\n", info.uordblks, info.fordblks, info.hblkhd);
+    return 0;
+}
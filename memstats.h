@@ -0,0 +1,28 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#define LEAK_REPORT_ENV "SHELL_LEAK_REPORT"
+
+/*
+ * The part of the shell an allocation is counted for: the subsystem the allocating
+ * thread has entered (see memEnter). Memory freed elsewhere is still taken off the
+ * subsystem that allocated it.
+ */
+typedef enum MemSubsystem {
+    MEM_OTHER,
+    MEM_SCANNER,
+    MEM_PARSER,
+    MEM_BUILTINS,
+    MEM_SCRIPTS,
+    MEM_LINEEDIT,
+    MEM_STREAMS,
+    MEM_SUBSYSTEMS
+} MemSubsystem;
+
+MemSubsystem memEnter(MemSubsystem subsystem);
+void memLeave(MemSubsystem previous);
+void memLineDone();
+void enableLeakReport();
+int command_memstats(int argc, char **argv);
+
+#endif
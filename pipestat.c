@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "pipestat.h"
+
+#define TAP_CHUNK (1 << 20)
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The function parsePipeSize parses a pipe capacity such as "1048576", "256k" or "1M".
+ * @return the size in bytes, or -1 if \param s is not a valid size.
+ */
+long parsePipeSize(const char *s) {
+    char *endptr;
+    long size = strtol(s, &endptr, 10);
+    if (endptr == s || size <= 0)
+        return -1;
+    if (*endptr == 'k' || *endptr == 'K') {
+        size *= 1024;
+        endptr++;
+    } else if (*endptr == 'm' || *endptr == 'M') {
+        size *= 1024 * 1024;
+        endptr++;
+    }
+    return *endptr == '\0' ? size : -1;
+}
+
+/**
+ * The function setPipeSize raises the capacity of the pipe of \param fd with F_SETPIPE_SZ.
+ * The kernel rounds the size up to a power of two pages; unprivileged users are
+ * limited by /proc/sys/fs/pipe-max-size.
+ * @return a bool denoting whether the capacity was changed.
+ */
+bool setPipeSize(int fd, long size) {
+    if (fcntl(fd, F_SETPIPE_SZ, (int)size) == -1) {
+        fprintf(stderr, "Error: cannot set pipe size to %ld: %s\n", size, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The function waitFor blocks until \param fd is ready for \param events.
+ * @return the time spent waiting, in seconds.
+ */
+static double waitFor(int fd, short events) {
+    struct pollfd pfd = { fd, events, 0 };
+    double start = now();
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+        ;
+    return now() - start;
+}
+
+/**
+ * The function runPipeTap moves data from the producer's pipe to the consumer's pipe
+ * with non-blocking splices. When a splice cannot proceed, the tap checks which side
+ * is holding it up and accounts the wait to that side.
+ */
+static void *runPipeTap(void *arg) {
+    PipeTap *tap = arg;
+    double start = now();
+
+    while (true) {
+        ssize_t n = splice(tap->in, NULL, tap->out, NULL, TAP_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            tap->bytes += n;
+            continue;
+        }
+        if (n == 0)
+            break;                  // producer closed its end
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            break;                  // consumer is gone (EPIPE)
+
+        struct pollfd pfd = { tap->in, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN))
+            tap->writerBlocked += waitFor(tap->out, POLLOUT);
+        else
+            tap->readerStarved += waitFor(tap->in, POLLIN);
+    }
+
+    tap->seconds = now() - start;
+    close(tap->in);
+    close(tap->out);
+    return NULL;
+}
+
+/**
+ * The function startPipeTap starts the thread of a tap. The tap owns both descriptors
+ * and closes them when the producer is done or the consumer went away.
+ * @return a bool denoting whether the tap was started.
+ */
+bool startPipeTap(PipeTap *tap) {
+    tap->bytes = 0;
+    tap->seconds = tap->writerBlocked = tap->readerStarved = 0;
+    tap->capacity = fcntl(tap->out, F_GETPIPE_SZ);
+
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int error = pthread_create(&tap->thread, NULL, runPipeTap, tap);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (error != 0) {
+        errno = error;
+        perror("pthread_create");
+        return false;
+    }
+    return true;
+}
+
+void finishPipeTap(PipeTap *tap) {
+    pthread_join(tap->thread, NULL);
+}
+
+/**
+ * The function printPipeTap reports the traffic of a tap on stderr. A pipe whose
+ * writer was blocked more than its reader was starved points at a slow consumer,
+ * and the other way around.
+ * @param index position of the pipe in the pipeline, starting at 1.
+ */
+void printPipeTap(int index, PipeTap *tap) {
+    double throughput = tap->seconds > 0 ? tap->bytes / tap->seconds / (1024 * 1024) : 0;
+    fprintf(stderr, "pipe %d (%s -> %s): %llu bytes in %.3f s, %.2f MiB/s, capacity %d, "
+                    "writer blocked %.3f s, reader starved %.3f s, %s-bound\n",
+            index, tap->producer, tap->consumer, tap->bytes, tap->seconds, throughput, tap->capacity,
+            tap->writerBlocked, tap->readerStarved,
+            tap->writerBlocked > tap->readerStarved ? "consumer" : "producer");
+}
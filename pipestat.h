@@ -0,0 +1,32 @@
+#ifndef PIPESTAT_H
+#define PIPESTAT_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * A PipeTap sits between two stages of a pipeline: the producer writes into one
+ * pipe, the tap splices the data into a second pipe that the consumer reads. The
+ * data is moved between the pipes by the kernel without being copied, while the
+ * tap counts the bytes and the time each side spent waiting for the other.
+ */
+typedef struct PipeTap {
+    pthread_t thread;
+    int in;                         // read end of the producer's pipe
+    int out;                        // write end of the consumer's pipe
+    char *producer;
+    char *consumer;
+    unsigned long long bytes;
+    double seconds;                 // time from start until the producer closed the pipe
+    double writerBlocked;           // time the consumer's pipe was full
+    double readerStarved;           // time the producer's pipe was empty
+    int capacity;
+} PipeTap;
+
+long parsePipeSize(const char *s);
+bool setPipeSize(int fd, long size);
+bool startPipeTap(PipeTap *tap);
+void finishPipeTap(PipeTap *tap);
+void printPipeTap(int index, PipeTap *tap);
+
+#endif
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scanner.h"
+#include "shell.h"
+#include "vars.h"
+#include "stream.h"
+#include "functions.h"
+#include "record.h"
+#include "spawn.h"
+#include "prefetch.h"
+
+typedef enum PrefetchState {
+    PREFETCH_UNSEEN,            // launched without having been prefetched
+    PREFETCH_QUEUED,
+    PREFETCH_DONE,
+    PREFETCH_FAILED             // not found on PATH
+} PrefetchState;
+
+typedef struct PrefetchEntry {
+    char *name;                 // the command as written, NULL for a free slot
+    PrefetchState state;
+    bool launched;              // a launch has been counted since it was queued
+    int64_t finished;           // when the prefetch ended
+    int64_t cost;               // time spent reading files that were not cached
+} PrefetchEntry;
+
+typedef struct PrefetchStats {
+    long queued;
+    long dropped;               // queue or table full
+    long prefetched;
+    long notFound;
+    long filesRead;             // files with pages that were not cached
+    long filesCached;           // files that were cached already
+    long long bytesRead;
+    int64_t readTime;
+    long hits;
+    long late;
+    long unpredicted;
+    int64_t saved;
+} PrefetchStats;
+
+bool prefetchEnabled = true;
+
+static PrefetchEntry table[PREFETCH_TABLE_SIZE];
+static int tableUsed = 0;
+static char *queue[PREFETCH_QUEUE_SIZE];
+static int queueHead = 0;
+static int queueLength = 0;
+static PrefetchStats stats;
+static bool threadStarted = false;
+static pthread_mutex_t prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetchWork = PTHREAD_COND_INITIALIZER;
+
+// Directories searched for shared libraries after LD_LIBRARY_PATH.
+static const char *libraryDirectories[] = {
+        "/lib/x86_64-linux-gnu",
+        "/usr/lib/x86_64-linux-gnu",
+        "/lib/aarch64-linux-gnu",
+        "/usr/lib/aarch64-linux-gnu",
+        "/lib64",
+        "/usr/lib64",
+        "/lib",
+        "/usr/lib",
+        "/usr/local/lib",
+        NULL
+};
+
+/**
+ * The function findEntry looks up \param name in the table, adding it if \param add.
+ * Called with prefetchLock held.
+ * @return the entry, or NULL if it is not there (or the table is full).
+ */
+static PrefetchEntry *findEntry(const char *name, bool add) {
+    unsigned long h = 5381;
+    for (const char *s = name; *s != '\0'; s++)
+        h = h * 33 + (unsigned char)*s;
+    unsigned long i = h & (PREFETCH_TABLE_SIZE - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0)
+        i = (i + 1) & (PREFETCH_TABLE_SIZE - 1);
+    if (table[i].name != NULL)
+        return &table[i];
+    if (!add || 4 * (tableUsed + 1) > 3 * PREFETCH_TABLE_SIZE)
+        return NULL;
+    table[i].name = strdup(name);
+    if (table[i].name == NULL)
+        return NULL;
+    table[i].state = PREFETCH_UNSEEN;
+    table[i].launched = false;
+    tableUsed++;
+    return &table[i];
+}
+
+/**
+ * The function findExecutable finds the file that execvp would run for \param name.
+ * @return a bool denoting whether it was found.
+ */
+static bool findExecutable(const char *name, char *path, size_t size) {
+    struct stat st;
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, size, "%s", name);
+        return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    }
+    const char *dirs = getenv("PATH");
+    if (dirs == NULL)
+        dirs = "/usr/local/bin:/usr/bin:/bin";
+    while (*dirs != '\0') {
+        size_t n = strcspn(dirs, ":");
+        int len = snprintf(path, size, "%.*s/%s", (int)(n == 0 ? 1 : n), n == 0 ? "." : dirs, name);
+        if (len > 0 && (size_t)len < size && access(path, X_OK) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            return true;
+        dirs += n;
+        if (*dirs == ':')
+            dirs++;
+    }
+    return false;
+}
+
+static bool addFile(char **files, int *count, const char *path) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(files[i], path) == 0)
+            return true;
+    }
+    if (*count == PREFETCH_MAX_FILES)
+        return false;
+    files[*count] = strdup(path);
+    if (files[*count] != NULL)
+        (*count)++;
+    return true;
+}
+
+/**
+ * The function addLibrary finds shared library \param name the way the dynamic linker
+ * does, in LD_LIBRARY_PATH and the default directories, and adds it to \param files.
+ * The cache of ld.so is not consulted, so libraries in unusual places are missed.
+ */
+static void addLibrary(char **files, int *count, const char *name) {
+    char path[PATH_MAX];
+    if (strchr(name, '/') != NULL) {
+        addFile(files, count, name);
+        return;
+    }
+    const char *dirs = getenv("LD_LIBRARY_PATH");
+    while (dirs != NULL && *dirs != '\0') {
+        size_t n = strcspn(dirs, ":");
+        int len = snprintf(path, sizeof(path), "%.*s/%s", (int)n, dirs, name);
+        if (n > 0 && len > 0 && (size_t)len < sizeof(path) && access(path, R_OK) == 0) {
+            addFile(files, count, path);
+            return;
+        }
+        dirs += n;
+        if (*dirs == ':')
+            dirs++;
+    }
+    for (int i = 0; libraryDirectories[i] != NULL; i++) {
+        int len = snprintf(path, sizeof(path), "%s/%s", libraryDirectories[i], name);
+        if (len > 0 && (size_t)len < sizeof(path) && access(path, R_OK) == 0) {
+            addFile(files, count, path);
+            return;
+        }
+    }
+}
+
+/**
+ * The function addDependencies adds the interpreter of a script ("#!"), or the ELF
+ * interpreter and the DT_NEEDED libraries of a 64-bit ELF file, to \param files.
+ * @param map the contents of the file.
+ */
+static void addDependencies(const unsigned char *map, size_t size, char **files, int *count) {
+    if (size > 2 && map[0] == '#' && map[1] == '!') {
+        char interpreter[PATH_MAX];
+        size_t i = 2, n = 0;
+        while (i < size && (map[i] == ' ' || map[i] == '\t'))
+            i++;
+        while (i < size && n + 1 < sizeof(interpreter) && !isspace(map[i]))
+            interpreter[n++] = map[i++];
+        interpreter[n] = '\0';
+        if (n > 0)
+            addFile(files, count, interpreter);
+        return;
+    }
+
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)map;
+    if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64
+        || eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_phoff > size
+        || (size - eh->e_phoff) / sizeof(Elf64_Phdr) < eh->e_phnum)
+        return;
+    const Elf64_Phdr *ph = (const Elf64_Phdr *)(map + eh->e_phoff);
+    const Elf64_Dyn *dynamic = NULL;
+    size_t dynamicCount = 0;
+    for (int i = 0; i < eh->e_phnum; i++) {
+        if (ph[i].p_offset > size || ph[i].p_filesz > size - ph[i].p_offset)
+            continue;
+        if (ph[i].p_type == PT_INTERP && ph[i].p_filesz > 0 && memchr(map + ph[i].p_offset, '\0', ph[i].p_filesz) != NULL)
+            addFile(files, count, (const char *)map + ph[i].p_offset);
+        else if (ph[i].p_type == PT_DYNAMIC) {
+            dynamic = (const Elf64_Dyn *)(map + ph[i].p_offset);
+            dynamicCount = ph[i].p_filesz / sizeof(Elf64_Dyn);
+        }
+    }
+
+    // The string table is given by its address; find its offset through the segments.
+    uint64_t strtab = 0, strsz = 0;
+    for (size_t i = 0; i < dynamicCount && dynamic[i].d_tag != DT_NULL; i++) {
+        if (dynamic[i].d_tag == DT_STRTAB)
+            strtab = dynamic[i].d_un.d_ptr;
+        else if (dynamic[i].d_tag == DT_STRSZ)
+            strsz = dynamic[i].d_un.d_val;
+    }
+    uint64_t strings = 0;
+    bool found = false;
+    for (int i = 0; i < eh->e_phnum && !found; i++) {
+        if (ph[i].p_type == PT_LOAD && strtab >= ph[i].p_vaddr && strtab - ph[i].p_vaddr < ph[i].p_filesz) {
+            strings = ph[i].p_offset + (strtab - ph[i].p_vaddr);
+            found = true;
+        }
+    }
+    if (!found || strings >= size)
+        return;
+    if (strsz == 0 || strsz > size - strings)
+        strsz = size - strings;
+    for (size_t i = 0; i < dynamicCount && dynamic[i].d_tag != DT_NULL; i++) {
+        uint64_t name = dynamic[i].d_un.d_val;
+        if (dynamic[i].d_tag == DT_NEEDED && name < strsz && memchr(map + strings + name, '\0', strsz - name) != NULL)
+            addLibrary(files, count, (const char *)map + strings + name);
+    }
+}
+
+/**
+ * The function prefetchFile reads the pages of \param path that are not in the page
+ * cache, and adds its dependencies to \param files.
+ * @return the time spent reading, 0 if the file was cached.
+ */
+static int64_t prefetchFile(const char *path, char **files, int *count) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + pageSize - 1) / pageSize;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *resident = malloc(pages);
+    size_t missing = pages;
+    if (map != MAP_FAILED && resident != NULL && mincore(map, size, resident) == 0) {
+        missing = 0;
+        for (size_t i = 0; i < pages; i++)
+            missing += (resident[i] & 1) == 0;
+    }
+    free(resident);
+
+    int64_t cost = 0;
+    if (missing > 0) {
+        int64_t start = monotonicNow();
+        if (readahead(fd, 0, size) == -1)
+            posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+        cost = monotonicNow() - start;
+    }
+    if (map != MAP_FAILED) {
+        addDependencies(map, size, files, count);
+        munmap(map, size);
+    }
+    close(fd);
+
+    pthread_mutex_lock(&prefetchLock);
+    if (missing > 0) {
+        stats.filesRead++;
+        stats.bytesRead += (long long)missing * pageSize;
+        stats.readTime += cost;
+    } else {
+        stats.filesCached++;
+    }
+    pthread_mutex_unlock(&prefetchLock);
+    return cost;
+}
+
+/**
+ * The function prefetchExecutable prefetches the executable that \param name runs and
+ * the files it depends on.
+ * @return whether the executable was found.
+ */
+static bool prefetchExecutable(const char *name, int64_t *cost) {
+    char path[PATH_MAX];
+    char *files[PREFETCH_MAX_FILES];
+    int count = 0;
+    *cost = 0;
+    if (!findExecutable(name, path, sizeof(path)) || !addFile(files, &count, path))
+        return false;
+    for (int i = 0; i < count; i++)             // files found along the way are appended
+        *cost += prefetchFile(files[i], files, &count);
+    for (int i = 0; i < count; i++)
+        free(files[i]);
+    return true;
+}
+
+static void *prefetchThread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&prefetchLock);
+    while (true) {
+        while (queueLength == 0)
+            pthread_cond_wait(&prefetchWork, &prefetchLock);
+        char *name = queue[queueHead];
+        queueHead = (queueHead + 1) % PREFETCH_QUEUE_SIZE;
+        queueLength--;
+        pthread_mutex_unlock(&prefetchLock);
+
+        int64_t cost;
+        bool found = prefetchExecutable(name, &cost);
+
+        pthread_mutex_lock(&prefetchLock);
+        PrefetchEntry *e = findEntry(name, false);
+        if (e != NULL) {
+            e->state = found ? PREFETCH_DONE : PREFETCH_FAILED;
+            e->finished = monotonicNow();
+            e->cost = cost;
+        }
+        if (found)
+            stats.prefetched++;
+        else
+            stats.notFound++;
+        free(name);
+    }
+    return NULL;
+}
+
+/**
+ * The function stopInChild turns prefetching off in a forked copy of the shell, which
+ * has no prefetch thread; runs with prefetchLock held (see guardAcrossFork).
+ */
+static void stopInChild() {
+    prefetchEnabled = false;
+}
+
+/**
+ * The function startPrefetchThread starts the prefetch thread, with every signal
+ * blocked so they stay with the shell. Called with prefetchLock held.
+ */
+static bool startPrefetchThread() {
+    guardAcrossFork(&prefetchLock, stopInChild);
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    pthread_t thread;
+    threadStarted = pthread_create(&thread, NULL, prefetchThread, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (threadStarted)
+        pthread_detach(thread);
+    return threadStarted;
+}
+
+/**
+ * The function prefetchCommand hands command \param name to the prefetch thread,
+ * unless it has been prefetched recently or is waiting already.
+ */
+void prefetchCommand(const char *name) {
+    if (!prefetchEnabled || *name == '\0')
+        return;
+    pthread_mutex_lock(&prefetchLock);
+    PrefetchEntry *e = findEntry(name, true);
+    if (e != NULL && (e->state == PREFETCH_QUEUED
+                      || (e->state != PREFETCH_UNSEEN
+                          && monotonicNow() - e->finished < (int64_t)PREFETCH_REFRESH_SECONDS * 1000000000))) {
+        pthread_mutex_unlock(&prefetchLock);
+        return;
+    }
+    char *copy = NULL;
+    if (e == NULL || queueLength == PREFETCH_QUEUE_SIZE || (!threadStarted && !startPrefetchThread())
+        || (copy = strdup(name)) == NULL) {
+        stats.dropped++;
+        pthread_mutex_unlock(&prefetchLock);
+        return;
+    }
+    e->state = PREFETCH_QUEUED;
+    e->launched = false;
+    queue[(queueHead + queueLength++) % PREFETCH_QUEUE_SIZE] = copy;
+    stats.queued++;
+    pthread_cond_signal(&prefetchWork);
+    pthread_mutex_unlock(&prefetchLock);
+}
+
+/**
+ * The function prefetchLine prefetches the commands of the line \param tokens: the
+ * first words of its pipeline stages and chains, after prefixes and assignments.
+ * Builtins, functions and words with variables are left out.
+ */
+void prefetchLine(List tokens) {
+    if (!prefetchEnabled)
+        return;
+    bool commandStart = true;
+    for (List l = tokens; l != NULL; l = l->next) {
+        char *t = l->t;
+        if (isOperator(t)) {
+            commandStart = strcmp(t, "<") != 0 && strcmp(t, ">") != 0 && strcmp(t, ">>") != 0
+                           && strcmp(t, "<&") != 0 && strcmp(t, ">&") != 0;
+            continue;
+        }
+        if (!commandStart)
+            continue;
+        bool prefix = false;
+        for (int i = 0; prefixNames[i] != NULL && !prefix; i++)
+            prefix = strcmp(t, prefixNames[i]) == 0;
+        if (prefix || isAssignment(t) || t[0] == '-' || isdigit((unsigned char)t[0]))
+            continue;                           // the command comes later
+        commandStart = false;
+        if (strchr(t, '$') == NULL && !isBuiltIn(t) && !isFunction(t))
+            prefetchCommand(t);
+    }
+}
+
+/**
+ * The function prefetchLaunch counts the launch of command \param name as a hit, late
+ * or not predicted. A command launched again before it is prefetched again is not
+ * counted a second time.
+ */
+void prefetchLaunch(const char *name) {
+    if (!prefetchEnabled)
+        return;
+    pthread_mutex_lock(&prefetchLock);
+    PrefetchEntry *e = findEntry(name, false);
+    if (e == NULL) {
+        if (findEntry(name, true) != NULL)
+            stats.unpredicted++;
+    } else if (!e->launched && e->state == PREFETCH_QUEUED) {
+        stats.late++;
+    } else if (!e->launched && e->state == PREFETCH_DONE) {
+        stats.hits++;
+        stats.saved += e->cost;
+    }
+    if (e != NULL)
+        e->launched = true;
+    pthread_mutex_unlock(&prefetchLock);
+}
+
+/**
+ * The function command_prefetch is one of the built-in commands of the shell.
+ *
+ *     prefetch [on | off]
+ *
+ * Turns prefetching on or off, or prints the setting and the statistics.
+ * @return the exit code of the command.
+ */
+int command_prefetch(int argc, char **argv) {
+    if (argc == 2 && (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0)) {
+        prefetchEnabled = strcmp(argv[1], "on") == 0;
+        return 0;
+    }
+    if (argc != 1) {
+        shellPrintf("Error: usage: prefetch [on | off]!\n");
+        return 2;
+    }
+    pthread_mutex_lock(&prefetchLock);
+    PrefetchStats s = stats;
+    pthread_mutex_unlock(&prefetchLock);
+    long launches = s.hits + s.late + s.unpredicted;
+    shellPrintf("Prefetching executables: %s\n", prefetchEnabled ? "on" : "off");
+    shellPrintf("Commands: %ld queued, %ld prefetched, %ld not found, %ld dropped\n",
+                s.queued, s.prefetched, s.notFound, s.dropped);
+    shellPrintf("Files: %ld read ahead (%.1f MiB in %.3f ms), %ld cached already\n",
+                s.filesRead, s.bytesRead / 1048576.0, s.readTime / 1e6, s.filesCached);
+    shellPrintf("Launches: %ld hits, %ld late, %ld not predicted (hit rate %.1f%%)\n",
+                s.hits, s.late, s.unpredicted, launches > 0 ? 100.0 * s.hits / launches : 0.0);
+    shellPrintf("Latency saved: %.3f ms (reads done ahead of the commands that hit)\n", s.saved / 1e6);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include "scanner.h"
+
+#define PREFETCH_QUEUE_SIZE 64          // commands waiting for the prefetch thread
+#define PREFETCH_TABLE_SIZE 1024        // commands remembered, a power of two
+#define PREFETCH_MAX_FILES 32           // executable, interpreter and libraries of a command
+#define PREFETCH_LOOKAHEAD 8            // instructions of a script looked at ahead of the one running
+#define PREFETCH_REFRESH_SECONDS 30     // a command is prefetched again after this long
+
+/*
+ * While a command runs, the shell looks at the commands that come next (the other
+ * commands of the line, or the next commands of a script) and hands their names to a
+ * thread. The thread finds the executable on PATH, its ELF interpreter and the shared
+ * libraries it needs, and reads the parts of those files that are not in the page
+ * cache (mincore) with readahead, so the exec that follows does not wait for the disk.
+ *
+ * Every launch is checked against what was prefetched: a hit when the prefetch had
+ * finished, late when it was still running, not predicted otherwise. The time the
+ * thread spent reading for the commands that hit is the latency it saved, roughly.
+ */
+extern bool prefetchEnabled;
+
+void prefetchCommand(const char *name);
+void prefetchLine(List tokens);
+void prefetchLaunch(const char *name);
+int command_prefetch(int argc, char **argv);
+
+#endif
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "record.h"
+
+static int recordFd = -1;
+static int64_t sessionStart;
+static int64_t lineStart;
+static int64_t lineCpu;
+
+/**
+ * The function monotonicNow reads CLOCK_MONOTONIC, for the timing throughout the shell.
+ * @return the time in nanoseconds.
+ */
+int64_t monotonicNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t shellCpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return ((int64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000
+           + ((int64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+/**
+ * The function openRecording starts recording the session into \param path, appending
+ * when it exists. Nothing is recorded when \param path is NULL or empty.
+ */
+void openRecording(const char *path) {
+    if (path == NULL || *path == '\0')
+        return;
+    recordFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (recordFd == -1) {
+        printf("Error: cannot open recording %s: %s!\n", path, strerror(errno));
+        return;
+    }
+    if (write(recordFd, RECORD_HEADER, strlen(RECORD_HEADER)) < 0) {
+        close(recordFd);
+        recordFd = -1;
+        return;
+    }
+    sessionStart = monotonicNow();
+}
+
+/**
+ * The function recordBegin marks that an input line has been read and starts to run.
+ */
+void recordBegin() {
+    if (recordFd == -1)
+        return;
+    lineStart = monotonicNow();
+    lineCpu = shellCpuTime();
+}
+
+/**
+ * The function recordEnd appends the line started by recordBegin to the recording.
+ * The entry is written with a single write, so a session that is killed leaves no
+ * half entry behind.
+ */
+void recordEnd(const char *line, int exitCode) {
+    if (recordFd == -1)
+        return;
+    int64_t end = monotonicNow(), cpu = shellCpuTime() - lineCpu;
+
+    size_t length = strlen(line);
+    char *entry = malloc(96 + 2 * length);
+    if (entry == NULL)
+        return;
+    int n = sprintf(entry, "%lld %lld %lld %d ", (long long)(lineStart - sessionStart),
+                    (long long)(end - lineStart), (long long)cpu, exitCode);
+    for (const char *p = line; *p != '\0'; p++) {
+        if (*p == '\n' || *p == '\t' || *p == '\\') {
+            entry[n++] = '\\';
+            entry[n++] = *p == '\n' ? 'n' : *p == '\t' ? 't' : '\\';
+        } else {
+            entry[n++] = *p;
+        }
+    }
+    entry[n++] = '\n';
+    if (write(recordFd, entry, n) < 0)
+        perror("recording");
+    free(entry);
+}
+
+/**
+ * The function readRecordedLine reads the next entry of a recording; comment lines
+ * (such as the header of every session) are skipped.
+ * @param record is filled in; record->line is allocated and must be freed.
+ * @return a bool denoting whether an entry was read.
+ */
+bool readRecordedLine(FILE *f, RecordedLine *record) {
+    char *text = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&text, &capacity, f)) != -1) {
+        long long start, duration, cpu;
+        int offset;
+        if (text[0] == '#' || sscanf(text, "%lld %lld %lld %d %n", &start, &duration, &cpu,
+                                     &record->exitCode, &offset) != 4)
+            continue;
+        record->start = start;
+        record->duration = duration;
+        record->shellCpu = cpu;
+
+        char *out = text, *p = text + offset;
+        for (; *p != '\0' && *p != '\n'; p++) {
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+                *out++ = *p == 'n' ? '\n' : *p == 't' ? '\t' : *p;
+            } else {
+                *out++ = *p;
+            }
+        }
+        *out = '\0';
+        record->line = text;
+        return true;
+    }
+    free(text);
+    return false;
+}
@@ -0,0 +1,35 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RECORD_ENV "SHELL_RECORD"
+#define RECORD_HEADER "# shell recording v1\n"
+
+/*
+ * A recording has one line per input line of an interactive session:
+ *
+ *     <start> <duration> <shell cpu> <exit code> <input line>
+ *
+ * The times are in nanoseconds: start since the start of the session (when the line
+ * had been read), duration until the line was done, and the CPU time the shell itself
+ * (not its children) spent on it. Newlines, tabs and backslashes of the input line
+ * are escaped with a backslash; a compound command is one entry with all its lines.
+ */
+typedef struct RecordedLine {
+    int64_t start;
+    int64_t duration;
+    int64_t shellCpu;
+    int exitCode;
+    char *line;
+} RecordedLine;
+
+int64_t monotonicNow();
+void openRecording(const char *path);
+void recordBegin();
+void recordEnd(const char *line, int exitCode);
+bool readRecordedLine(FILE *f, RecordedLine *record);
+
+#endif
@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "record.h"
+
+/*
+ * shell-replay feeds a session recorded with SHELL_RECORD (see record.h) back through
+ * a shell, as fast as possible or at the recorded pace, and compares the latency of
+ * the lines in the recording with the latency they have now. The replayed shell
+ * records itself into a temporary file, so both sides are measured the same way.
+ *
+ * Usage: shell-replay [-s shell] [-p] [-o] [-n slowest] recording
+ */
+
+typedef struct Recording {
+    RecordedLine *lines;
+    int count;
+    int capacity;
+} Recording;
+
+static void usage() {
+    fprintf(stderr, "Usage: shell-replay [-s shell] [-p] [-o] [-n slowest] recording\n");
+    exit(2);
+}
+
+static bool loadRecording(const char *path, Recording *r) {
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+        return false;
+    RecordedLine line;
+    while (readRecordedLine(f, &line)) {
+        if (r->count == r->capacity) {
+            r->capacity = r->capacity == 0 ? 1024 : 2 * r->capacity;
+            r->lines = realloc(r->lines, r->capacity * sizeof(*r->lines));
+            if (r->lines == NULL) {
+                perror("shell-replay");
+                exit(1);
+            }
+        }
+        r->lines[r->count++] = line;
+    }
+    fclose(f);
+    return true;
+}
+
+static bool writeFully(int fd, const char *p, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * The function formatTime prints a duration in nanoseconds with a fitting unit.
+ */
+static char *formatTime(int64_t ns, char *buf, size_t size) {
+    if (ns < 1000)
+        snprintf(buf, size, "%lldns", (long long)ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+static int compareTimes(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * The function printDistribution prints the latency percentiles of the lines of a
+ * recording, their total and the CPU time the shell itself spent on them.
+ */
+static void printDistribution(const char *name, const Recording *r) {
+    int64_t *latency = malloc((r->count + 1) * sizeof(*latency));
+    int64_t total = 0, cpu = 0;
+    for (int i = 0; i < r->count; i++) {
+        latency[i] = r->lines[i].duration;
+        total += latency[i];
+        cpu += r->lines[i].shellCpu;
+    }
+    qsort(latency, r->count, sizeof(*latency), compareTimes);
+
+    char t[6][32];
+    int n = r->count;
+    printf("%-9s %6d %10s %10s %10s %10s %10s %10s\n", name, n,
+           formatTime(n ? latency[n / 2] : 0, t[0], 32),
+           formatTime(n ? latency[n * 9 / 10] : 0, t[1], 32),
+           formatTime(n ? latency[n * 99 / 100] : 0, t[2], 32),
+           formatTime(n ? latency[n - 1] : 0, t[3], 32),
+           formatTime(total, t[4], 32), formatTime(cpu, t[5], 32));
+    free(latency);
+}
+
+/**
+ * The function replay starts \param shell with its stdin on a pipe, feeds it the lines
+ * of \param r and waits for it to exit.
+ * @return the wall-clock time of the replay, or -1 if the shell could not be started.
+ */
+static int64_t replay(const char *shell, const Recording *r, bool paced, bool keepOutput) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        return -1;
+    pid_t pid = fork();
+    if (pid == -1)
+        return -1;
+    if (pid == 0) {
+        dup2(pipefd[0], STDIN_FILENO);
+        if (!keepOutput) {
+            int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execl(shell, shell, (char *)NULL);
+        perror("shell-replay: exec");
+        _exit(127);
+    }
+    close(pipefd[0]);
+
+    int64_t start = monotonicNow();
+    for (int i = 0; i < r->count; i++) {
+        if (paced) {
+            int64_t due = start + r->lines[i].start - r->lines[0].start, now = monotonicNow();
+            if (due > now) {
+                struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+                while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+                    ;
+            }
+        }
+        if (!writeFully(pipefd[1], r->lines[i].line, strlen(r->lines[i].line)) || !writeFully(pipefd[1], "\n", 1))
+            break;                          // the shell exited early
+    }
+    close(pipefd[1]);
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    return monotonicNow() - start;
+}
+
+int main(int argc, char *argv[]) {
+    const char *shell = "./shell";
+    bool paced = false, keepOutput = false;
+    long slowest = 5;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            shell = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0)
+            paced = true;
+        else if (strcmp(argv[i], "-o") == 0)
+            keepOutput = true;
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            slowest = strtol(argv[++i], NULL, 10);
+        else
+            usage();
+    }
+    if (i != argc - 1)
+        usage();
+
+    Recording recorded = { NULL, 0, 0 }, replayed = { NULL, 0, 0 };
+    if (!loadRecording(argv[i], &recorded)) {
+        perror("shell-replay");
+        return 1;
+    }
+
+    char temp[] = "/tmp/shell-replay-XXXXXX";
+    int fd = mkstemp(temp);
+    if (fd == -1) {
+        perror("shell-replay");
+        return 1;
+    }
+    close(fd);
+    setenv(RECORD_ENV, temp, 1);
+    signal(SIGPIPE, SIG_IGN);
+
+    int64_t wall = replay(shell, &recorded, paced, keepOutput);
+    bool loaded = loadRecording(temp, &replayed);
+    unlink(temp);
+    if (wall == -1 || !loaded) {
+        fprintf(stderr, "shell-replay: cannot run %s\n", shell);
+        return 1;
+    }
+
+    char t[2][32];
+    printf("%-9s %6s %10s %10s %10s %10s %10s %10s\n", "", "lines", "p50", "p90", "p99", "max", "total", "shell cpu");
+    printDistribution("recorded", &recorded);
+    printDistribution("replayed", &replayed);
+
+    int64_t cpu = 0;
+    int differ = 0;
+    for (int j = 0; j < replayed.count; j++) {
+        cpu += replayed.lines[j].shellCpu;
+        if (j < recorded.count && replayed.lines[j].exitCode != recorded.lines[j].exitCode)
+            differ++;
+    }
+    printf("\nreplay took %s%s, the shell itself used %s of CPU (%.1f%%)\n", formatTime(wall, t[0], 32),
+           paced ? " at the recorded pace" : "", formatTime(cpu, t[1], 32), wall > 0 ? 100.0 * cpu / wall : 0);
+    if (differ > 0 || replayed.count != recorded.count)
+        printf("%d of %d lines replayed, %d with a different exit code\n", replayed.count, recorded.count, differ);
+
+    if (slowest > 0 && replayed.count > 0) {
+        printf("\nslowest lines:\n");
+        RecordedLine **order = malloc(replayed.count * sizeof(*order));
+        for (int j = 0; j < replayed.count; j++)
+            order[j] = &replayed.lines[j];
+        for (int j = 0; j < replayed.count && j < slowest; j++) {
+            for (int k = j + 1; k < replayed.count; k++) {
+                if (order[k]->duration > order[j]->duration) {
+                    RecordedLine *swap = order[j];
+                    order[j] = order[k];
+                    order[k] = swap;
+                }
+            }
+            printf("%10s  ", formatTime(order[j]->duration, t[0], 32));
+            for (const char *c = order[j]->line; *c != '\0'; c++)
+                printf(*c == '\n' ? "\n            " : "%c", *c);     // a compound command spans lines
+            printf("\n");
+        }
+        free(order);
+    }
+    return 0;
+}
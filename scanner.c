@@ -1,12 +1,25 @@
 #define _GNU_SOURCE
 #include "scanner.h"
+#include "lineedit.h"
+#include "stream.h"
+#include "memstats.h"
 #include <sys/types.h>
+#include <unistd.h>
 
 /**
- * Reads an inputline from stdin.
+ * Reads an inputline from stdin. When stdin is a terminal the line editor
+ * (with tab completion) is used instead of reading raw bytes.
  * @return a string containing the inputline.
  */
 char *readInputLine() {
+    shellFlush();
+    if (isatty(STDIN_FILENO)) {
+        MemSubsystem previous = memEnter(MEM_LINEEDIT);
+        char *line = editLine();
+        memLeave(previous);
+        return line;
+    }
+
     int strLen = INITIAL_STRING_SIZE;
     int c = getchar();
     int i = 0;
@@ -90,13 +103,18 @@ char *matchIdentifier(char *s, int *start) {
     assert(ident != NULL);
 
     bool quoteStarted = false;
-    size_t lenS = strlen(s);
-    while ((*start + offset <= lenS && !isspace(s[*start + offset]) && !isOperatorCharacter(s[*start + offset])) || quoteStarted) { // Ensure that whitespace in strings is accepted
+    int arithmeticDepth = 0; // parentheses open in a $((...)), which may contain spaces and operators
+    while (s[*start + offset] != '\0' && (quoteStarted || arithmeticDepth > 0 || (!isspace(s[*start + offset]) && !isOperatorCharacter(s[*start + offset])))) { // Ensure that whitespace in strings is accepted
         if (s[*start + offset] == '\"') { // Strip the quotes from the input before storing in the identifier
             quoteStarted = !quoteStarted;
             offset++;
             continue;
         }
+        if (s[*start + offset] == '(' && (arithmeticDepth > 0 || (offset > 0 && strncmp(s + *start + offset - 1, "$((", 3) == 0))) {
+            arithmeticDepth++;
+        } else if (s[*start + offset] == ')' && arithmeticDepth > 0) {
+            arithmeticDepth--;
+        }
         ident[pos++] = s[*start + offset++];
         if (pos >= strLen) { // Resize the string if necessary
             strLen = 2 * strLen;
@@ -138,7 +156,7 @@ char *matchOperator(char *s, int *start) {
     char *op = malloc((strLen + 1) * sizeof(*op));
     assert(op != NULL);
 
-    while (isOperatorCharacter(s[*start + offset])) {
+    while (pos < strLen && isOperatorCharacter(s[*start + offset])) {
         op[pos++] = s[*start + offset++];
     }
     op[pos] = '\0';
@@ -163,6 +181,7 @@ List newOperatorNode(char *s, int *start) {
 
 /**
  * The function tokenList reads an array and puts the tokens that are read in a list.
+ * A word starting with '#' starts a comment, which is skipped.
  * @param s input string.
  * @return a pointer to the beginning of the list.
  */
@@ -175,7 +194,9 @@ List getTokenList(char *s) {
     while (i < length) {
         if (isspace(s[i])) { // spaces are skipped
             i++;
-        }else {
+        } else if (s[i] == '#') { // a comment runs until the end of the line
+            break;
+        } else {
             node = isOperatorCharacter(s[i]) ? newOperatorNode(s, &i) : newNode(s, &i);
             if (lastNode == NULL) { // there is no list yet
                 tl = node;
@@ -203,25 +224,25 @@ bool isEmpty(List l) {
  */
 void printList(List li) {
     if (li == NULL) return;
-    printf("\"%s\"", li->t);
+    shellPrintf("\"%s\"", li->t);
     li = li->next;
     while (li != NULL) {
-        printf(", \"%s\"", li->t);
+        shellPrintf(", \"%s\"", li->t);
         li = li->next;
     }
-    printf("\n");
+    shellPrintf("\n");
 }
 
 /**
  * The function freeTokenlist frees the memory of the nodes of the list, and of the strings
- * in the nodes.
+ * in the nodes. The list is walked in a loop, so long lists do not exhaust the stack.
  * @param li the starting node of a list.
  */
 void freeTokenList(List li) {
-    if (li == NULL) {
-        return;
+    while (li != NULL) {
+        List next = li->next;
+        free(li->t);
+        free(li);
+        li = next;
     }
-    free(li->t);
-    freeTokenList(li->next);
-    free(li);
 }
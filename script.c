@@ -0,0 +1,1024 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scanner.h"
+#include "shell.h"
+#include "vars.h"
+#include "script.h"
+#include "cache.h"
+#include "memstats.h"
+#include "functions.h"
+#include "prefetch.h"
+
+/*
+ * Scripts and compound commands (if, while, until, for, case) are compiled once into
+ * a small bytecode. Every simple command becomes an OP_RUN instruction that holds the
+ * token list of the command, which is handed to parseInputLine each time it runs;
+ * the control structures become jumps. A loop body is therefore lexed and split into
+ * commands only once, however often it runs.
+ *
+ * The body of a function is compiled in place, between an OP_FUNCTION that skips it and
+ * an OP_RETURN. Running OP_FUNCTION defines the function (see functions.h), and a call
+ * runs the body of the program from there, so a function is not parsed again either.
+ */
+
+typedef struct ForState                                             // runtime state of a loop
+{
+    char *text;             // expanded items, separated by '\0'
+    size_t textCapacity;
+    char **items;
+    int itemCapacity;
+    int count;
+    int next;
+    int status;             // exit code of the body of a while or until loop
+} ForState;
+
+typedef struct CaseState                                            // runtime state of a case
+{
+    char *word;
+    size_t capacity;
+} CaseState;
+
+typedef struct Loop                                                 // loop being compiled
+{
+    int continueTarget;
+    int *breaks;            // jumps to patch with the end of the loop
+    int breakCount;
+    struct Loop *outer;
+} Loop;
+
+typedef struct Compiler
+{
+    Program *program;
+    List pending;           // rest of the current line
+    LineReader readLine;
+    void *context;
+    bool wholeInput;        // false: stop at the end of a line outside compound commands
+    int depth;              // nesting level of compound commands
+    int line;
+    Loop *loop;
+    bool function;          // compiling the body of a function, where return is allowed
+} Compiler;
+
+// NULL-terminated list of words that start a compound command.
+static char *blockWords[] = {
+        "if",
+        "while",
+        "until",
+        "for",
+        "case",
+        NULL
+};
+
+// NULL-terminated list of words that may only appear inside a compound command.
+static char *reservedWords[] = {
+        "then",
+        "elif",
+        "else",
+        "fi",
+        "do",
+        "done",
+        "in",
+        "esac",
+        ";;",
+        "}",
+        NULL
+};
+
+static bool isName(char *s)
+{
+    if (!isalpha((unsigned char)*s) && *s != '_')
+        return false;
+    while (isalnum((unsigned char)*s) || *s == '_')
+        s++;
+    return *s == '\0';
+}
+
+static bool isWordIn(char *s, char **words)
+{
+    for (int i = 0; words[i] != NULL; i++) {
+        if (strcmp(s, words[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The function functionHeader checks whether \param tokens start with "name()" or
+ * "name ()".
+ * @return the number of tokens of the header, or 0 if there is none.
+ */
+static int functionHeader(List tokens)
+{
+    if (tokens == NULL)
+        return 0;
+    size_t len = strlen(tokens->t);
+    if (len > 2 && strcmp(tokens->t + len - 2, "()") == 0) {
+        tokens->t[len - 2] = '\0';
+        bool name = isName(tokens->t);
+        tokens->t[len - 2] = '(';
+        return name ? 1 : 0;
+    }
+    return isName(tokens->t) && tokens->next != NULL && strcmp(tokens->next->t, "()") == 0 ? 2 : 0;
+}
+
+/**
+ * The function startsBlock checks whether the line \param tokens starts with a compound
+ * command or a function definition.
+ */
+bool startsBlock(List tokens)
+{
+    return tokens != NULL && (isWordIn(tokens->t, blockWords) || functionHeader(tokens) > 0);
+}
+
+static void syntaxError(Compiler *c, char *near)
+{
+    printf("Error: syntax error near '%s' on line %d!\n", near == NULL ? "end of file" : near, c->line);
+}
+
+static int emit(Compiler *c, OpCode op)
+{
+    Program *p = c->program;
+    if (p->length == p->capacity) {
+        p->capacity = p->capacity == 0 ? 16 : 2 * p->capacity;
+        p->code = realloc(p->code, p->capacity * sizeof(*p->code));
+        assert(p->code != NULL);
+    }
+    Instruction *in = &p->code[p->length];
+    memset(in, 0, sizeof(*in));
+    in->op = op;
+    return p->length++;
+}
+
+static void patch(Compiler *c, int at)
+{
+    c->program->code[at].target = c->program->length;
+}
+
+/**
+ * The function fillPending makes sure there are tokens left on the current line,
+ * reading further lines while inside a compound command (or when compiling a file).
+ * @return a bool denoting whether there are tokens.
+ */
+static bool fillPending(Compiler *c)
+{
+    while (c->pending == NULL) {
+        if (c->depth == 0 && !c->wholeInput)
+            return false;
+        char *line = c->readLine(c->context);
+        if (line == NULL)
+            return false;
+        c->line++;
+        c->pending = getTokenList(line);
+        if (!c->wholeInput)
+            c->pending = expandAliases(c->pending);     // not in scripts, like other shells
+        free(line);
+    }
+    return true;
+}
+
+static void dropToken(Compiler *c)
+{
+    List node = c->pending;
+    c->pending = node->next;
+    free(node->t);
+    free(node);
+}
+
+static char *takeToken(Compiler *c)
+{
+    List node = c->pending;
+    char *t = node->t;
+    c->pending = node->next;
+    free(node);
+    return t;
+}
+
+/**
+ * The function peekWord returns the first word of the next statement, skipping empty
+ * statements.
+ * @return the word, or NULL at the end of the input.
+ */
+static char *peekWord(Compiler *c)
+{
+    while (fillPending(c) && strcmp(c->pending->t, ";") == 0)
+        dropToken(c);
+    return c->pending == NULL ? NULL : c->pending->t;
+}
+
+static bool pendingIs(Compiler *c, char *s)
+{
+    return c->pending != NULL && strcmp(c->pending->t, s) == 0;
+}
+
+static bool expectWord(Compiler *c, char *word)
+{
+    char *w = peekWord(c);
+    if (w == NULL || strcmp(w, word) != 0) {
+        syntaxError(c, w);
+        return false;
+    }
+    dropToken(c);
+    return true;
+}
+
+static bool isChainWord(char *s)
+{
+    return strcmp(s, "&&") == 0 || strcmp(s, "||") == 0;
+}
+
+/**
+ * The function takeCommand detaches the tokens of a command, up to ";", ";;" or the
+ * end of the line, from the input. A terminating ";" is dropped.
+ * @param pipeline whether to stop at "&&" and "||" as well.
+ */
+static List takeCommand(Compiler *c, bool pipeline)
+{
+    List head = c->pending, last = NULL;
+    for (List l = head; l != NULL && strcmp(l->t, ";") != 0 && strcmp(l->t, ";;") != 0
+                        && !(pipeline && isChainWord(l->t)); l = l->next)
+        last = l;
+    c->pending = last->next;
+    last->next = NULL;
+    if (pendingIs(c, ";"))
+        dropToken(c);
+    return head;
+}
+
+static char **appendWord(char **words, int *count, char *word)
+{
+    words = realloc(words, (*count + 2) * sizeof(*words));
+    assert(words != NULL);
+    words[(*count)++] = word;
+    words[*count] = NULL;
+    return words;
+}
+
+static int compileStatements(Compiler *c, char **terminators);
+
+/**
+ * if <list> then <list> { elif <list> then <list> } [ else <list> ] fi
+ */
+static bool compileIf(Compiler *c)
+{
+    char *ends[] = { "elif", "else", "fi", NULL };
+    char *then[] = { "then", NULL };
+    char *fi[] = { "fi", NULL };
+    int *exits = NULL, exitCount = 0;
+    bool ok = false;
+
+    dropToken(c);
+    while (true) {
+        if (compileStatements(c, then) < 0)
+            goto done;
+        dropToken(c);
+        int skip = emit(c, OP_JUMP_IF_FAILED);
+        int end = compileStatements(c, ends);
+        if (end < 0)
+            goto done;
+        exits = realloc(exits, (exitCount + 1) * sizeof(*exits));
+        assert(exits != NULL);
+        exits[exitCount++] = emit(c, OP_JUMP);
+        patch(c, skip);
+        dropToken(c);
+        if (end == 0)
+            continue;
+        if (end == 1) {
+            if (compileStatements(c, fi) < 0)
+                goto done;
+            dropToken(c);
+        } else {
+            emit(c, OP_CLEAR_STATUS);           // no branch was taken
+        }
+        break;
+    }
+    for (int i = 0; i < exitCount; i++)
+        patch(c, exits[i]);
+    ok = true;
+done:
+    free(exits);
+    return ok;
+}
+
+/**
+ * The function compileLoopBody compiles "do <list> done" of a loop whose condition
+ * continues at \param continueTarget and jumps out with \param leave, and patches
+ * the breaks out of it. A while or until loop passes the \param slot that keeps the
+ * exit code of its body, -1 for a for loop, whose condition does not change it.
+ */
+static bool compileLoopBody(Compiler *c, int continueTarget, int leave, int slot)
+{
+    char *done[] = { "done", NULL };
+    Loop loop = { continueTarget, NULL, 0, c->loop };
+    bool ok = false;
+
+    c->loop = &loop;
+    if (expectWord(c, "do") && compileStatements(c, done) >= 0) {
+        dropToken(c);
+        int jump = emit(c, OP_JUMP);
+        c->program->code[jump].target = continueTarget;
+        patch(c, leave);
+        if (slot >= 0)
+            c->program->code[emit(c, OP_LOAD_STATUS)].slot = slot;
+        for (int i = 0; i < loop.breakCount; i++)
+            patch(c, loop.breaks[i]);
+        ok = true;
+    }
+    c->loop = loop.outer;
+    free(loop.breaks);
+    return ok;
+}
+
+/**
+ * while|until <list> do <list> done
+ * The exit code of the body is kept across the condition: the loop ends with the exit
+ * code of the last command of the body, or 0 if the body did not run.
+ */
+static bool compileWhile(Compiler *c)
+{
+    char *do_[] = { "do", NULL };
+    bool until = strcmp(c->pending->t, "until") == 0;
+    dropToken(c);
+
+    int slot = c->program->forSlots++;
+    emit(c, OP_CLEAR_STATUS);
+    int start = emit(c, OP_SAVE_STATUS);
+    c->program->code[start].slot = slot;
+    if (compileStatements(c, do_) < 0)
+        return false;
+    int leave = emit(c, until ? OP_JUMP_IF_SUCCEEDED : OP_JUMP_IF_FAILED);
+    return compileLoopBody(c, start, leave, slot);
+}
+
+/**
+ * for <name> [ in <word>... ] ; do <list> done
+ * Without "in" the loop runs over the positional parameters.
+ */
+static bool compileFor(Compiler *c)
+{
+    dropToken(c);
+    char *name = peekWord(c);
+    if (name == NULL || !isName(name)) {
+        syntaxError(c, name);
+        return false;
+    }
+    name = takeToken(c);
+
+    char **words = NULL;
+    int count = 0;
+    if (pendingIs(c, "in")) {
+        dropToken(c);
+        while (c->pending != NULL && !pendingIs(c, ";") && !pendingIs(c, "do"))
+            words = appendWord(words, &count, takeToken(c));
+    } else {
+        words = appendWord(words, &count, strdup("$@"));
+    }
+    if (words == NULL) {
+        words = calloc(1, sizeof(*words));
+        assert(words != NULL);
+    }
+
+    int init = emit(c, OP_FOR_INIT);
+    int slot = c->program->forSlots++;
+    c->program->code[init].slot = slot;
+    c->program->code[init].words = words;
+
+    emit(c, OP_CLEAR_STATUS);                   // for a loop over no items
+    int next = emit(c, OP_FOR_NEXT);
+    c->program->code[next].slot = slot;
+    c->program->code[next].name = name;
+    if (!compileLoopBody(c, next, next, -1))
+        return false;
+    patch(c, init);
+    return true;
+}
+
+/**
+ * case <word> in { [(] <pattern> { | <pattern> } ) <list> ;; } esac
+ */
+static bool compileCase(Compiler *c)
+{
+    char *ends[] = { ";;", "esac", NULL };
+    int *exits = NULL, exitCount = 0;
+    bool ok = false;
+
+    dropToken(c);
+    char *word = peekWord(c);
+    if (word == NULL || isWordIn(word, reservedWords)) {
+        syntaxError(c, word);
+        return false;
+    }
+    int caseWord = emit(c, OP_CASE_WORD);
+    int slot = c->program->caseSlots++;
+    int count = 0;
+    c->program->code[caseWord].slot = slot;
+    c->program->code[caseWord].words = appendWord(NULL, &count, takeToken(c));
+    emit(c, OP_CLEAR_STATUS);                   // for no match, or an empty list
+    if (!expectWord(c, "in"))
+        return false;
+
+    while (true) {
+        char *w = peekWord(c);
+        if (w == NULL) {
+            syntaxError(c, w);
+            goto done;
+        }
+        if (strcmp(w, "esac") == 0) {
+            dropToken(c);
+            break;
+        }
+
+        char **patterns = NULL;
+        int patternCount = 0;
+        bool closed = false;
+        while (c->pending != NULL && !closed) {
+            char *p = takeToken(c);
+            size_t len = strlen(p);
+            if (len > 0 && p[len - 1] == ')') {
+                p[--len] = '\0';
+                closed = true;
+            }
+            if (patternCount == 0 && p[0] == '(')
+                memmove(p, p + 1, len--);
+            if (len > 0)
+                patterns = appendWord(patterns, &patternCount, p);
+            else
+                free(p);
+            if (!closed && pendingIs(c, "|"))
+                dropToken(c);
+        }
+        int match = emit(c, OP_CASE_MATCH);
+        c->program->code[match].slot = slot;
+        c->program->code[match].words = patterns;
+        if (!closed || patterns == NULL) {
+            syntaxError(c, c->pending == NULL ? ")" : c->pending->t);
+            goto done;
+        }
+
+        int end = compileStatements(c, ends);
+        if (end < 0)
+            goto done;
+        exits = realloc(exits, (exitCount + 1) * sizeof(*exits));
+        assert(exits != NULL);
+        exits[exitCount++] = emit(c, OP_JUMP);
+        patch(c, match);
+        dropToken(c);
+        if (end == 1)
+            break;
+    }
+    for (int i = 0; i < exitCount; i++)
+        patch(c, exits[i]);
+    patch(c, caseWord);
+    ok = true;
+done:
+    free(exits);
+    return ok;
+}
+
+/**
+ * break [n] | continue [n]
+ */
+static bool compileJumpOut(Compiler *c)
+{
+    char *word = takeToken(c);
+    bool isBreak = strcmp(word, "break") == 0;
+    int levels = 1;
+    if (c->pending != NULL && !pendingIs(c, ";") && !pendingIs(c, ";;")) {
+        char *endptr;
+        levels = (int)strtol(c->pending->t, &endptr, 10);
+        if (*endptr != '\0' || levels < 1) {
+            syntaxError(c, c->pending->t);
+            free(word);
+            return false;
+        }
+        dropToken(c);
+    }
+    Loop *loop = c->loop;
+    if (loop == NULL) {
+        syntaxError(c, word);
+        free(word);
+        return false;
+    }
+    free(word);
+    while (--levels > 0 && loop->outer != NULL)
+        loop = loop->outer;
+
+    emit(c, OP_CLEAR_STATUS);                   // the exit code of break and continue
+    int jump = emit(c, OP_JUMP);
+    if (isBreak) {
+        loop->breaks = realloc(loop->breaks, (loop->breakCount + 1) * sizeof(*loop->breaks));
+        assert(loop->breaks != NULL);
+        loop->breaks[loop->breakCount++] = jump;
+    } else {
+        c->program->code[jump].target = loop->continueTarget;
+    }
+    if (pendingIs(c, ";"))
+        dropToken(c);
+    return true;
+}
+
+/**
+ * name() { <list> }
+ */
+static bool compileFunction(Compiler *c)
+{
+    char *end[] = { "}", NULL };
+    int header = functionHeader(c->pending);
+    char *name = takeToken(c);
+    if (header == 1)
+        name[strlen(name) - 2] = '\0';
+    else
+        dropToken(c);
+    if (!expectWord(c, "{")) {
+        free(name);
+        return false;
+    }
+    int define = emit(c, OP_FUNCTION);
+    c->program->code[define].name = name;
+
+    Loop *loop = c->loop;
+    bool function = c->function;
+    c->loop = NULL;                 // break and continue do not reach out of the body
+    c->function = true;
+    int found = compileStatements(c, end);
+    c->loop = loop;
+    c->function = function;
+    if (found < 0)
+        return false;
+    dropToken(c);
+    emit(c, OP_RETURN);
+    patch(c, define);
+    return true;
+}
+
+/**
+ * return [n]
+ */
+static bool compileReturn(Compiler *c)
+{
+    char *word = takeToken(c);
+    if (!c->function) {
+        syntaxError(c, word);
+        free(word);
+        return false;
+    }
+    free(word);
+    int ret = emit(c, OP_RETURN);
+    if (c->pending != NULL && !pendingIs(c, ";") && !pendingIs(c, ";;")) {
+        int count = 0;
+        c->program->code[ret].words = appendWord(NULL, &count, takeToken(c));
+    }
+    if (pendingIs(c, ";"))
+        dropToken(c);
+    return true;
+}
+
+static bool compileBlock(Compiler *c, char *w)
+{
+    bool ok;
+    c->depth++;
+    if (strcmp(w, "if") == 0)
+        ok = compileIf(c);
+    else if (strcmp(w, "for") == 0)
+        ok = compileFor(c);
+    else if (strcmp(w, "case") == 0)
+        ok = compileCase(c);
+    else
+        ok = compileWhile(c);
+    c->depth--;
+    return ok;
+}
+
+/**
+ * The function compileAndOr compiles the "&&" and "||" that follow a compound command.
+ * Each becomes a jump over the next pipeline or compound command, on the exit code so far.
+ */
+static bool compileAndOr(Compiler *c)
+{
+    while (c->pending != NULL && isChainWord(c->pending->t)) {
+        bool and = strcmp(c->pending->t, "&&") == 0;
+        dropToken(c);
+        int skip = emit(c, and ? OP_JUMP_IF_FAILED : OP_JUMP_IF_SUCCEEDED);
+        c->depth++;                             // the command may follow on the next line
+        char *w = peekWord(c);
+        c->depth--;
+        if (w == NULL || isChainWord(w) || isWordIn(w, reservedWords)) {
+            syntaxError(c, w);
+            return false;
+        }
+        if (isWordIn(w, blockWords)) {
+            if (!compileBlock(c, w))
+                return false;
+        } else {
+            int run = emit(c, OP_RUN);
+            c->program->code[run].command = takeCommand(c, true);
+        }
+        patch(c, skip);
+    }
+    return true;
+}
+
+/**
+ * The function compileStatements compiles statements until the next statement starts
+ * with one of \param terminators, which is left in the input.
+ * @return the index of the terminator that was found, or -1 after a syntax error.
+ * Without terminators, statements are compiled until the end of the input and 0 is returned.
+ */
+static int compileStatements(Compiler *c, char **terminators)
+{
+    while (true) {
+        char *w = peekWord(c);
+        if (w == NULL) {
+            if (terminators == NULL)
+                return 0;
+            syntaxError(c, NULL);
+            return -1;
+        }
+        for (int i = 0; terminators != NULL && terminators[i] != NULL; i++) {
+            if (strcmp(w, terminators[i]) == 0)
+                return i;
+        }
+
+        bool ok = true;
+        if (isWordIn(w, blockWords)) {
+            ok = compileBlock(c, w) && compileAndOr(c);
+        } else if (functionHeader(c->pending) > 0) {
+            c->depth++;
+            ok = compileFunction(c);
+            c->depth--;
+        } else if (strcmp(w, "break") == 0 || strcmp(w, "continue") == 0) {
+            ok = compileJumpOut(c);
+        } else if (strcmp(w, "return") == 0) {
+            ok = compileReturn(c);
+        } else if (isWordIn(w, reservedWords)) {
+            syntaxError(c, w);
+            ok = false;
+        } else {
+            int run = emit(c, OP_RUN);
+            c->program->code[run].command = takeCommand(c, false);
+        }
+        if (!ok)
+            return -1;
+    }
+}
+
+/**
+ * The function compileProgram compiles the statements starting with the line \param tokens.
+ * @param tokens tokens of the first line, owned by the program from now on.
+ * @param readLine reads further lines.
+ * @param wholeInput whether to compile until the end of the input, or only until the end
+ * of the line (and of the compound commands that started on it).
+ * @return the program, or NULL after a syntax error.
+ */
+Program *compileProgram(List tokens, LineReader readLine, void *context, bool wholeInput)
+{
+    MemSubsystem previous = memEnter(MEM_SCRIPTS);
+    Program *program = calloc(1, sizeof(*program));
+    assert(program != NULL);
+    Compiler c = { program, tokens, readLine, context, wholeInput, 0, tokens == NULL ? 0 : 1, NULL, false };
+
+    bool ok = compileStatements(&c, NULL) == 0;
+    freeTokenList(c.pending);
+    memLeave(previous);
+    if (!ok) {
+        freeProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+void freeProgram(Program *program)
+{
+    if (program == NULL)
+        return;
+    if (program->references > 0) {
+        program->references--;
+        return;
+    }
+    if (program->mapping != NULL) {
+        free(program->code);
+        free(program->nodes);
+        free(program->wordTable);
+        munmap(program->mapping, program->mappingSize);
+        free(program);
+        return;
+    }
+    for (int i = 0; i < program->length; i++) {
+        Instruction *in = &program->code[i];
+        freeTokenList(in->command);
+        for (int j = 0; in->words != NULL && in->words[j] != NULL; j++)
+            free(in->words[j]);
+        free(in->words);
+        free(in->name);
+    }
+    free(program->code);
+    free(program);
+}
+
+static void appendItem(ForState *f, size_t *used, const char *s, size_t n)
+{
+    if (*used + n + 1 > f->textCapacity) {
+        while (*used + n + 1 > f->textCapacity)
+            f->textCapacity = f->textCapacity == 0 ? 256 : 2 * f->textCapacity;
+        f->text = realloc(f->text, f->textCapacity);
+        assert(f->text != NULL);
+    }
+    memcpy(f->text + *used, s, n);
+    f->text[*used + n] = '\0';
+    *used += n + 1;
+    f->count++;
+}
+
+/**
+ * The function startFor expands the words of a for loop into its items. Words that
+ * contain a variable are split at whitespace. The buffers of the loop are reused
+ * every time the loop starts.
+ * @return a bool denoting whether the words could be expanded.
+ */
+static bool startFor(ForState *f, char **words)
+{
+    size_t used = 0;
+    f->count = f->next = 0;
+    ExpansionMark mark = expansionMark();
+    for (int i = 0; words[i] != NULL; i++) {
+        char *s = expandWord(words[i]);
+        if (s == NULL) {
+            f->count = 0;
+            expansionRelease(mark);
+            return false;
+        }
+        if (s == words[i]) {
+            appendItem(f, &used, s, strlen(s));
+            continue;
+        }
+        while (*s != '\0') {
+            s += strspn(s, " \t\n");
+            size_t n = strcspn(s, " \t\n");
+            if (n > 0)
+                appendItem(f, &used, s, n);
+            s += n;
+        }
+    }
+    expansionRelease(mark);
+
+    if (f->count > f->itemCapacity) {
+        f->itemCapacity = f->count;
+        f->items = realloc(f->items, f->itemCapacity * sizeof(*f->items));
+        assert(f->items != NULL);
+    }
+    char *item = f->text;
+    for (int i = 0; i < f->count; i++) {
+        f->items[i] = item;
+        item += strlen(item) + 1;
+    }
+    return true;
+}
+
+static bool setCaseWord(CaseState *cs, char *word)
+{
+    ExpansionMark mark = expansionMark();
+    char *s = expandWord(word);
+    if (s == NULL) {
+        expansionRelease(mark);
+        return false;
+    }
+    size_t len = strlen(s);
+    if (len + 1 > cs->capacity) {
+        cs->capacity = len + 1;
+        cs->word = realloc(cs->word, cs->capacity);
+        assert(cs->word != NULL);
+    }
+    memcpy(cs->word, s, len + 1);
+    expansionRelease(mark);
+    return true;
+}
+
+static bool caseMatches(CaseState *cs, char **patterns)
+{
+    bool matched = false;
+    ExpansionMark mark = expansionMark();
+    for (int i = 0; patterns[i] != NULL && !matched; i++) {
+        char *pattern = expandWord(patterns[i]);
+        matched = pattern != NULL && fnmatch(pattern, cs->word, 0) == 0;
+    }
+    expansionRelease(mark);
+    return matched;
+}
+
+/**
+ * The function lookAhead hands the commands of the instructions up to PREFETCH_LOOKAHEAD
+ * after \param pc to the prefetch thread (see prefetch.h), every instruction once.
+ */
+static void lookAhead(Program *program, int pc)
+{
+    int end = pc + PREFETCH_LOOKAHEAD < program->length ? pc + PREFETCH_LOOKAHEAD : program->length;
+    for (int i = program->prefetched > pc ? program->prefetched : pc; i < end; i++) {
+        if (program->code[i].op == OP_RUN)
+            prefetchLine(program->code[i].command);
+    }
+    if (end > program->prefetched)
+        program->prefetched = end;
+}
+
+/**
+ * The function runProgram runs the bytecode of \param program. exitCode holds the
+ * exit code of the last command that ran.
+ */
+void runProgram(Program *program)
+{
+    runProgramFrom(program, 0);
+}
+
+/**
+ * The function runProgramFrom runs the bytecode of \param program from instruction
+ * \param start up to the end, or up to an OP_RETURN for the body of a function.
+ */
+void runProgramFrom(Program *program, int start)
+{
+    ForState *loops = calloc(program->forSlots + 1, sizeof(*loops));
+    CaseState *cases = calloc(program->caseSlots + 1, sizeof(*cases));
+    assert(loops != NULL && cases != NULL);
+
+    int pc = start;
+    while (pc < program->length) {
+        Instruction *in = &program->code[pc++];
+        List l;
+        switch (in->op) {
+        case OP_RUN:
+            if (prefetchEnabled)
+                lookAhead(program, pc - 1);
+            l = in->command;
+            parseInputLine(&l);
+            break;
+        case OP_JUMP:
+            pc = in->target;
+            break;
+        case OP_JUMP_IF_FAILED:
+            if (exitCode != 0)
+                pc = in->target;
+            break;
+        case OP_JUMP_IF_SUCCEEDED:
+            if (exitCode == 0)
+                pc = in->target;
+            break;
+        case OP_FOR_INIT:
+            if (!startFor(&loops[in->slot], in->words)) {
+                exitCode = 1;
+                pc = in->target;
+            }
+            break;
+        case OP_FOR_NEXT:
+            if (loops[in->slot].next < loops[in->slot].count)
+                setVariable(in->name, loops[in->slot].items[loops[in->slot].next++]);
+            else
+                pc = in->target;
+            break;
+        case OP_CASE_WORD:
+            if (!setCaseWord(&cases[in->slot], in->words[0])) {
+                exitCode = 1;
+                pc = in->target;
+            }
+            break;
+        case OP_CASE_MATCH:
+            if (!caseMatches(&cases[in->slot], in->words))
+                pc = in->target;
+            break;
+        case OP_FUNCTION:
+            defineFunction(in->name, program, pc);
+            pc = in->target;
+            break;
+        case OP_RETURN:
+            if (in->words != NULL) {
+                ExpansionMark mark = expansionMark();
+                char *code = expandWord(in->words[0]);
+                exitCode = code == NULL ? 1 : (int)(strtol(code, NULL, 10) & 0xff);
+                expansionRelease(mark);
+            }
+            pc = program->length;
+            break;
+        case OP_CLEAR_STATUS:
+            exitCode = 0;
+            break;
+        case OP_SAVE_STATUS:
+            loops[in->slot].status = exitCode;
+            break;
+        case OP_LOAD_STATUS:
+            exitCode = loops[in->slot].status;
+            break;
+        }
+    }
+
+    for (int i = 0; i < program->forSlots; i++) {
+        free(loops[i].text);
+        free(loops[i].items);
+    }
+    for (int i = 0; i < program->caseSlots; i++)
+        free(cases[i].word);
+    free(loops);
+    free(cases);
+}
+
+/**
+ * The function runBlock compiles and runs a line that starts a compound command. The
+ * lines up to the end of the command are read first.
+ * @param tokens the tokens of the line, which are freed by this function.
+ * @param readLine reads the following lines, with \param context.
+ */
+void runBlock(List tokens, LineReader readLine, void *context)
+{
+    Program *program = compileProgram(tokens, readLine, context, false);
+    if (program == NULL) {
+        exitCode = 2;
+        return;
+    }
+    runProgram(program);
+    freeProgram(program);
+}
+
+typedef struct TextReader                                            // reads the lines of a buffer
+{
+    const char *next;
+    const char *end;
+} TextReader;
+
+static char *readTextLine(void *context)
+{
+    TextReader *r = context;
+    if (r->next >= r->end)
+        return NULL;
+    const char *eol = memchr(r->next, '\n', r->end - r->next);
+    size_t len = (eol == NULL ? r->end : eol) - r->next;
+    char *line = malloc(len + 1);
+    assert(line != NULL);
+    memcpy(line, r->next, len);
+    line[len] = '\0';
+    r->next += len + 1;
+    return line;
+}
+
+/**
+ * The function loadProgram returns the compiled form of the script \param path. It is
+ * taken from the script cache when the cache holds it for the current contents of the
+ * file; otherwise the script is compiled and the result is stored in the cache.
+ * @param status set to the exit code of the script if it cannot be run.
+ * @return the program, or NULL if the script could not be read or has a syntax error.
+ */
+static Program *loadProgram(char *path, int *status)
+{
+    *status = 127;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    char *text = st.st_size == 0 ? NULL : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    ScriptKey key;
+    makeScriptKey(&key, path, &st, text);
+    Program *program = loadCachedProgram(&key);
+    if (program == NULL) {
+        TextReader reader = { text, text + st.st_size };
+        program = compileProgram(NULL, readTextLine, &reader, true);
+        if (program != NULL)
+            saveCachedProgram(&key, program);
+        else
+            *status = 2;
+    }
+    if (text != NULL)
+        munmap(text, st.st_size);
+    return program;
+}
+
+/**
+ * The function runScript runs the script \param path, compiled as a whole.
+ * @param argc number of arguments of the script.
+ * @param argv the arguments, which become $1 ... $n.
+ * @return the exit code of the script.
+ */
+int runScript(char *path, int argc, char **argv)
+{
+    int status;
+    setPositionalParameters(path, argc, argv);
+    MemSubsystem previous = memEnter(MEM_SCRIPTS);
+    Program *program = loadProgram(path, &status);
+    memLeave(previous);
+    if (program == NULL)
+        return status;
+    runProgram(program);
+    freeProgram(program);
+    return exitCode;
+}
@@ -0,0 +1,60 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdbool.h>
+#include "scanner.h"
+
+typedef enum OpCode
+{
+    OP_RUN,                 // run command (a chain of pipelines)
+    OP_JUMP,                // continue at target
+    OP_JUMP_IF_FAILED,      // continue at target if the last exit code is not 0
+    OP_JUMP_IF_SUCCEEDED,   // continue at target if the last exit code is 0
+    OP_FOR_INIT,            // expand words into the item list of loop slot, or continue at target if they are invalid
+    OP_FOR_NEXT,            // assign the next item to name, or continue at target when done
+    OP_CASE_WORD,           // expand words[0] into the case word of slot, or continue at target if it is invalid
+    OP_CASE_MATCH,          // continue at target unless the case word matches one of words
+    OP_FUNCTION,            // define function name with the body that follows, continue at target
+    OP_RETURN,              // leave the function, with exit code words[0] if there is one
+    OP_CLEAR_STATUS,        // set the exit code to 0
+    OP_SAVE_STATUS,         // keep the exit code in loop slot
+    OP_LOAD_STATUS          // set the exit code to the one kept in loop slot
+} OpCode;
+
+typedef struct Instruction
+{
+    OpCode op;
+    int target;
+    int slot;
+    List command;
+    char **words;           // NULL-terminated
+    char *name;
+} Instruction;
+
+typedef struct Program
+{
+    Instruction *code;
+    int length;
+    int capacity;
+    int forSlots;
+    int caseSlots;
+    ListNode *nodes;        // set when loaded from the cache: all tokens in one array,
+    char **wordTable;       // all word lists in one array,
+    void *mapping;          // and the strings in the mapped cache file
+    size_t mappingSize;
+    int references;         // functions defined by the program, which keep it alive
+    int prefetched;         // instructions before this one were handed to prefetch
+} Program;
+
+/* Returns the next line of input (malloc'ed), or NULL at the end of the input. */
+typedef char *(*LineReader)(void *context);
+
+bool startsBlock(List tokens);
+Program *compileProgram(List tokens, LineReader readLine, void *context, bool wholeInput);
+void runProgram(Program *program);
+void runProgramFrom(Program *program, int start);
+void freeProgram(Program *program);
+void runBlock(List tokens, LineReader readLine, void *context);
+int runScript(char *path, int argc, char **argv);
+
+#endif
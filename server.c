@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "scanner.h"
+#include "shell.h"
+#include "server.h"
+#include "script.h"
+#include "functions.h"
+
+/*
+ * Server mode keeps one initialized shell alive on a Unix domain socket. Each
+ * accepted connection is served by a forked copy of that shell, so requests run
+ * concurrently and never see each other's state (working directory, jobs), while
+ * the exec and initialization cost of a fresh shell is paid only once.
+ */
+
+/**
+ * The function readFully reads exactly \param size bytes from \param fd.
+ * @return a bool denoting whether all bytes were read.
+ */
+static bool readFully(int fd, void *buf, size_t size) {
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * The function receiveRequest reads a request header together with the client's
+ * standard file descriptors.
+ * @param conn the connection socket.
+ * @param header the header that is filled in.
+ * @param fds receives the client's stdin, stdout and stderr.
+ * @return a bool denoting whether a well-formed request was received.
+ */
+static bool receiveRequest(int conn, RequestHeader *header, int fds[3]) {
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { header, sizeof(*header) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return false;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return false;
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    if ((size_t)n < sizeof(*header) && !readFully(conn, (char *)header + n, sizeof(*header) - n))
+        return false;
+    return header->version == SERVER_PROTOCOL_VERSION && header->length <= MAX_REQUEST_LENGTH;
+}
+
+static int responseConn = -1;           // the connection of the worker, until the exit code is sent
+static pid_t workerPid;
+
+/**
+ * The function sendResponse sends the exit code of the request to the client. It runs
+ * when the worker exits, also through the exit builtin; children forked by the worker
+ * for background builtins leave it to the worker.
+ */
+static void sendResponse() {
+    if (responseConn == -1 || getpid() != workerPid)
+        return;
+    ResponseMessage response = { exitCode };
+    if (write(responseConn, &response, sizeof(response)) != sizeof(response))
+        perror("write");
+    responseConn = -1;
+}
+
+/**
+ * The function readRequestLine returns the next line of a request (malloc'ed), or NULL
+ * at its end. The lines of a compound command that spans several are read with it.
+ * @param context points to the rest of the request.
+ */
+static char *readRequestLine(void *context) {
+    char **next = context;
+    if (*next == NULL)
+        return NULL;
+    char *eol = strchr(*next, '\n');
+    size_t length = eol == NULL ? strlen(*next) : (size_t)(eol - *next);
+    char *line = strndup(*next, length);
+    *next = eol == NULL ? NULL : eol + 1;
+    return line;
+}
+
+/**
+ * The function serveConnection runs one request in a forked worker: the client's
+ * descriptors become the standard streams, every line of the request is dispatched
+ * as the interactive shell does it (aliases, compound commands, parseInputLine) and
+ * the exit code is sent back.
+ * @param conn the connection socket.
+ */
+static void serveConnection(int conn) {
+    RequestHeader header;
+    int fds[3];
+    if (!receiveRequest(conn, &header, fds))
+        exit(EXIT_FAILURE);
+
+    char *inputLine = malloc(header.length + 1);
+    if (inputLine == NULL || !readFully(conn, inputLine, header.length))
+        exit(EXIT_FAILURE);
+    inputLine[header.length] = '\0';
+
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) == -1) {
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+        close(fds[i]);
+    }
+    responseConn = conn;
+    workerPid = getpid();
+    atexit(sendResponse);
+
+    char *next = inputLine, *line;
+    while ((line = readRequestLine(&next)) != NULL) {
+        List tokenList = expandAliases(getTokenList(line));
+        if (startsBlock(tokenList)) {
+            runBlock(tokenList, readRequestLine, &next);
+        } else {
+            List tokenListCopy = tokenList;
+            if (!parseInputLine(&tokenList) && exitCode == 0)
+                exitCode = 2;
+            freeTokenList(tokenListCopy);
+        }
+        free(line);
+    }
+    free(inputLine);
+
+    exit(EXIT_SUCCESS);                     // the exit code is sent by sendResponse
+}
+
+/**
+ * The function runServer listens on a Unix domain socket and serves requests until
+ * the shell is interrupted. Workers are reaped by the SIGCHLD handler.
+ * @param socketPath path of the socket, or NULL for the default path.
+ * @return the exit status of the shell.
+ */
+int runServer(const char *socketPath) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath == NULL)
+        defaultSocketPath(addr.sun_path, sizeof(addr.sun_path));
+    else if (strlen(socketPath) < sizeof(addr.sun_path))
+        strcpy(addr.sun_path, socketPath);
+    else {
+        printf("Error: socket path too long!\n");
+        return 2;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("socket");
+        return 1;
+    }
+    unlink(addr.sun_path);
+    mode_t oldMask = umask(0077);
+    int bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+    umask(oldMask);
+    if (bound == -1 || listen(listener, SOMAXCONN) == -1) {
+        perror("bind");
+        close(listener);
+        return 1;
+    }
+
+    while (true) {
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+        } else if (pid == 0) {
+            close(listener);
+            serveConnection(conn);
+        }
+        close(conn);
+    }
+
+    close(listener);
+    unlink(addr.sun_path);
+    return 1;
+}
@@ -0,0 +1,40 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define SERVER_PROTOCOL_VERSION 1
+#define SERVER_SOCKET_ENV "SHELL_SOCKET"
+#define MAX_REQUEST_LENGTH (1 << 20)
+
+/*
+ * A request is a RequestHeader, sent together with the client's stdin, stdout
+ * and stderr as SCM_RIGHTS ancillary data, followed by `length` bytes of input
+ * line. The server answers with a single ResponseMessage.
+ */
+typedef struct RequestHeader {
+    uint32_t version;
+    uint32_t length;
+} RequestHeader;
+
+typedef struct ResponseMessage {
+    int32_t exitCode;
+} ResponseMessage;
+
+/**
+ * The function defaultSocketPath fills \param buf with the socket path used when
+ * none is given: $SHELL_SOCKET, or a per-user path in /tmp.
+ */
+static inline void defaultSocketPath(char *buf, size_t size) {
+    const char *env = getenv(SERVER_SOCKET_ENV);
+    if (env != NULL && *env != '\0')
+        snprintf(buf, size, "%s", env);
+    else
+        snprintf(buf, size, "/tmp/shell-%d.sock", (int)getuid());
+}
+
+int runServer(const char *socketPath);
+
+#endif
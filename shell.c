@@ -1,9 +1,11 @@
-#define _POSIX_C_SOURCE 200809L
-#define MAX_ARGS 100
+#define _GNU_SOURCE
 #define MAX_COMMANDS 10
 #define MAX_COMMAND_LENGTH 100
 #define MAX_BACKGROUND_PROCESSES 100
+#define MAX_FINISHED_JOBS 64
 #define MAX_SIGNAL 31
+#define ARG_CHECK_THRESHOLD (64 * 1024)     // below this the arguments always fit
+#define ARG_MAX_FALLBACK 131072
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
@@ -16,55 +18,147 @@
 #include <signal.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include "scanner.h"
 #include "commands.h"
+#include "spawn.h"
+#include "stream.h"
+#include "pipestat.h"
+#include "vars.h"
+#include "batch.h"
+#include "joblimits.h"
+#include "affinity.h"
+#include "memstats.h"
+#include "capture.h"
+#include "dag.h"
+#include "functions.h"
+#include "prefetch.h"
+#include "timeouts.h"
+#include "fds.h"
 
 typedef struct                                                      // struct for managing bg processes
 {
     pid_t pid;
     int index;
+    ResourceLimits limits;                                          // limits of the job, see the limit prefix
+    bool lastStage;                                                 // its exit code is the one of the job
+    int jobStatus;                                                  // exit code of the job once lastStage ended
+    int deadline;                                                   // see timeouts.h, -1 if none
 } BackgroundProcess;
 BackgroundProcess backgroundProcesses[MAX_BACKGROUND_PROCESSES];    // array to manage bg processes
 int backgroundProcessCount = 0;                                     // keep track of num of bg processes
 int nextProcessIndex = 1;                                           // starting at index 1
 
+typedef struct                                                      // exit code of a finished bg job
+{
+    int index;
+    int status;
+    int deadline;                                                   // cancelled by cancelFinishedDeadlines
+} FinishedJob;
+FinishedJob finishedJobs[MAX_FINISHED_JOBS];                        // ring of the most recent finished jobs
+int finishedJobCount = 0;                                           // total, the ring keeps the last ones
+int deadlinesCancelled = 0;                                         // finished jobs seen by cancelFinishedDeadlines
+
+int coprocIndex = 0;                                                // job of the coprocess, 0 if none was started
+int coprocReadFd = -1;                                              // reads the stdout of the coprocess (<&p)
+int coprocWriteFd = -1;                                             // writes to the stdin of the coprocess (>&p)
+
+volatile sig_atomic_t waitingForJobs = 0;                           // the wait builtin is blocked
+int waitInterruptFd = -1;                                           // signalled by Ctrl+C during wait
+
 int exitCode = 0;                                                   // for storing exit code
 bool commandNotFound = false;
-bool isBackground = false;
 
 pid_t foregroundPID = -1;                                                // keep track of currently executing foreground process
 
-int keeptrack = 0;
-
 /**
  * The function addBackgroundPID adds a new bg process to the
  * backgroundProcesses array
  *
  * @param pid process ID of the newly created bg process.
+ * @param limits the resource limits of its job.
+ * @param lastStage whether it runs the last stage of its pipeline.
+ * @param deadline the deadline of its job, -1 if none.
  */
-void addBackgroundPID(pid_t pid)
+void addBackgroundPID(pid_t pid, const ResourceLimits *limits, bool lastStage, int deadline)
 {
     if (backgroundProcessCount < MAX_BACKGROUND_PROCESSES)
     {
         backgroundProcesses[backgroundProcessCount].pid = pid;
         backgroundProcesses[backgroundProcessCount].index = nextProcessIndex;
+        backgroundProcesses[backgroundProcessCount].limits = *limits;
+        backgroundProcesses[backgroundProcessCount].lastStage = lastStage;
+        backgroundProcesses[backgroundProcessCount].jobStatus = 0;
+        backgroundProcesses[backgroundProcessCount].deadline = deadline;
         backgroundProcessCount += 1;
     }
 } 
 
+/**
+ * The function statusCode turns a status from waitpid into an exit code.
+ */
+static int statusCode(int status)
+{
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+ * The function findFinishedJob looks up the exit code of a finished bg job.
+ * @return a pointer to the entry, or NULL if the job is unknown or too old.
+ */
+static FinishedJob *findFinishedJob(int index)
+{
+    int first = finishedJobCount > MAX_FINISHED_JOBS ? finishedJobCount - MAX_FINISHED_JOBS : 0;
+    for (int i = finishedJobCount - 1; i >= first; --i)
+    {
+        if (finishedJobs[i % MAX_FINISHED_JOBS].index == index)
+            return &finishedJobs[i % MAX_FINISHED_JOBS];
+    }
+    return NULL;
+}
+
 /**
  * The function removeBackgroundPID removes a bg process from the
- * backgroundProcesses array
+ * backgroundProcesses array. When it was the last process of its job, the exit
+ * code of the job is kept in finishedJobs and the cgroup of the job is removed.
+ * Called from the SIGCHLD handler, so it only uses async-signal-safe functions.
  *
  * @param pid process ID of the to be removed bg process.
+ * @param status its status from waitpid.
  */
-void removeBackgroundPID(pid_t pid) 
+void removeBackgroundPID(pid_t pid, int status) 
 {
     int i;
     for (i = 0; i < backgroundProcessCount; ++i)
     {
         if (backgroundProcesses[i].pid == pid)
         {
+            BackgroundProcess *process = &backgroundProcesses[i];
+            bool last = (i == 0 || backgroundProcesses[i - 1].index != process->index)
+                        && (i == backgroundProcessCount - 1 || backgroundProcesses[i + 1].index != process->index);
+            if (process->lastStage)
+            {
+                for (int j = 0; j < backgroundProcessCount; ++j)
+                {
+                    if (backgroundProcesses[j].index == process->index)
+                        backgroundProcesses[j].jobStatus = statusCode(status);
+                }
+            }
+            if (last)
+            {
+                FinishedJob *job = &finishedJobs[finishedJobCount % MAX_FINISHED_JOBS];
+                job->index = process->index;
+                job->status = process->jobStatus;
+                job->deadline = process->deadline;
+                finishedJobCount++;
+                if (process->deadline != -1)
+                    finishDeadline(process->deadline);
+                removeJobCgroup(&process->limits);
+            }
             for (int j = i; j < backgroundProcessCount - 1; ++j)
             {
                 backgroundProcesses[j] = backgroundProcesses[j + 1];
@@ -75,6 +169,23 @@ void removeBackgroundPID(pid_t pid)
     }
 }
 
+/**
+ * The function cancelFinishedDeadlines cancels the deadlines of the bg jobs that have
+ * finished since it last ran; the SIGCHLD handler cannot take the lock of the timer.
+ */
+static void cancelFinishedDeadlines()
+{
+    int count = finishedJobCount;
+    if (count - deadlinesCancelled > MAX_FINISHED_JOBS)
+        deadlinesCancelled = count - MAX_FINISHED_JOBS;
+    for (; deadlinesCancelled < count; deadlinesCancelled++)
+    {
+        FinishedJob *job = &finishedJobs[deadlinesCancelled % MAX_FINISHED_JOBS];
+        if (job->deadline != -1)
+            cancelDeadline(job->deadline);
+    }
+}
+
 /**
  * The function cleanupBackgroundProcesses cleans any bg process that has
  * terminated.
@@ -89,9 +200,21 @@ void cleanupBackgroundProcesses()
         pid = waitpid(backgroundProcesses[i].pid, &status, WNOHANG);
         if (pid > 0)
         {
-            removeBackgroundPID(pid);
+            removeBackgroundPID(pid, status);
         }
     }
+    cancelFinishedDeadlines();
+}
+
+/**
+ * The function jobTableSize tells how much memory the (static) job tables take.
+ * @param entries is set to the number of bg processes tracked now.
+ * @return the size of the tables in bytes.
+ */
+size_t jobTableSize(int *entries)
+{
+    *entries = backgroundProcessCount;
+    return sizeof(backgroundProcesses) + sizeof(finishedJobs);
 }
 
 /**
@@ -121,7 +244,7 @@ void sigchld_handler(int sig, siginfo_t *siginfo, void *context)
     int status;
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
     {
-        removeBackgroundPID(pid);
+        removeBackgroundPID(pid, status);
     }
 }
 
@@ -138,6 +261,12 @@ void sigint_handler(int sig)
         // Send SIGINT to the process group of the foreground process
         kill(-foregroundPID, SIGINT);        
     }
+    else if (waitingForJobs)
+    {
+        uint64_t one = 1;
+        if (write(waitInterruptFd, &one, sizeof(one)) < 0)
+            return;
+    }
     else
     {
         if (backgroundProcessListIsEmpty())
@@ -178,33 +307,35 @@ void setup_signal_handlers()
  * Terminates and/or send signals to background processes.
  * Allows the user to specify a process by its index, rather than its PID.
  * 
- * @param idxStr represents the index of the background process.
- * @param (optional) parameter represents the signal number to be sent to
+ * @param argc number of arguments.
+ * @param argv argv[1] represents the index of the background process,
+ * (optional) argv[2] represents the signal number to be sent to
  * the background process.
+ * @return the exit code of the command.
 */
-void command_kill(char *idxStr, char *sigStr) {
+int command_kill(int argc, char **argv) {
+    char *idxStr = argc > 1 ? argv[1] : NULL;
+    char *sigStr = argc > 2 && isdigit((unsigned char)argv[2][0]) ? argv[2] : NULL;
+
     if (idxStr == NULL) {
-        printf("Error: command requires an index!\n");
-        exitCode = 2;
-        return;
+        shellPrintf("Error: command requires an index!\n");
+        return 2;
     }
 
     char *endptr;
     long idx = strtol(idxStr, &endptr, 10);
 
     if (*endptr != '\0' || idx <= 0 || idx >= nextProcessIndex) {
-        printf("Error: invalid index provided!\n");
-        exitCode = 2;
-        return;
+        shellPrintf("Error: invalid index provided!\n");
+        return 2;
     }
 
     int sig = SIGTERM; // Default signal
     if (sigStr != NULL && strlen(sigStr) > 0) {
         long sigNum = strtol(sigStr, &endptr, 10);
         if (*endptr != '\0' || sigNum <= 0) {
-            printf("Error: invalid signal provided!\n");
-            exitCode = 2;
-            return;
+            shellPrintf("Error: invalid signal provided!\n");
+            return 2;
         }
         sig = (int)sigNum;
     }
@@ -218,46 +349,346 @@ void command_kill(char *idxStr, char *sigStr) {
     }
 
     if (pid == -1) {
-        printf("Error: this index is not a background process!\n");
-        exitCode = 2;
-        return;
+        shellPrintf("Error: this index is not a background process!\n");
+        return 2;
     }
 
     if (kill(pid, sig) == -1) {
         perror("Error sending signal");
-        exitCode = 2;
+        return 2;
+    }
+    return 0;
+}
+
+/**
+ * The function command_deadline is one of the built-in commands of the shell.
+ *
+ *     deadline index [-k duration] duration | off
+ *
+ * Sets (or replaces, or removes) the deadline of bg job index: when it passes, the job
+ * gets SIGTERM, and SIGKILL after the grace period of -k (see timeouts.h). Without
+ * arguments, the jobs that have a deadline are listed.
+ * @return the exit code of the command.
+ */
+int command_deadline(int argc, char **argv)
+{
+    if (argc == 1)
+    {
+        int64_t left;
+        bool terminated;
+        for (int i = 0; i < backgroundProcessCount; ++i)
+        {
+            BackgroundProcess *job = &backgroundProcesses[i];
+            if ((i == 0 || backgroundProcesses[i - 1].index != job->index)
+                && job->deadline != -1 && deadlineLeft(job->deadline, &left, &terminated))
+                shellPrintf("Job %d: %s in %.1fs\n", job->index, terminated ? "SIGKILL" : "SIGTERM", left > 0 ? left / 1e9 : 0.0);
+        }
+        return 0;
+    }
+
+    char *endptr;
+    long index = strtol(argv[1][0] == '%' ? argv[1] + 1 : argv[1], &endptr, 10);
+    int64_t timeout = 0, killAfter = (int64_t)DEFAULT_KILL_AFTER_SECONDS * 1000000000;
+    int i = 2;
+    bool valid = *endptr == '\0' && index > 0;
+    if (valid && argc > 3 && strcmp(argv[2], "-k") == 0)
+    {
+        valid = parseDuration(argv[3], &killAfter);
+        i = 4;
+    }
+    bool off = valid && i == argc - 1 && strcmp(argv[i], "off") == 0;
+    if (!valid || i != argc - 1 || (!off && (!parseDuration(argv[i], &timeout) || timeout == 0)))
+    {
+        shellPrintf("Error: usage: deadline [index [-k duration] duration | off]!\n");
+        return 2;
+    }
+
+    int first = -1;
+    for (int j = 0; j < backgroundProcessCount && first == -1; ++j)
+    {
+        if (backgroundProcesses[j].index == index)
+            first = j;
+    }
+    pid_t pgid = first == -1 ? -1 : getpgid(backgroundProcesses[first].pid);
+    if (pgid == -1)
+    {
+        shellPrintf("Error: this index is not a background process!\n");
+        return 2;
     }
+    if (backgroundProcesses[first].deadline != -1)
+        cancelDeadline(backgroundProcesses[first].deadline);
+    int deadline = off ? -1 : addDeadline(pgid, timeout, killAfter);
+    for (int j = first; j < backgroundProcessCount && backgroundProcesses[j].index == index; ++j)
+        backgroundProcesses[j].deadline = deadline;
+    return off || deadline != -1 ? 0 : 1;
 }
 
 /**
  * The function command_jobs is one of the built-in commands of the shell.
- * Lists all currently running background processes.
+ * Lists all currently running background jobs, with the limits of the jobs
+ * started by the limit prefix and the CPU time and memory they have used.
+ * "jobs -o N" shows the captured output of job N, like "output N".
+ * @return the exit code of the command.
 */
-void command_jobs()
+int command_jobs(int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "-o") == 0)
+        return command_output(argc - 1, argv + 1);
     if (backgroundProcessCount == 0)
     {
-        printf("No background processes!\n");
+        shellPrintf("No background processes!\n");
+        return 0;
     }
-    else
+
+    // The processes of a job are added together, so they are next to each other.
+    pid_t pids[MAX_BACKGROUND_PROCESSES];
+    char text[512];
+    for (int i = backgroundProcessCount - 1; i >= 0; )
+    {
+        BackgroundProcess *job = &backgroundProcesses[i];
+        int count = 0;
+        for (; i >= 0 && backgroundProcesses[i].index == job->index; --i)
+            pids[count++] = backgroundProcesses[i].pid;
+        job = &backgroundProcesses[i + 1];
+
+        shellPrintf("Process running with index %d%s\n", job->index, job->index == coprocIndex ? " (coprocess)" : "");
+        if (hasLimits(&job->limits))
+        {
+            describeLimits(&job->limits, text, sizeof(text));
+            shellPrintf("    limits: %s\n", text);
+            describeUsage(&job->limits, pids, count, text, sizeof(text));
+            shellPrintf("    usage: %s\n", text);
+        }
+        int64_t left;
+        bool terminated;
+        if (job->deadline != -1 && deadlineLeft(job->deadline, &left, &terminated))
+            shellPrintf("    deadline: %s in %.1fs\n", terminated ? "SIGKILL" : "SIGTERM", left > 0 ? left / 1e9 : 0.0);
+    }
+    return 0;
+}
+
+/**
+ * The function jobIsRunning checks whether bg job \param index still has processes.
+ */
+static bool jobIsRunning(int index)
+{
+    for (int i = 0; i < backgroundProcessCount; ++i)
+    {
+        if (backgroundProcesses[i].index == index)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The function waitForJobs blocks until bg job \param index (0: every job, or with
+ * \param any the first job) has finished. The processes are watched through pidfds
+ * together with waitInterruptFd, so the wait does not poll and Ctrl+C ends it. It
+ * reaps the processes itself; SIGCHLD is blocked meanwhile, so the handler does not
+ * take them first.
+ * @param interrupted set when Ctrl+C ended the wait.
+ * @return the exit code of the job that finished last, 130 if interrupted.
+ */
+static int waitForJobs(int index, bool any, bool *interrupted)
+{
+    struct pollfd fds[MAX_BACKGROUND_PROCESSES + 1];
+    pid_t pids[MAX_BACKGROUND_PROCESSES];
+    int result = 0;
+
+    if (waitInterruptFd == -1)
+        waitInterruptFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    uint64_t pending;
+    while (read(waitInterruptFd, &pending, sizeof(pending)) > 0)
+        ;                                   // a Ctrl+C from before the wait
+    sigset_t blockChild, saved;
+    sigemptyset(&blockChild);
+    sigaddset(&blockChild, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &blockChild, &saved);
+    waitingForJobs = 1;
+
+    while (true)
+    {
+        int count = 0;
+        for (int i = 0; i < backgroundProcessCount; ++i)
+        {
+            if (index != 0 && backgroundProcesses[i].index != index)
+                continue;
+            pids[count] = backgroundProcesses[i].pid;
+            fds[count].fd = (int)syscall(SYS_pidfd_open, pids[count], 0);
+            fds[count].events = POLLIN;
+            fds[count].revents = fds[count].fd == -1 ? POLLIN : 0;   // no pidfd: reap it blocking
+            count++;
+        }
+        if (count == 0)
+            break;
+        fds[count].fd = waitInterruptFd;
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+
+        bool ready = false;
+        for (int i = 0; i < count; ++i)
+            ready = ready || fds[i].fd == -1;
+        if (!ready && poll(fds, count + 1, -1) == -1 && errno != EINTR)
+            perror("poll");
+
+        *interrupted = fds[count].revents != 0 || read(waitInterruptFd, &pending, sizeof(pending)) > 0;
+        int finished = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            int status;
+            pid_t pid = 0;
+            if (fds[i].revents != 0)
+            {
+                while ((pid = waitpid(pids[i], &status, fds[i].fd == -1 ? 0 : WNOHANG)) == -1 && errno == EINTR)
+                    ;
+                if (pid == -1)
+                    status = 0;             // not our child (wait in a background pipeline)
+            }
+            if (fds[i].fd != -1)
+                close(fds[i].fd);
+            if (pid == 0)
+                continue;
+            int job = -1;
+            for (int j = 0; j < backgroundProcessCount; ++j)
+            {
+                if (backgroundProcesses[j].pid == pids[i])
+                    job = backgroundProcesses[j].index;
+            }
+            removeBackgroundPID(pids[i], status);
+            if (job != -1 && !jobIsRunning(job))
+            {
+                FinishedJob *done = findFinishedJob(job);
+                result = done != NULL ? done->status : 0;
+                finished++;
+            }
+        }
+        if (*interrupted)
+        {
+            result = 130;
+            break;
+        }
+        if (any && finished > 0)
+            break;
+    }
+
+    cancelFinishedDeadlines();
+    waitingForJobs = 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return result;
+}
+
+/**
+ * The function command_wait is one of the built-in commands of the shell.
+ *
+ *     wait [-n] [%index...]
+ *
+ * Waits for all background jobs, for the given jobs or, with -n, for the next job to
+ * finish. The exit code of a job is kept once it has finished, so waiting for a job
+ * that already ended returns at once.
+ * @return the exit code of the (last) job waited for, 127 for an unknown job.
+ */
+int command_wait(int argc, char **argv)
+{
+    bool interrupted = false;
+    if (argc > 1 && strcmp(argv[1], "-n") == 0)
     {
-        for (int i = backgroundProcessCount - 1; i >= 0; --i)
+        if (argc > 2 || backgroundProcessCount == 0)
+        {
+            shellPrintf(argc > 2 ? "Error: usage: wait [-n] [%%index...]!\n" : "Error: no background processes!\n");
+            return 127;
+        }
+        return waitForJobs(0, true, &interrupted);
+    }
+    if (argc == 1)
+        return waitForJobs(0, false, &interrupted);
+
+    int result = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        char *endptr;
+        long index = strtol(argv[i] + (argv[i][0] == '%'), &endptr, 10);
+        if (*endptr != '\0' || index <= 0 || index >= nextProcessIndex)
+        {
+            shellPrintf("Error: invalid index provided!\n");
+            return 127;
+        }
+        if (jobIsRunning((int)index))
+            result = waitForJobs((int)index, false, &interrupted);
+        else
         {
-            printf("Process running with index %d\n", backgroundProcesses[i].index);
+            FinishedJob *job = findFinishedJob((int)index);
+            if (job == NULL)
+            {
+                shellPrintf("Error: the exit code of index %ld is no longer known!\n", index);
+                return 127;
+            }
+            result = job->status;
         }
+        if (interrupted)
+            break;
+    }
+    return result;
+}
+
+/**
+ * The function command_pool is one of the built-in commands of the shell.
+ * Without an argument it prints the state of the spawn pool; with a number
+ * it sets how many pre-forked helpers are kept ready (0 disables the pool).
+ * @return the exit code of the command.
+*/
+int command_pool(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printSpawnPoolStatus();
+        return 0;
+    }
+
+    char *endptr;
+    long size = strtol(argv[1], &endptr, 10);
+    if (*endptr != '\0' || size < 0 || size > MAX_POOL_SIZE)
+    {
+        shellPrintf("Error: pool size must be between 0 and %d!\n", MAX_POOL_SIZE);
+        return 2;
     }
+    setSpawnPoolSize((int)size);
+    return 0;
 }
 
 /**
  * one of the built-in commands of the shell.
- * this function is used in parseBuiltIn.
- * this function returns the most recent exit code.
- * @return a bool denoting the sucess of its execution
+ * this function is used in runBuiltIn.
+ * this function prints the most recent exit code.
+ * @return the most recent exit code, which is left unchanged.
 */
-bool status()
+int command_status(int argc, char **argv)
 {
-    printf("The most recent exit code is: %d\n", exitCode);
-    return true;
+    shellPrintf("The most recent exit code is: %d\n", exitCode);
+    int first = finishedJobCount > MAX_FINISHED_JOBS ? finishedJobCount - MAX_FINISHED_JOBS : 0;
+    for (int i = first; i < finishedJobCount; i++)
+    {
+        FinishedJob *job = &finishedJobs[i % MAX_FINISHED_JOBS];
+        shellPrintf("Background process with index %d exited with code %d\n", job->index, job->status);
+    }
+    return exitCode;
+}
+
+/**
+ * The function command_exit is one of the built-in commands of the shell.
+ * Exits the shell, unless there are still background processes running.
+ * @return the exit code of the command if the shell does not exit.
+*/
+int command_exit(int argc, char **argv)
+{
+    cleanupBackgroundProcesses();
+    if (backgroundProcessCount > 0)
+    {
+        shellPrintf("Error: there are still background processes running!\n");
+        return 2;
+    }
+    shellFlush();
+    exitCode = 0;               // reported by server mode on the way out
+    exit(0);
 }
 
 /**
@@ -313,6 +744,8 @@ bool isOperator(char *s) {
             ";",
             "<",
             ">",
+            "<&",
+            ">&",
             "|",
             NULL
     };
@@ -323,244 +756,893 @@ bool isOperator(char *s) {
     return false;
 }
 
+typedef struct Stage                                                // one command of a pipeline
+{
+    char **args;                    // NULL-terminated, grows in the expansion arena
+    int argc;
+    int capacity;
+    size_t size;                    // bytes the arguments take up in the exec image
+    size_t limit;                   // see argumentLimit, computed once the arguments get large
+    char *inputFile;
+    char *outputFile;
+    bool append;
+    bool coprocIn;                  // stdin from the coprocess (<&p)
+    bool coprocOut;                 // stdout to the coprocess (>&p)
+    bool coprocClose;               // and the shell closes the input of the coprocess (>&p-)
+    bool expansionFailed;           // an arithmetic expansion was invalid, the command does not run
+    bool builtIn;
+    bool function;                  // runs in a forked copy of the shell (see spawnBuiltIn)
+} Stage;
+
+typedef struct PipelineOptions                                      // set by prefixes in front of a pipeline
+{
+    bool stats;
+    long pipeSize;
+    bool coproc;
+    int64_t timeout;                // see the timeout prefix, 0 for none
+    int64_t killAfter;
+    ResourceLimits limits;
+} PipelineOptions;
+
+typedef struct StageThread                                          // a builtin stage running as a thread
+{
+    pthread_t thread;
+    Stage *stage;
+    Stream in;
+    Stream out;
+    int status;
+} StageThread;
+
 /**
- * The main function of our shell.
- * It processes the list to handle command execution including piping and 
- * i/o redirection and background processes.
- * 
- * PIPING && REDIRECTION:
- * If the pipe operator is encountered, a pipe is created using pipe(),
- * this fills pipfd array (of file descriptors) in which pipefd[0] is used 
- * for reading from the pipe and pipefd[1] for writing to the pipe.
- * 
- * OUTPUT REDIRECTION:
- * If the function runs into an output redirection operator, it opens the output file. 
- * The file descriptor for the opened file is stored in fd_out.
- * 
- * INPUT REDIRECTION:
- * If the function runs into an input redirection operator, it opens the input file
- * for reading and stores the file descriptor in fd_in
- * 
- * BG PROCESSES:
- * Manages background processes by calling appropriate functions and
- * updating the appropriate variables.
- * 
- * @param lp List pointer to the start of the tokenlist.
- * a bool denoting whether execution was successful 
-*/
+ * The function isChainOperator checks whether \param s ends a pipeline.
+ */
+static bool isChainOperator(char *s)
+{
+    return strcmp(s, "&") == 0 || strcmp(s, "&&") == 0 || strcmp(s, "||") == 0 || strcmp(s, ";") == 0;
+}
 
-bool parseExecutable(List *lp) {
-    int pipefd[2];
-    pid_t pid;
-    int status;
-    int prev_pipe = STDIN_FILENO;
-    // File descriptors for input and output redirection
-    int fd_in = -1, fd_out = -1; 
-    
-    char *inputFile = NULL;
-    char *outputFile = NULL;
-    bool invalidSyntax = false;
-    List backupList = *lp;
-
-    if (keeptrack == 0)
-    {
-        while (backupList != NULL) {
-            if (strcmp(backupList->t, "&") == 0) {
-                isBackground = true;
-                ++keeptrack;
-                break; // Exit the loop if "&" is found.
-            }
-            backupList = backupList->next; // Move to the next item in the list.
-            ++keeptrack;
-        }
-    }    
-    // Iterate through the list until an operator is encountered
-    while (*lp != NULL && !isOperator((*lp)->t)) {
+/**
+ * The function isBackgroundPipeline checks whether the pipeline starting at \param l
+ * is terminated by "&".
+ */
+static bool isBackgroundPipeline(List l)
+{
+    while (l != NULL && !isChainOperator(l->t))
+        l = l->next;
+    return l != NULL && strcmp(l->t, "&") == 0;
+}
+
+/**
+ * The function skipPipeline moves \param lp to the operator that ends the current pipeline.
+ */
+static void skipPipeline(List *lp)
+{
+    while (*lp != NULL && !isChainOperator((*lp)->t))
+        *lp = (*lp)->next;
+}
+
+/**
+ * The function argumentLimit returns how many bytes of arguments a command may get:
+ * ARG_MAX less the environment, which shares the space with the arguments.
+ */
+size_t argumentLimit()
+{
+    extern char **environ;
+    size_t size = 0;
+    for (char **e = environ; *e != NULL; e++)
+        size += strlen(*e) + 1 + sizeof(char *);
+    long max = sysconf(_SC_ARG_MAX);
+    max = max > 0 ? max : ARG_MAX_FALLBACK;
+    return (size_t)max > size ? (size_t)max - size : 1;
+}
 
-        char *args[MAX_ARGS + 1];
-        int i = 0;
-        bool hasPipe = false;
-        
-        char *firstFile = (*lp)->t;
+/**
+ * The function addArgument appends \param arg to the arguments of \param stage. The
+ * argument vector lives in the expansion arena and doubles when it is full, so a
+ * command line is collected in linear time, whatever the number of arguments.
+ * @return a bool denoting whether the argument fits in the limits of the kernel.
+ */
+static bool addArgument(Stage *stage, char *arg)
+{
+    size_t length = strlen(arg) + 1;
+    stage->size += length + sizeof(char *);
+    if (stage->size > ARG_CHECK_THRESHOLD && stage->limit == 0)
+        stage->limit = argumentLimit();
+    if (length > MAX_ARGUMENT_LENGTH || (stage->limit > 0 && stage->size > stage->limit))
+    {
+        printf("Error: argument list too long!\n");
+        return false;
+    }
+    if (stage->argc + 1 >= stage->capacity)
+    {
+        int capacity = stage->capacity == 0 ? 16 : 2 * stage->capacity;
+        char **args = expansionAllocate(capacity * sizeof(*args));
+        if (stage->argc > 0)
+            memcpy(args, stage->args, stage->argc * sizeof(*args));
+        stage->args = args;
+        stage->capacity = capacity;
+    }
+    stage->args[stage->argc++] = arg;
+    return true;
+}
 
-        // loop until end of command
-        while (*lp != NULL && i < MAX_ARGS) 
+/**
+ * The function parseStage reads one command of a pipeline: its arguments and its
+ * input/output redirections, up to the next "|" or operator. Variables in the words
+ * are expanded (see expandWord); "$@" becomes one argument per positional parameter.
+ * @param lp List pointer to the start of the command.
+ * @param stage the stage that is filled in.
+ * @param hasPipe set to whether the command is followed by "|".
+ * @return a bool denoting whether the command was syntactically valid, and its words
+ * could be expanded.
+ */
+static bool parseStage(List *lp, Stage *stage, bool *hasPipe)
+{
+    stage->argc = 0;
+    stage->capacity = 0;
+    stage->size = 0;
+    stage->limit = 0;
+    stage->args = NULL;
+    stage->inputFile = NULL;
+    stage->outputFile = NULL;
+    stage->append = false;
+    stage->coprocIn = false;
+    stage->coprocOut = false;
+    stage->coprocClose = false;
+    stage->expansionFailed = false;
+    *hasPipe = false;
+    bool valid = true;
+
+    while (*lp != NULL && valid)
+    {
+        char *t = (*lp)->t;
+        if (strcmp(t, "|") == 0)
         {
-            if (strcmp((*lp)->t, "&") == 0)
-            {
-                isBackground = true;
-                break;
-            }
-            if (strcmp((*lp)->t, "|") == 0) 
-            {
-                hasPipe = true;
-                (*lp) = (*lp)->next;
-                break;
-            } 
-            else if (strcmp((*lp)->t, ">") == 0 || strcmp((*lp)->t, ">>") == 0) 
-            {
-                // Handle output redirection
-                (*lp) = (*lp)->next;
-                if ((*lp) != NULL) 
-                {
-                    fd_out = open((*lp)->t, strcmp((*lp)->t, ">") == 0 ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY | O_CREAT | O_APPEND, 0644);
-                    outputFile = (*lp)->t;
-                    inputFile = firstFile;
-                    if (fd_out == -1) 
-                    {
-                        perror("open");
-                        return false;
-                    }
-                } else {
-                    invalidSyntax = true;
-                    printf("Error: invalid syntax!\n");
-                    break;
-                }
-                (*lp) = (*lp)->next;
-                continue;
-            } 
-            else if (strcmp((*lp)->t, "<") == 0) 
-            {
-                // Handle input redirection
-                (*lp) = (*lp)->next;
-                if ((*lp) != NULL)
-                {
-                    fd_in = open((*lp)->t, O_RDONLY);
-                    inputFile = (*lp)->t;
-                    outputFile = firstFile;
-                    if (fd_in == -1) 
-                    {
-                        perror("open");
-                        return false;
-                    }
-                } else{
-                    invalidSyntax = true;
-                    printf("Error: invalid syntax!\n");
-                    break;
-                }
-                (*lp) = (*lp)->next;
-                continue;
-            } 
-            
-            if (isOperator((*lp)->t)) 
-                break;
-            
-            args[i] = (*lp)->t; 
+            *hasPipe = true;
             *lp = (*lp)->next;
-            i++;
-        }
-        if (inputFile != NULL && outputFile != NULL && strcmp(inputFile, outputFile) == 0)
-        {
-            printf("Error: input and output files cannot be equal!\n");
-            exitCode = 2;
-            continue;
+            break;
         }
-        args[i] = NULL; // Null-terminate the arguments array
-
-        // Execute the command with its arguments
-        if (i > 0) 
+        if (strcmp(t, ">") == 0 || strcmp(t, ">>") == 0 || strcmp(t, "<") == 0)
         {
-            if (hasPipe && pipe(pipefd) == -1) 
+            *lp = (*lp)->next;
+            if (*lp == NULL || isOperator((*lp)->t))
             {
-                perror("pipe");
+                printf("Error: invalid syntax!\n");
                 return false;
             }
-
-            pid = fork();
-            if (pid == -1) 
+            char *file = expandWord((*lp)->t);
+            if (file == NULL)
             {
-                perror("fork");
+                stage->expansionFailed = true;
                 return false;
             }
-            if (pid > 0)
+            if (t[0] == '<')
             {
-                foregroundPID = pid;
-                if (isBackground)
-                {
-                    addBackgroundPID(pid);
-                    nextProcessIndex += 1;
-                }
-                else if (!isBackground || backgroundProcessCount <= 0)
-                {
-                    waitpid(pid, &status, 0);
-                    if (WIFEXITED(status)) {
-                        exitCode = WEXITSTATUS(status);
-                    } else if (WIFSIGNALED(status)) {
-                        int signalNum = WTERMSIG(status);
-                        exitCode = 128 + signalNum; // Setting special exit code for signal termination
-                    }
-                    foregroundPID = -1; // Reset after the process completes
-                }
+                stage->inputFile = file;
             }
-            // Child process
-            if (pid == 0) 
+            else
             {
-                if (setpgid(0, 0) == -1)
-                {
-                    perror("setpgid failed");
-                    exit(EXIT_FAILURE);
-                }
-                if (fd_in != -1) 
-                {
-                    dup2(fd_in, STDIN_FILENO);
-                    close(fd_in);
-                } 
-                else 
-                {
-                    dup2(prev_pipe, STDIN_FILENO);
-                    if (prev_pipe != STDIN_FILENO) 
-                        close(prev_pipe);
-                }
-                if (fd_out != -1) 
-                {
-                    dup2(fd_out, STDOUT_FILENO);
-                    close(fd_out);
-                } 
-                else if (hasPipe) 
-                {
-                    dup2(pipefd[1], STDOUT_FILENO);
-                    close(pipefd[1]);
-                }    
-                if (!invalidSyntax && execvp(args[0], args) == -1){
-                    printf("Error: command not found!\n");
-                    exit(127);
-                } else {
-                    if (!isBackground)
-                    {
-                        waitpid(pid, &status, 0);
-                        exitCode = WEXITSTATUS(status);
-                        foregroundPID = -1;
-                    } else {
-                        addBackgroundPID(pid);
-                    }
-                }
-                exit(EXIT_FAILURE);
-            } 
-            else 
-            {  
-                if (fd_in != -1) 
-                    close(fd_in);
-                if (fd_out != -1) 
-                    close(fd_out);
-                if (hasPipe) 
-                    close(pipefd[1]);
-                if (hasPipe) 
-                    prev_pipe = pipefd[0];
-                else 
-                    prev_pipe = STDIN_FILENO;
+                stage->outputFile = file;
+                stage->append = strcmp(t, ">>") == 0;
             }
+            *lp = (*lp)->next;
+            continue;
         }
-    }
-    if (isBackground)
-    {
-        isBackground = false;
-    }
-    else if (!isBackground)
+        if (strcmp(t, "<&") == 0 || strcmp(t, ">&") == 0)
+        {
+            *lp = (*lp)->next;
+            bool close = *lp != NULL && t[0] == '>' && strcmp((*lp)->t, "p-") == 0;
+            if (*lp == NULL || (strcmp((*lp)->t, "p") != 0 && !close))
+            {
+                printf("Error: invalid syntax!\n");
+                return false;
+            }
+            if (t[0] == '<')
+                stage->coprocIn = true;
+            else
+                stage->coprocOut = true;
+            stage->coprocClose = close;
+            *lp = (*lp)->next;
+            continue;
+        }
+        if (isOperator(t))
+            break;
+
+        if (strcmp(t, "$@") == 0)
+        {
+            for (int i = 1; i <= positionalCount() && valid; i++)
+                valid = addArgument(stage, positionalParameter(i));
+        }
+        else
+        {
+            char *arg = expandWord(t);
+            stage->expansionFailed = arg == NULL;
+            valid = arg != NULL && addArgument(stage, arg);
+        }
+        *lp = (*lp)->next;
+    }
+    if (!valid)
+        return false;
+    if (stage->args == NULL)
+        stage->args = expansionAllocate(sizeof(*stage->args));
+    stage->args[stage->argc] = NULL;        // Null-terminate the arguments array
+    stage->builtIn = stage->argc > 0 && isBuiltIn(stage->args[0]);
+    stage->function = !stage->builtIn && stage->argc > 0 && isFunction(stage->args[0]);
+    return true;
+}
+
+/**
+ * The function runBuiltInStage is the body of a thread that runs a builtin stage.
+ * Its stdin and stdout are the streams of the stage; both are closed when the
+ * builtin returns, so neighbouring stages see end-of-input.
+ */
+static void *runBuiltInStage(void *arg)
+{
+    StageThread *st = arg;
+    shellIn = &st->in;
+    shellOut = &st->out;
+    st->status = runBuiltIn(st->stage->argc, st->stage->args);
+    streamClose(&st->in);
+    streamClose(&st->out);
+    return NULL;
+}
+
+/**
+ * The function startBuiltInThread starts a builtin stage on its own thread. All signals
+ * are blocked on the thread, so they keep being handled by the main thread and a write
+ * to a closed pipe fails with EPIPE instead of raising SIGPIPE.
+ * @return a bool denoting whether the thread was started.
+ */
+static bool startBuiltInThread(StageThread *st)
+{
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int error = pthread_create(&st->thread, NULL, runBuiltInStage, st);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (error != 0)
+    {
+        errno = error;
+        perror("pthread_create");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The function spawnBuiltIn runs a builtin stage of a background pipeline in a
+ * forked child, so it does not hold up the shell. A function that is a stage of a
+ * pipeline, or has redirections, runs this way too; the commands of the function
+ * inherit the streams of the stage as their stdin and stdout.
+ * @param errFd becomes stderr of the child.
+ * @return the pid of the child, or -1 if it could not be started.
+ */
+static pid_t spawnBuiltIn(Stage *stage, Stream *in, Stream *out, int errFd, pid_t pgid, const ResourceLimits *limits)
+{
+    shellFlush();                   // the child would write pending output a second time
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (setpgid(0, pgid) == -1)
+            setpgid(0, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        applyLimits(limits);
+        if (errFd != STDERR_FILENO)
+            dup2(errFd, STDERR_FILENO);
+        int keep[] = { in->fd, out->fd, errFd, coprocReadFd, coprocWriteFd };
+        closeOtherPipes(keep, sizeof(keep) / sizeof(*keep));
+        shellIn = in;
+        shellOut = out;
+        if (stage->function)
+        {
+            if (in->fd != STDIN_FILENO)
+                dup2(in->fd, STDIN_FILENO);
+            if (out->fd != STDOUT_FILENO)
+                dup2(out->fd, STDOUT_FILENO);
+            exit(runFunction(stage->argc, stage->args));
+        }
+        exit(runBuiltIn(stage->argc, stage->args));
+    }
+    return pid;
+}
+
+/**
+ * The function coprocessRunning checks whether the job of the coprocess is still running.
+ */
+static bool coprocessRunning()
+{
+    for (int i = 0; coprocIndex != 0 && i < backgroundProcessCount; i++)
+    {
+        if (backgroundProcesses[i].index == coprocIndex)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The function openCoprocess makes the pipes of a new coprocess. The shell keeps one
+ * end of each, so later commands can be connected to the coprocess with <&p and >&p.
+ * The ends of an earlier coprocess that has finished are closed.
+ * @param in set to the end the first command of the coprocess reads from.
+ * @param out set to the end the last command of the coprocess writes to.
+ * @return a bool denoting whether the pipes were made.
+ */
+static bool openCoprocess(int *in, int *out)
+{
+    if (coprocessRunning())
+    {
+        printf("Error: coprocess %d is still running!\n", coprocIndex);
+        return false;
+    }
+    if (coprocReadFd != -1)
+        close(coprocReadFd);
+    if (coprocWriteFd != -1)
+        close(coprocWriteFd);
+    coprocReadFd = coprocWriteFd = -1;
+    coprocIndex = 0;
+
+    int toCoprocess[2], fromCoprocess[2];
+    if (pipe2(toCoprocess, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        return false;
+    }
+    if (pipe2(fromCoprocess, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        close(toCoprocess[0]);
+        close(toCoprocess[1]);
+        return false;
+    }
+    *in = toCoprocess[0];
+    *out = fromCoprocess[1];
+    coprocWriteFd = toCoprocess[1];
+    coprocReadFd = fromCoprocess[0];
+    return true;
+}
+
+/**
+ * The function openCoprocessStream connects a stream of a stage to the coprocess.
+ * @return a bool denoting whether the coprocess can be written to (read from, for input).
+ */
+static bool openCoprocessStream(Stream *s, bool output)
+{
+    if (output && coprocessRunning() && coprocWriteFd == -1)
+    {
+        printf("Error: the input of the coprocess is closed!\n");
+        return false;
+    }
+    // What the coprocess wrote can still be read after it has ended.
+    int source = output ? (coprocessRunning() ? coprocWriteFd : -1) : coprocReadFd;
+    int fd = source != -1 ? fcntl(source, F_DUPFD_CLOEXEC, 0) : -1;
+    if (fd == -1)
+    {
+        printf("Error: no coprocess is running!\n");
+        return false;
+    }
+    streamClose(s);
+    *s = fdStream(fd, output);
+    return true;
+}
+
+/**
+ * The function openRedirections replaces the streams of a stage by the files it
+ * redirects from/to, or by the pipes of the coprocess. With >&p- the shell gives up
+ * its own end of the coprocess input to the stage.
+ * @return a bool denoting whether the files could be opened.
+ */
+static bool openRedirections(Stage *stage, Stream *in, Stream *out)
+{
+    if ((stage->coprocIn && !openCoprocessStream(in, false)) || (stage->coprocOut && !openCoprocessStream(out, true)))
+        return false;
+    if (stage->inputFile != NULL)
+    {
+        int fd = open(stage->inputFile, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            perror("open");
+            return false;
+        }
+        streamClose(in);
+        *in = fdStream(fd, false);
+    }
+    if (stage->outputFile != NULL)
+    {
+        int fd = open(stage->outputFile, O_WRONLY | O_CREAT | O_CLOEXEC | (stage->append ? O_APPEND : O_TRUNC), 0644);
+        if (fd == -1)
+        {
+            perror("open");
+            return false;
+        }
+        streamClose(out);
+        *out = fdStream(fd, true);
+    }
+    if (stage->coprocClose)
+    {
+        // The stage holds the last write end, so the coprocess sees EOF once it is done.
+        close(coprocWriteFd);
+        coprocWriteFd = -1;
+    }
+    return true;
+}
+
+/**
+ * The function parseSizeArgument reads the pipe capacity argument of a prefix.
+ * @return a bool denoting whether a valid size was read.
+ */
+static bool parseSizeArgument(List *lp, long *size)
+{
+    if (*lp == NULL || (*size = parsePipeSize((*lp)->t)) == -1)
+    {
+        printf("Error: invalid pipe size!\n");
+        return false;
+    }
+    *lp = (*lp)->next;
+    return true;
+}
+
+/**
+ * The function parseLimitArguments reads the options of the limit prefix.
+ * @return a bool denoting whether the options were valid.
+ */
+static bool parseLimitArguments(List *lp, ResourceLimits *limits)
+{
+    while (*lp != NULL && (*lp)->t[0] == '-' && (*lp)->t[1] != '\0' && strchr("tvnNmc", (*lp)->t[1]) != NULL && (*lp)->t[2] == '\0')
+    {
+        char option = (*lp)->t[1];
+        char *arg = (*lp)->next == NULL ? NULL : (*lp)->next->t;
+        char *endptr = NULL;
+        long value = arg == NULL ? 0 : strtol(arg, &endptr, 10);
+        bool valid = arg != NULL && *endptr == '\0' && value > 0;
+        switch (option)
+        {
+        case 't':
+            limits->cpuSeconds = value;
+            break;
+        case 'n':
+            limits->openFiles = value;
+            break;
+        case 'N':
+            valid = arg != NULL && *endptr == '\0' && value >= -20 && value <= 19;
+            limits->nice = value;
+            break;
+        case 'c':
+            limits->cpuPercent = value;
+            break;
+        case 'v':
+            valid = arg != NULL && (limits->addressSpace = parseByteSize(arg)) != -1;
+            break;
+        case 'm':
+            valid = arg != NULL && (limits->memoryMax = parseByteSize(arg)) != -1;
+            break;
+        }
+        if (!valid)
+        {
+            printf("Error: usage: limit [-t sec] [-v size] [-n files] [-N nice] [-m size] [-c percent] command!\n");
+            return false;
+        }
+        *lp = (*lp)->next->next;
+    }
+    return true;
+}
+
+/**
+ * The function parseTimeoutArguments reads the arguments of the timeout prefix.
+ * @return a bool denoting whether they were valid.
+ */
+static bool parseTimeoutArguments(List *lp, PipelineOptions *options)
+{
+    bool valid = true;
+    options->killAfter = (int64_t)DEFAULT_KILL_AFTER_SECONDS * 1000000000;
+    if (acceptToken(lp, "-k"))
+    {
+        valid = *lp != NULL && parseDuration((*lp)->t, &options->killAfter);
+        if (valid)
+            *lp = (*lp)->next;
+    }
+    valid = valid && *lp != NULL && parseDuration((*lp)->t, &options->timeout) && options->timeout > 0;
+    if (!valid)
+    {
+        printf("Error: usage: timeout [-k duration] duration command!\n");
+        return false;
+    }
+    *lp = (*lp)->next;
+    return true;
+}
+
+/**
+ * The function parsePrefixes reads the prefixes in front of a pipeline:
+ *
+ * <prefix>     ::= "pipestat" [ "-s" <size> ]
+ *               |  "pipesize" <size>
+ *               |  "limit" { <limit option> }
+ *               |  "pin" <cpu list>
+ *               |  "coproc"
+ *               |  "timeout" [ "-k" <duration> ] <duration>
+ *
+ * pipestat reports the traffic of every pipe of the pipeline, pipesize sets the
+ * capacity of its pipes (F_SETPIPE_SZ), limit sets the resource limits of its
+ * processes (see ResourceLimits), pin the CPUs they may run on, coproc starts it
+ * as the coprocess and timeout gives it a deadline (see timeouts.h).
+ * @param lp List pointer to the start of the pipeline.
+ * @param options the options that are filled in.
+ * @return a bool denoting whether the prefixes were valid.
+ */
+static bool parsePrefixes(List *lp, PipelineOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+    clearLimits(&options->limits);
+    while (*lp != NULL)
+    {
+        if (acceptToken(lp, "pipestat"))
+        {
+            options->stats = true;
+            if (acceptToken(lp, "-s") && !parseSizeArgument(lp, &options->pipeSize))
+                return false;
+        }
+        else if (acceptToken(lp, "pipesize"))
+        {
+            if (!parseSizeArgument(lp, &options->pipeSize))
+                return false;
+        }
+        else if (acceptToken(lp, "limit"))
+        {
+            if (!parseLimitArguments(lp, &options->limits))
+                return false;
+        }
+        else if (acceptToken(lp, "pin"))
+        {
+            if (*lp == NULL || !parseCpuList((*lp)->t, &options->limits.cpus))
+            {
+                printf("Error: usage: pin <cpu list> command!\n");
+                return false;
+            }
+            options->limits.pinned = true;
+            *lp = (*lp)->next;
+        }
+        else if (acceptToken(lp, "coproc"))
+            options->coproc = true;
+        else if (acceptToken(lp, "timeout"))
+        {
+            if (!parseTimeoutArguments(lp, options))
+                return false;
+        }
+        else
+            break;
+    }
+    return true;
+}
+
+/**
+ * The function spreadBackgroundJob pins a new background job to the core or node
+ * that runs the fewest of the background jobs.
+ */
+static void spreadBackgroundJob(ResourceLimits *limits)
+{
+    static cpu_set_t jobs[MAX_BACKGROUND_PROCESSES];
+    int count = 0;
+    for (int i = 0; i < backgroundProcessCount; i++)
+    {
+        BackgroundProcess *process = &backgroundProcesses[i];
+        bool first = i == 0 || backgroundProcesses[i - 1].index != process->index;
+        if (first && process->limits.pinned)
+            jobs[count++] = process->limits.cpus;
+    }
+    limits->pinned = chooseCpus(jobs, count, &limits->cpus);
+}
+
+/**
+ * The function runPipeline starts all stages of a pipeline and, unless it runs in the
+ * background, waits for them.
+ *
+ * External commands are started as processes in one process group. Builtins of a
+ * foreground pipeline run as threads inside the shell; two adjacent builtin stages are
+ * connected by a RingBuffer, and a kernel pipe is only used where a builtin meets an
+ * external command. In a background pipeline every stage is a process.
+ *
+ * With pipestat, every pipe of a foreground pipeline is split in two and a PipeTap
+ * splices the data across, measuring it on the way.
+ *
+ * With limit and pin, every process of the pipeline sets the limits before it execs
+ * and joins the cgroup of the pipeline, if it has one. Builtins running as threads of
+ * the shell are not limited. A background pipeline without pin is pinned to a core or
+ * node of its own when spreading is on (see chooseCpus).
+ *
+ * With capturing on, the stderr of every stage and the stdout of the last stage of a
+ * background pipeline go to the capture pipe of the job (see startCapture).
+ *
+ * A coprocess is a background pipeline whose first stage reads from, and whose last
+ * stage writes to, a pipe that the shell keeps open (see openCoprocess).
+ *
+ * @param stages the commands of the pipeline.
+ * @param count the number of commands.
+ * @param background whether the pipeline was terminated by "&".
+ * @param options the options set by the prefixes of the pipeline.
+ */
+static void runPipeline(Stage *stages, int count, bool background, PipelineOptions *options)
+{
+    StageThread threads[MAX_COMMANDS];
+    PipeTap taps[MAX_COMMANDS];
+    pid_t pids[MAX_COMMANDS];
+    int threadCount = 0, pidCount = 0, tapCount = 0;
+    pid_t pgid = 0;
+    int status;
+    int lastStatus = exitCode;
+    bool lastIsThread = false;
+    bool lastFailed = false;            // the last stage could not be started; lastStatus holds why
+
+    int coprocIn = -1, coprocOut = -1;
+    int deadline = -1;
+    background = background || options->coproc;
+    cancelFinishedDeadlines();
+    if (!createJobCgroup(&options->limits))
+    {
+        exitCode = 2;
+        return;
+    }
+    if (options->coproc && !openCoprocess(&coprocIn, &coprocOut))
     {
-        waitpid(pid, &status, 0);
-        foregroundPID = -1;
+        removeJobCgroup(&options->limits);
+        exitCode = 2;
+        return;
+    }
+    if (background && !options->limits.pinned && spreadMode != SPREAD_OFF)
+        spreadBackgroundJob(&options->limits);
+    int captureFd = background && captureOutput ? startCapture(nextProcessIndex) : -1;
+    int errFd = captureFd != -1 ? captureFd : STDERR_FILENO;
+
+    // Children are reaped here; keep the SIGCHLD handler from taking them first.
+    sigset_t blockChild, saved;
+    sigemptyset(&blockChild);
+    sigaddset(&blockChild, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blockChild, &saved);
+
+    Stream next = fdStream(coprocIn != -1 ? coprocIn : STDIN_FILENO, false);
+    for (int i = 0; i < count; i++)
+    {
+        Stage *stage = &stages[i];
+        Stream in = next;
+        Stream out;
+        if (i == count - 1 && coprocOut != -1)
+        {
+            out = fdStream(coprocOut, true);
+        }
+        else if (i == count - 1)
+        {
+            out = fdStream(captureFd != -1 ? fcntl(captureFd, F_DUPFD_CLOEXEC, 0) : STDOUT_FILENO, true);
+        }
+        else if (!background && stage->builtIn && stages[i + 1].builtIn)
+        {
+            RingBuffer *ring = newRingBuffer();
+            out = ringStream(ring, true);
+            next = ringStream(ring, false);
+        }
+        else
+        {
+            // Close-on-exec: builtin threads own pipe ends that commands started
+            // meanwhile must not inherit, or their readers would never see EOF.
+            int pipefd[2];
+            if (pipe2(pipefd, O_CLOEXEC) == -1)
+            {
+                perror("pipe");
+                streamClose(&in);
+                break;
+            }
+            if (options->pipeSize > 0)
+                setPipeSize(pipefd[1], options->pipeSize);
+            out = fdStream(pipefd[1], true);
+            next = fdStream(pipefd[0], false);
+
+            int tapfd[2];
+            if (options->stats && !background && pipe2(tapfd, O_CLOEXEC) == 0)
+            {
+                if (options->pipeSize > 0)
+                    setPipeSize(tapfd[1], options->pipeSize);
+                PipeTap *tap = &taps[tapCount];
+                tap->in = pipefd[0];
+                tap->out = tapfd[1];
+                tap->producer = stage->args[0];
+                tap->consumer = stages[i + 1].args[0];
+                if (startPipeTap(tap))
+                {
+                    tapCount++;
+                    next = fdStream(tapfd[0], false);
+                }
+                else
+                {
+                    close(tapfd[0]);
+                    close(tapfd[1]);
+                }
+            }
+        }
+
+        if (!openRedirections(stage, &in, &out))
+        {
+            streamClose(&in);
+            streamClose(&out);
+            lastStatus = 2;
+            lastFailed = i == count - 1;
+            continue;
+        }
+
+        pid_t pid = -1;
+        if (stage->builtIn && !background)
+        {
+            StageThread *st = &threads[threadCount];
+            st->stage = stage;
+            st->in = in;
+            st->out = out;
+            st->status = 0;
+            if (startBuiltInThread(st))
+                threadCount++;
+            else
+            {
+                streamClose(&in);
+                streamClose(&out);
+            }
+            lastIsThread = true;
+            continue;
+        }
+
+        if (stage->builtIn || stage->function)
+        {
+            pid = spawnBuiltIn(stage, &in, &out, errFd, pgid, &options->limits);
+        }
+        else
+        {
+            SpawnSpec spec = { stage->args, in.fd, out.fd, errFd, pgid, &options->limits };
+            pid = spawnCommand(&spec);
+        }
+        streamClose(&in);
+        streamClose(&out);
+        if (pid == -1)
+        {
+            perror("fork");
+            continue;
+        }
+        if (pgid == 0)
+            pgid = pid;
+        setpgid(pid, pgid);     // also done by the child; whichever runs first wins the race
+        pids[pidCount++] = pid;
+        lastIsThread = false;
+    }
+
+    if (options->timeout > 0 && pgid > 0)
+        deadline = addDeadline(pgid, options->timeout, options->killAfter);
+
+    if (background)
+    {
+        if (captureFd != -1)
+            close(captureFd);
+        for (int i = 0; i < pidCount; i++)
+            addBackgroundPID(pids[i], &options->limits, i == pidCount - 1, deadline);
+        if (options->coproc && pidCount > 0)
+            coprocIndex = nextProcessIndex;
+        if (pidCount > 0)
+            nextProcessIndex += 1;
+        else
+        {
+            removeJobCgroup(&options->limits);
+            if (captureFd != -1)
+                dropCapture(nextProcessIndex);
+        }
+    }
+    else
+    {
+        foregroundPID = pgid > 0 ? pgid : -1;
+        for (int i = 0; i < pidCount; i++)
+        {
+            while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+                ;
+            if (i == pidCount - 1 && !lastIsThread && !lastFailed)
+            {
+                if (WIFEXITED(status)) {
+                    lastStatus = WEXITSTATUS(status);
+                } else if (WIFSIGNALED(status)) {
+                    int signalNum = WTERMSIG(status);
+                    lastStatus = 128 + signalNum; // Setting special exit code for signal termination
+                }
+            }
+        }
+        for (int i = 0; i < threadCount; i++)
+        {
+            pthread_join(threads[i].thread, NULL);
+            if (i == threadCount - 1 && lastIsThread && !lastFailed)
+                lastStatus = threads[i].status;
+        }
+        for (int i = 0; i < tapCount; i++)
+        {
+            finishPipeTap(&taps[i]);
+            printPipeTap(i + 1, &taps[i]);
+        }
+        if (deadline != -1 && cancelDeadline(deadline))
+            lastStatus = TIMEOUT_STATUS;
+        foregroundPID = -1; // Reset after the pipeline completes
+        removeJobCgroup(&options->limits);
+        exitCode = lastStatus;
+    }
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * The main function of our shell.
+ * It processes the list to handle command execution including piping and 
+ * i/o redirection and background processes.
+ * 
+ * The commands of the pipeline are read first (see parseStage) and then started
+ * together by runPipeline, so the stages run concurrently. The words expanded while
+ * reading the commands are released once the pipeline has been started.
+ * 
+ * PIPING && REDIRECTION:
+ * Stages separated by the pipe operator are connected by a pipe (or, for two
+ * builtins, by a ring buffer). 
+ * 
+ * OUTPUT REDIRECTION:
+ * If a command has an output redirection operator, its stdout is the opened file
+ * ("> file" truncates, ">> file" appends).
+ * 
+ * INPUT REDIRECTION:
+ * If a command has an input redirection operator, its stdin is the opened file.
+ * 
+ * BG PROCESSES:
+ * Manages background processes by calling appropriate functions and
+ * updating the appropriate variables.
+ * 
+ * @param lp List pointer to the start of the tokenlist.
+ * a bool denoting whether execution was successful 
+*/
+bool parseExecutable(List *lp) {
+    Stage stages[MAX_COMMANDS];
+    int count = 0;
+    bool hasPipe = true;
+    bool background = isBackgroundPipeline(*lp);
+    PipelineOptions options;
+    bool valid = true;
+    ExpansionMark mark = expansionMark();
+
+    if (!parsePrefixes(lp, &options))
+    {
+        exitCode = 2;
+        skipPipeline(lp);
+        return true;
+    }
+
+    // Iterate through the list until an operator is encountered
+    while (hasPipe && *lp != NULL && !isOperator((*lp)->t)) {
+        if (count == MAX_COMMANDS)
+        {
+            printf("Error: too many commands in pipeline!\n");
+            exitCode = 2;
+            skipPipeline(lp);
+            valid = false;
+            break;
+        }
+        Stage *stage = &stages[count];
+        if (!parseStage(lp, stage, &hasPipe))
+        {
+            exitCode = stage->expansionFailed ? 1 : 2;
+            skipPipeline(lp);
+            valid = false;
+            break;
+        }
+        if (stage->inputFile != NULL && stage->outputFile != NULL && strcmp(stage->inputFile, stage->outputFile) == 0)
+        {
+            printf("Error: input and output files cannot be equal!\n");
+            exitCode = 2;
+            skipPipeline(lp);
+            valid = false;
+            break;
+        }
+        if (stage->argc > 0)
+            count++;
     }
 
+    if (valid && count > 0)
+        runPipeline(stages, count, background, &options);
+    expansionRelease(mark);
     return true;
 }
 
@@ -609,12 +1691,13 @@ bool parsePipeline(List *lp) {
     // If there is a pipe operator, create a pipe
     if (acceptToken(lp, "|")) 
     {
-        if (pipe(pipefd) == -1) 
+        if (pipe2(pipefd, O_CLOEXEC) == -1) 
         {
             perror("pipe");
             return false;
         }
 
+        shellFlush();
         pid = fork();
         if (pid == -1) 
         {
@@ -701,78 +1784,198 @@ bool parseRedirections(List *lp) {
     return true;
 }
 
+// NULL-terminated list of builtin names, shared with tab completion.
+char *builtinNames[] = {
+        "exit",
+        "status",
+        "cd",
+        "kill",
+        "jobs",
+        "pool",
+        "batch",
+        "spread",
+        "wait",
+        "memstats",
+        "capture",
+        "output",
+        "dag",
+        "alias",
+        "unalias",
+        "prefetch",
+        "deadline",
+        "fds",
+        NULL
+};
+
+// NULL-terminated list of prefixes that modify the pipeline they precede.
+char *prefixNames[] = {
+        "pipestat",
+        "pipesize",
+        "limit",
+        "pin",
+        "coproc",
+        "timeout",
+        NULL
+};
+
+/**
+ * The function isBuiltIn checks whether \param s names a builtin.
+ */
+bool isBuiltIn(char *s) {
+    for (int i = 0; builtinNames[i] != NULL; i++) {
+        if (strcmp(s, builtinNames[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The function callBuiltIn calls the function of the builtin named by \param argv[0].
+ */
+static int callBuiltIn(int argc, char **argv) {
+    if (strcmp(argv[0], "exit") == 0)
+        return command_exit(argc, argv);
+    else if (strcmp(argv[0], "status") == 0)
+        return command_status(argc, argv);
+    else if (strcmp(argv[0], "cd") == 0)
+        return cd(argc, argv);
+    else if (strcmp(argv[0], "kill") == 0)
+        return command_kill(argc, argv);
+    else if (strcmp(argv[0], "jobs") == 0)
+        return command_jobs(argc, argv);
+    else if (strcmp(argv[0], "pool") == 0)
+        return command_pool(argc, argv);
+    else if (strcmp(argv[0], "batch") == 0)
+        return command_batch(argc, argv);
+    else if (strcmp(argv[0], "spread") == 0)
+        return command_spread(argc, argv);
+    else if (strcmp(argv[0], "wait") == 0)
+        return command_wait(argc, argv);
+    else if (strcmp(argv[0], "memstats") == 0)
+        return command_memstats(argc, argv);
+    else if (strcmp(argv[0], "capture") == 0)
+        return command_capture(argc, argv);
+    else if (strcmp(argv[0], "output") == 0)
+        return command_output(argc, argv);
+    else if (strcmp(argv[0], "dag") == 0)
+        return command_dag(argc, argv);
+    else if (strcmp(argv[0], "alias") == 0)
+        return command_alias(argc, argv);
+    else if (strcmp(argv[0], "unalias") == 0)
+        return command_unalias(argc, argv);
+    else if (strcmp(argv[0], "prefetch") == 0)
+        return command_prefetch(argc, argv);
+    else if (strcmp(argv[0], "deadline") == 0)
+        return command_deadline(argc, argv);
+    else if (strcmp(argv[0], "fds") == 0)
+        return command_fds(argc, argv);
+    return 127;
+}
+
+/**
+ * The function runBuiltIn runs the builtin named by \param argv[0]. Builtins write
+ * their output with shellPrintf, so they can also run as a stage of a pipeline; the
+ * output they buffered is flushed when they return.
+ * @param argc number of arguments.
+ * @param argv NULL-terminated argument vector.
+ * @return the exit code of the builtin.
+ */
+int runBuiltIn(int argc, char **argv) {
+    MemSubsystem previous = memEnter(MEM_BUILTINS);
+    int status = callBuiltIn(argc, argv);
+    memLeave(previous);
+    shellFlush();
+    return status;
+}
+
 /**
- * The function parseBuiltIn parses a builtin.
- * BuiltIn commands include status, exit, cd, kill, and jobs.
+ * The function parseBuiltIn parses a builtin and runs it.
+ * BuiltIn commands include status, exit, cd, kill, jobs, pool and batch.
  * @param lp List pointer to the start of the tokenlist.
  * @return a bool denoting whether the builtin was parsed successfully.
  */
 bool parseBuiltIn(List *lp) {
+    if (*lp == NULL || !isBuiltIn((*lp)->t))
+        return false;
 
-    char *builtIns[] = {
-            "exit",
-            "status",
-            "cd",
-            "kill",
-            "jobs",
-            NULL
-    };
-    for (int i = 0; builtIns[i] != NULL; i++) {
-        if (acceptToken(lp, builtIns[i]))
-        {
-            if (strcmp(builtIns[i], "exit") == 0)
-            {
-                cleanupBackgroundProcesses();
-                if (isBackground || backgroundProcessCount > 0)
-                {
-                    printf("Error: there are still background processes running!\n");
-                    exitCode = 2;
-                    return true;
-                }
-                else
-                {
-                    cleanupBackgroundProcesses();
-                    exit(0); 
-                }
-            }
-            else if (strcmp(builtIns[i], "status") == 0)
-                return status();
-            else if (strcmp(builtIns[i], "cd") == 0) 
-            {
-                exitCode = cd(lp);
-                return true;
-            }
-            else if (strcmp(builtIns[i], "kill") == 0) {
-                if (*lp == NULL) {
-                    printf("! Error: command requires an index!\n");
-                    return false;
-                }
-                char *idxStr = (*lp)->t;  // Get idx
-                *lp = (*lp)->next;        // Move to next token, which could be sig or NULL
+    Stage stage;
+    bool hasPipe;
+    ExpansionMark mark = expansionMark();
+    if (parseStage(lp, &stage, &hasPipe))
+        exitCode = runBuiltIn(stage.argc, stage.args);
+    else
+    {
+        exitCode = stage.expansionFailed ? 1 : 2;
+        skipPipeline(lp);
+    }
+    expansionRelease(mark);
+    return true;
+}
 
-                char *sigStr = NULL;      // Initialize sig as NULL (default SIGTERM)
-                if (*lp != NULL && isdigit((**lp).t[0])) {  // Check if next token is a signal number
-                    sigStr = (*lp)->t;     // Get sig                    
-                    *lp = (*lp)->next; 
-                }
-                command_kill(idxStr, sigStr);
-                return true;
-            }
-            else if (strcmp(builtIns[i], "jobs") == 0)
-            {
-                command_jobs();
-                return true;
-            }
-        }
+/**
+ * The function parseFunction parses a call of a function and runs the function in the
+ * shell itself (see functions.h).
+ * @param lp List pointer to the start of the tokenlist.
+ * @return a bool denoting whether the chain was a call of a function.
+ */
+static bool parseFunction(List *lp) {
+    if (*lp == NULL || !isFunction((*lp)->t))
+        return false;
+
+    Stage stage;
+    bool hasPipe;
+    ExpansionMark mark = expansionMark();
+    if (parseStage(lp, &stage, &hasPipe))
+        exitCode = runFunction(stage.argc, stage.args);
+    else
+    {
+        exitCode = stage.expansionFailed ? 1 : 2;
+        skipPipeline(lp);
+    }
+    expansionRelease(mark);
+    return true;
+}
+
+/**
+ * The function needsPipeline checks whether the chain starting at \param l has a pipe
+ * or a redirection, in which case a builtin runs through the pipeline executor.
+ */
+static bool needsPipeline(List l) {
+    for (; l != NULL && !isChainOperator(l->t); l = l->next) {
+        if (strcmp(l->t, "|") == 0 || strcmp(l->t, "<") == 0 || strcmp(l->t, ">") == 0 || strcmp(l->t, ">>") == 0)
+            return true;
     }
     return false;
 }
 
+/**
+ * The function parseAssignments runs a chain that consists of assignments only
+ * (NAME=value ...).
+ * @return a bool denoting whether the chain consisted of assignments.
+ */
+static bool parseAssignments(List *lp) {
+    List l = *lp;
+    for (; l != NULL && !isChainOperator(l->t); l = l->next) {
+        if (!isAssignment(l->t))
+            return false;
+    }
+    if (l == *lp)
+        return false;           // no assignment before the operator
+    exitCode = 0;
+    for (; *lp != l; *lp = (*lp)->next) {
+        if (exitCode == 0 && !assignVariable((*lp)->t))
+            exitCode = 1;       // the value could not be expanded; the rest is not assigned
+    }
+    return true;
+}
+
 /**
  * The function parseChain parses a chain according to the grammar:
  *
- * <chain>              ::= <pipeline> <redirections>
+ * <chain>              ::= <assignment> { <assignment> }
+ *                       |  <pipeline> <redirections>
  *                       |  <builtin> <options>
+ *                       |  <function> <options>
  *
  * @param lp List pointer to the start of the tokenlist.
  * @return a bool denoting whether the chain was parsed successfully.
@@ -781,7 +1984,13 @@ bool parseChain(List *lp) {
     if (isEmpty(*lp))
         return false;
 
-    if (parseBuiltIn(lp))
+    if (parseAssignments(lp))
+        return true;
+
+    if (!needsPipeline(*lp) && parseBuiltIn(lp))
+        return parseOptions(lp);
+
+    if (!needsPipeline(*lp) && !isBackgroundPipeline(*lp) && parseFunction(lp))
         return parseOptions(lp);
 
     if (!isEmpty((*lp)->next) && strcmp((*lp)->next->t, "|") != 0)
@@ -814,40 +2023,29 @@ bool parseChain(List *lp) {
  *                   | <chain>
  *                   | <empty>
  *
- * The logic for composition handling is taken care of in this function.
+ * The logic for composition handling is taken care of in this function. The chains
+ * are evaluated one after the other in a loop, so the length of a line is not limited
+ * by the stack.
  * @param lp List pointer to the start of the tokenlist.
  * @return a bool denoting whether the inputline was parsed successfully.
  */
 bool parseInputLine(List *lp) {
 
-    if (isEmpty(*lp))
-        return true;
-
-    if (!parseChain(lp))
-        return false;
-
-    if (acceptToken(lp, "&") || acceptToken(lp, "&&")) {
-        if (exitCode == 0)
-            return parseInputLine(lp);
-        else
-        {
-            skipCommand(lp);
-            return parseInputLine(lp);
-        }
-    } 
+    while (!isEmpty(*lp)) {
+        if (!parseChain(lp))
+            return false;
 
-    else if (acceptToken(lp, "||")) 
-    {
-        if (exitCode != 0)
-            return parseInputLine(lp);
-        else
+        if (acceptToken(lp, "&") || acceptToken(lp, "&&")) {
+            if (exitCode != 0)
+                skipCommand(lp);
+        } 
+        else if (acceptToken(lp, "||")) 
         {
-            skipCommand(lp);
-            return parseInputLine(lp);
-        }
-    } 
-    else if (acceptToken(lp, ";"))
-        return parseInputLine(lp);
-    
+            if (exitCode == 0)
+                skipCommand(lp);
+        } 
+        else if (!acceptToken(lp, ";"))
+            break;
+    }
     return true;
-}
\ No newline at end of file
+}
@@ -2,6 +2,15 @@
 #define SHELL_SHELL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define MAX_ARGUMENT_LENGTH (32 * 4096)     // longest single argument execve accepts (MAX_ARG_STRLEN)
+
+extern char *builtinNames[];
+extern char *prefixNames[];
+extern int exitCode;
+extern pid_t foregroundPID;
 
 void skipCommand(List *lp);
 bool acceptToken(List *lp, char *ident);
@@ -13,10 +22,13 @@ bool parsePipeline(List *lp);
 bool parseFileName(List *lp);
 bool parseRedirections(List *lp);
 bool parseBuiltIn(List *lp);
+bool isBuiltIn(char *s);
+int runBuiltIn(int argc, char **argv);
+size_t argumentLimit();
 bool parseChain(List *lp);
 bool parseInputLine(List *lp);
-bool status();
 void setup_signal_handlers();
 void cleanupBackgroundProcesses();
+size_t jobTableSize(int *entries);
 
 #endif
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "spawn.h"
+#include "fds.h"
+#include "prefetch.h"
+#include "stream.h"
+
+/*
+ * Commands are started either by a plain fork, or, when the spawn pool is enabled,
+ * by handing them to a pre-forked helper process. A helper is a child of the shell
+ * that waits on a socket for a command spec (argv, environment, working directory,
+ * process group and the stdin/stdout/stderr descriptors through SCM_RIGHTS) and
+ * execs it. The helper becomes the command, so waitpid and job control work on its
+ * pid exactly as for a forked child. A background thread refills the pool, which
+ * moves the fork out of the path of every command launch.
+ */
+
+#define POOL_MESSAGE_MAX (64 * 1024)
+
+typedef struct Helper {
+    pid_t pid;
+    int sock;           // shell side of the helper's socket pair
+} Helper;
+
+typedef struct SpawnMessage {
+    int32_t pgid;
+    int32_t argc;
+    int32_t envc;
+} SpawnMessage;
+
+extern char **environ;
+
+static Helper pool[MAX_POOL_SIZE];
+static int poolIdle = 0;
+static int poolTarget = 0;
+static bool refillThreadStarted = false;
+static unsigned long poolLaunches = 0;
+static unsigned long forkLaunches = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWanted = PTHREAD_COND_INITIALIZER;
+
+/**
+ * The function redirect makes \param fd the descriptor \param target and closes the original.
+ */
+static void redirect(int fd, int target) {
+    if (fd == target)
+        return;
+    dup2(fd, target);
+    if (fd > STDERR_FILENO)
+        close(fd);
+}
+
+/**
+ * The function helperMain is the body of a pool helper. It waits for one command
+ * spec and execs it; it exits quietly when the shell closes its socket.
+ * Runs in a child forked from the refill thread, so it only uses static buffers.
+ * @param sock the helper side of the socket pair.
+ */
+static void helperMain(int sock) {
+    static char message[POOL_MESSAGE_MAX];
+    static char *pointers[POOL_MESSAGE_MAX / 2 + 2];
+    static const char notFound[] = "Error: command not found!\n";
+
+    setpgid(0, 0);      // out of the shell's group, so terminal signals do not reach idle helpers
+    if (sock != 3) {
+        dup2(sock, 3);
+        sock = 3;
+    }
+    closeDescriptorsFrom(4);    // drop the sockets of the other helpers
+
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { message, sizeof(message) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n < (ssize_t)sizeof(SpawnMessage) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        _exit(0);
+
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    SpawnMessage header;
+    memcpy(&header, message, sizeof(header));
+
+    int count = header.argc + 1 + header.envc + 1;
+    if (header.argc < 1 || header.envc < 0 || count > (int)(sizeof(pointers) / sizeof(*pointers)))
+        _exit(EXIT_FAILURE);
+
+    char *p = message + sizeof(header);
+    for (int i = 0; i < count; i++) {
+        if (i == header.argc || i == count - 1) {
+            pointers[i] = NULL;
+            continue;
+        }
+        pointers[i] = p;
+        p += strlen(p) + 1;
+    }
+    char *cwd = p;
+
+    if (header.pgid != 0 && setpgid(0, header.pgid) == -1)
+        _exit(EXIT_FAILURE);
+    close(sock);
+    for (int i = 0; i < 3; i++)
+        redirect(fds[i], i);
+    if (chdir(cwd) == -1)
+        _exit(EXIT_FAILURE);
+
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    environ = pointers + header.argc + 1;
+    execvp(pointers[0], pointers);
+    if (write(STDOUT_FILENO, notFound, sizeof(notFound) - 1) < 0)
+        _exit(127);
+    _exit(127);
+}
+
+/**
+ * The function startHelper forks a new pool helper.
+ * @param helper receives the pid and socket of the helper.
+ * @return a bool denoting whether the helper was started.
+ */
+static bool startHelper(Helper *helper) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return false;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0)
+        helperMain(sv[1]);
+
+    close(sv[1]);
+    helper->pid = pid;
+    helper->sock = sv[0];
+    return true;
+}
+
+/**
+ * The function refillPool runs on the refill thread and keeps the pool at its target size.
+ */
+static void *refillPool(void *arg) {
+    (void)arg;
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);     // signals are handled by the main thread
+
+    pthread_mutex_lock(&poolLock);
+    while (true) {
+        while (poolIdle >= poolTarget)
+            pthread_cond_wait(&poolWanted, &poolLock);
+        pthread_mutex_unlock(&poolLock);
+
+        Helper helper;
+        bool started = startHelper(&helper);
+
+        pthread_mutex_lock(&poolLock);
+        if (!started) {
+            struct timespec retry;
+            clock_gettime(CLOCK_REALTIME, &retry);
+            retry.tv_sec += 1;
+            pthread_cond_timedwait(&poolWanted, &poolLock, &retry);
+        } else if (poolIdle < poolTarget) {
+            pool[poolIdle++] = helper;
+        } else {
+            close(helper.sock);     // pool shrank meanwhile; the helper exits on EOF
+        }
+    }
+    return NULL;
+}
+
+typedef struct ForkGuard {
+    pthread_mutex_t *lock;
+    void (*resetInChild)();
+    bool ready;             // filled in; read by the fork handlers without a lock
+    bool locked;            // taken by lockBeforeFork
+} ForkGuard;
+
+static ForkGuard forkGuards[MAX_FORK_GUARDS];
+static int forkGuardCount = 0;
+static pthread_once_t forkHandlersOnce = PTHREAD_ONCE_INIT;
+
+static void lockBeforeFork() {
+    int count = __atomic_load_n(&forkGuardCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && i < MAX_FORK_GUARDS; i++) {
+        if (__atomic_load_n(&forkGuards[i].ready, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(forkGuards[i].lock);
+            forkGuards[i].locked = true;
+        }
+    }
+}
+
+static void unlockAfterFork() {
+    for (int i = MAX_FORK_GUARDS - 1; i >= 0; i--) {
+        if (forkGuards[i].locked) {
+            forkGuards[i].locked = false;
+            pthread_mutex_unlock(forkGuards[i].lock);
+        }
+    }
+}
+
+static void resetAfterForkInChild() {
+    for (int i = MAX_FORK_GUARDS - 1; i >= 0; i--) {
+        if (forkGuards[i].locked) {
+            forkGuards[i].locked = false;
+            if (forkGuards[i].resetInChild != NULL)
+                forkGuards[i].resetInChild();
+            pthread_mutex_unlock(forkGuards[i].lock);
+        }
+    }
+}
+
+static void installForkHandlers() {
+    if (pthread_atfork(lockBeforeFork, unlockAfterFork, resetAfterForkInChild) != 0)
+        perror("pthread_atfork");
+}
+
+/**
+ * The function guardAcrossFork holds \param lock of a background thread across every
+ * fork of the shell, so a forked copy never inherits it taken by a thread that does
+ * not exist there. In the child, \param resetInChild (if not NULL) then runs with
+ * the lock held, to drop what belonged to that thread. Registering a lock again does
+ * nothing. Called with \param lock held, so it is not registered twice at once.
+ */
+void guardAcrossFork(pthread_mutex_t *lock, void (*resetInChild)()) {
+    pthread_once(&forkHandlersOnce, installForkHandlers);
+    int count = __atomic_load_n(&forkGuardCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && i < MAX_FORK_GUARDS; i++) {
+        if (forkGuards[i].lock == lock)
+            return;
+    }
+    int i = __atomic_fetch_add(&forkGuardCount, 1, __ATOMIC_ACQ_REL);
+    if (i >= MAX_FORK_GUARDS) {
+        printf("Error: too many fork guards!\n");
+        return;
+    }
+    forkGuards[i].lock = lock;
+    forkGuards[i].resetInChild = resetInChild;
+    __atomic_store_n(&forkGuards[i].ready, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * The function forgetPoolInChild drops the pool in a forked copy of the shell, which
+ * has no refill thread. Its sockets lead to helpers of the shell, which would get
+ * commands from both processes.
+ */
+static void forgetPoolInChild() {
+    while (poolIdle > 0)
+        close(pool[--poolIdle].sock);
+    poolTarget = 0;
+    refillThreadStarted = false;
+}
+
+/**
+ * The function setSpawnPoolSize sets the number of idle helpers kept ready.
+ * A size of 0 disables the pool and retires the idle helpers.
+ * @param size the new pool size.
+ */
+void setSpawnPoolSize(int size) {
+    if (size < 0)
+        size = 0;
+    if (size > MAX_POOL_SIZE)
+        size = MAX_POOL_SIZE;
+
+    pthread_mutex_lock(&poolLock);
+    poolTarget = size;
+    while (poolIdle > poolTarget)
+        close(pool[--poolIdle].sock);
+    if (poolTarget > 0 && !refillThreadStarted) {
+        guardAcrossFork(&poolLock, forgetPoolInChild);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, refillPool, NULL) == 0) {
+            pthread_detach(thread);
+            refillThreadStarted = true;
+        } else {
+            perror("pthread_create");
+        }
+    }
+    pthread_cond_signal(&poolWanted);
+    pthread_mutex_unlock(&poolLock);
+}
+
+/**
+ * The function printSpawnPoolStatus prints the pool configuration and launch counters.
+ */
+void printSpawnPoolStatus() {
+    pthread_mutex_lock(&poolLock);
+    shellPrintf("Spawn pool size %d, %d idle helpers, %lu launches from pool, %lu forked\n",
+           poolTarget, poolIdle, poolLaunches, forkLaunches);
+    pthread_mutex_unlock(&poolLock);
+}
+
+/**
+ * The function appendString appends \param s (including its terminator) to a message.
+ * @return a bool denoting whether \param s fitted.
+ */
+static bool appendString(char *buf, size_t *len, const char *s) {
+    size_t n = strlen(s) + 1;
+    if (*len + n > POOL_MESSAGE_MAX)
+        return false;
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return true;
+}
+
+/**
+ * The function encodeSpec serializes a spec, the environment and the working directory.
+ * @return the message length, or 0 if the spec does not fit in a message.
+ */
+static size_t encodeSpec(SpawnSpec *spec, char *buf) {
+    SpawnMessage header = { spec->pgid, 0, 0 };
+    size_t len = sizeof(header);
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return 0;
+
+    for (; spec->args[header.argc] != NULL; header.argc++) {
+        if (!appendString(buf, &len, spec->args[header.argc]))
+            return 0;
+    }
+    for (; environ[header.envc] != NULL; header.envc++) {
+        if (!appendString(buf, &len, environ[header.envc]))
+            return 0;
+    }
+    if (!appendString(buf, &len, cwd))
+        return 0;
+    memcpy(buf, &header, sizeof(header));
+    return len;
+}
+
+/**
+ * The function sendSpec hands a serialized spec and the standard descriptors to a helper.
+ */
+static bool sendSpec(Helper *helper, SpawnSpec *spec, char *buf, size_t len) {
+    int fds[3] = { spec->fdIn, spec->fdOut, spec->fdErr };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n;
+    while ((n = sendmsg(helper->sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        ;
+    return n == (ssize_t)len;
+}
+
+/**
+ * The function takeHelper removes an idle helper from the pool and wakes the refill thread.
+ * @return a bool denoting whether a helper was available.
+ */
+static bool takeHelper(Helper *helper) {
+    bool taken = false;
+    pthread_mutex_lock(&poolLock);
+    if (poolIdle > 0) {
+        *helper = pool[--poolIdle];
+        taken = true;
+        pthread_cond_signal(&poolWanted);
+    }
+    pthread_mutex_unlock(&poolLock);
+    return taken;
+}
+
+/**
+ * The function spawnCommand starts a command as a child of the shell. The command joins
+ * process group \param spec->pgid (or leads a new group) and has its stdin and stdout
+ * redirected to the descriptors of the spec, and is held to the limits of the spec.
+ * @param spec describes the command to start.
+ * @return the pid of the command, or -1 if it could not be started.
+ */
+pid_t spawnCommand(SpawnSpec *spec) {
+    shellFlush();       // output of the shell goes before that of the command
+    prefetchLaunch(spec->args[0]);
+    // A limited command sets its limits itself between fork and exec, which a helper cannot.
+    if (poolTarget > 0 && (spec->limits == NULL || !hasLimits(spec->limits))) {
+        char *buf = malloc(POOL_MESSAGE_MAX);
+        size_t len = buf == NULL ? 0 : encodeSpec(spec, buf);
+        Helper helper;
+        if (len > 0 && takeHelper(&helper)) {
+            bool sent = sendSpec(&helper, spec, buf, len);
+            close(helper.sock);
+            if (sent) {
+                free(buf);
+                poolLaunches++;
+                return helper.pid;
+            }
+            kill(helper.pid, SIGKILL);
+        }
+        free(buf);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (setpgid(0, spec->pgid) == -1 && setpgid(0, 0) == -1) {
+            perror("setpgid failed");
+            exit(EXIT_FAILURE);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        if (spec->limits != NULL)
+            applyLimits(spec->limits);
+        if (spec->fdErr != STDERR_FILENO)
+            dup2(spec->fdErr, STDERR_FILENO);   // may also be fdOut, which is closed next
+        redirect(spec->fdIn, STDIN_FILENO);
+        redirect(spec->fdOut, STDOUT_FILENO);
+        closeDescriptorsFrom(STDERR_FILENO + 1);    // whatever is not close-on-exec
+        if (execvp(spec->args[0], spec->args) == -1) {
+            printf("Error: command not found!\n");
+            exit(127);
+        }
+    }
+    if (pid > 0)
+        forkLaunches++;
+    return pid;
+}
@@ -0,0 +1,26 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "joblimits.h"
+
+#define MAX_POOL_SIZE 64
+#define MAX_FORK_GUARDS 8          // locks of background threads guarded across fork
+
+typedef struct SpawnSpec {
+    char **args;        // NULL-terminated argument vector, args[0] is the executable
+    int fdIn;           // becomes stdin of the command
+    int fdOut;          // becomes stdout of the command
+    int fdErr;          // becomes stderr of the command
+    pid_t pgid;         // process group to join, 0 to lead a new one
+    const ResourceLimits *limits;   // applied before exec, NULL for none
+} SpawnSpec;
+
+pid_t spawnCommand(SpawnSpec *spec);
+void setSpawnPoolSize(int size);
+void printSpawnPoolStatus();
+void guardAcrossFork(pthread_mutex_t *lock, void (*resetInChild)());
+
+#endif
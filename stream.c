@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "stream.h"
+#include "memstats.h"
+
+static Stream standardInput = { STREAM_FD, STDIN_FILENO, NULL, false };
+static Stream standardOutput = { STREAM_FD, STDOUT_FILENO, NULL, true };
+
+__thread Stream *shellIn = &standardInput;      // stdin of the builtin running on this thread
+__thread Stream *shellOut = &standardOutput;    // stdout of the builtin running on this thread
+
+/*
+ * Output of shellPrintf is gathered per thread and written with one writev when the
+ * buffer fills up, so a builtin that prints many lines costs a few syscalls. The buffer
+ * is flushed when the builtin returns, before the shell forks, before a read on the
+ * thread and before any other write to the same stream, which keeps the output in the
+ * order it was printed in.
+ */
+typedef struct OutputBuffer {
+    Stream *target;             // stream the buffered output is for
+    size_t length;
+    char data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+static __thread OutputBuffer output;
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+static void futexWait(uint32_t *addr, uint32_t expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futexWake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * The function notify wakes the other side of a ring if it is (about to go) asleep.
+ * @param waiting the waiting flag of the other side.
+ * @param event the event counter the other side sleeps on.
+ */
+static void notify(uint32_t *waiting, uint32_t *event) {
+    // The index was stored with release order, which lets the load below pass it; the
+    // fence keeps the other side from reading the old index after setting its flag.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (LOAD(waiting)) {
+        __atomic_add_fetch(event, 1, __ATOMIC_SEQ_CST);
+        futexWake(event);
+    }
+}
+
+/**
+ * The function await sleeps until the other side of a ring notifies \param event,
+ * unless \param ready already holds after announcing the wait.
+ */
+static void await(RingBuffer *r, uint32_t *waiting, uint32_t *event, bool (*ready)(RingBuffer *)) {
+    uint32_t observed = LOAD(event);
+    STORE(waiting, 1);
+    if (!ready(r))
+        futexWait(event, observed);
+    STORE(waiting, 0);
+}
+
+static bool canRead(RingBuffer *r) {
+    return LOAD(&r->head) != r->tail || LOAD(&r->writerClosed);
+}
+
+static bool canWrite(RingBuffer *r) {
+    return r->head - LOAD(&r->tail) < r->capacity || LOAD(&r->readerClosed);
+}
+
+/**
+ * The function newRingBuffer makes a ring buffer with one reference for each side.
+ * @return the new ring buffer.
+ */
+RingBuffer *newRingBuffer() {
+    MemSubsystem previous = memEnter(MEM_STREAMS);
+    RingBuffer *r = calloc(1, sizeof(*r));
+    assert(r != NULL);
+    r->capacity = RING_BUFFER_SIZE;
+    r->data = malloc(r->capacity);
+    assert(r->data != NULL);
+    r->refs = 2;
+    memLeave(previous);
+    return r;
+}
+
+static void releaseRing(RingBuffer *r) {
+    if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(r->data);
+        free(r);
+    }
+}
+
+/**
+ * The function ringWrite copies \param n bytes into the ring, sleeping while it is full.
+ * @return the number of bytes written, or -1 with errno EPIPE if the reader is gone.
+ */
+static ssize_t ringWrite(RingBuffer *r, const char *buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        if (LOAD(&r->readerClosed)) {
+            errno = EPIPE;
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        uint32_t head = r->head;
+        uint32_t space = r->capacity - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        if (space == 0) {
+            await(r, &r->producerWaiting, &r->spaceEvent, canWrite);
+            continue;
+        }
+
+        uint32_t chunk = n - done < space ? n - done : space;
+        uint32_t offset = head & (r->capacity - 1);
+        uint32_t first = chunk < r->capacity - offset ? chunk : r->capacity - offset;
+        memcpy(r->data + offset, buf + done, first);
+        memcpy(r->data, buf + done + first, chunk - first);
+        __atomic_store_n(&r->head, head + chunk, __ATOMIC_RELEASE);
+        done += chunk;
+        notify(&r->consumerWaiting, &r->dataEvent);
+    }
+    return done;
+}
+
+/**
+ * The function ringRead copies up to \param n bytes out of the ring, sleeping while it is empty.
+ * @return the number of bytes read, or 0 once the writer closed and the ring is drained.
+ */
+static ssize_t ringRead(RingBuffer *r, char *buf, size_t n) {
+    while (true) {
+        uint32_t tail = r->tail;
+        uint32_t available = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+        if (available == 0) {
+            if (LOAD(&r->writerClosed) && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+                return 0;
+            await(r, &r->consumerWaiting, &r->dataEvent, canRead);
+            continue;
+        }
+
+        uint32_t chunk = n < available ? n : available;
+        uint32_t offset = tail & (r->capacity - 1);
+        uint32_t first = chunk < r->capacity - offset ? chunk : r->capacity - offset;
+        memcpy(buf, r->data + offset, first);
+        memcpy(buf + first, r->data, chunk - first);
+        __atomic_store_n(&r->tail, tail + chunk, __ATOMIC_RELEASE);
+        notify(&r->producerWaiting, &r->spaceEvent);
+        return chunk;
+    }
+}
+
+Stream fdStream(int fd, bool output) {
+    Stream s = { STREAM_FD, fd, NULL, output };
+    return s;
+}
+
+Stream ringStream(RingBuffer *ring, bool output) {
+    Stream s = { STREAM_RING, -1, ring, output };
+    return s;
+}
+
+/**
+ * The function writeGathered writes all the \param count buffers of \param iov to a
+ * stream, for a descriptor with as few writev calls as it takes.
+ * @return a bool denoting whether everything was written.
+ */
+static bool writeGathered(Stream *s, struct iovec *iov, int count) {
+    if (s->kind == STREAM_RING) {
+        for (int i = 0; i < count; i++) {
+            if (ringWrite(s->ring, iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len)
+                return false;
+        }
+        return true;
+    }
+    while (count > 0) {
+        ssize_t written = writev(s->fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * The function flushOutput writes the buffered output of the thread, followed by
+ * \param n bytes of \param extra, in one go. The buffer is emptied even if the write
+ * fails, so an error is reported once and not repeated by every later flush.
+ * @return a bool denoting whether everything was written.
+ */
+static bool flushOutput(const char *extra, size_t n) {
+    struct iovec iov[2];
+    int count = 0;
+    if (output.length > 0) {
+        iov[count].iov_base = output.data;
+        iov[count++].iov_len = output.length;
+    }
+    if (n > 0) {
+        iov[count].iov_base = (char *)extra;
+        iov[count++].iov_len = n;
+    }
+    bool ok = count == 0 || writeGathered(output.target, iov, count);
+    output.length = 0;
+    return ok;
+}
+
+/**
+ * The function shellFlush writes the output buffered by shellPrintf on this thread.
+ * @return 0, or -1 if it could not be written.
+ */
+int shellFlush() {
+    return output.length == 0 || flushOutput(NULL, 0) ? 0 : -1;
+}
+
+/**
+ * The function streamWrite writes all \param n bytes of \param buf to a stream.
+ * @return the number of bytes written, or -1 on error.
+ */
+ssize_t streamWrite(Stream *s, const void *buf, size_t n) {
+    if (s == output.target && output.length > 0 && !flushOutput(NULL, 0))
+        return -1;
+    if (s->kind == STREAM_RING)
+        return ringWrite(s->ring, buf, n);
+
+    const char *p = buf;
+    size_t left = n;
+    while (left > 0) {
+        ssize_t written = write(s->fd, p, left);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        left -= written;
+    }
+    return n;
+}
+
+/**
+ * The function streamRead reads up to \param n bytes from a stream.
+ * @return the number of bytes read, 0 at end of input, or -1 on error.
+ */
+ssize_t streamRead(Stream *s, void *buf, size_t n) {
+    shellFlush();                                   // a prompt shows before the read blocks
+    if (s->kind == STREAM_RING)
+        return ringRead(s->ring, buf, n);
+
+    ssize_t got;
+    while ((got = read(s->fd, buf, n)) == -1 && errno == EINTR)
+        ;
+    return got;
+}
+
+/**
+ * The function streamClose closes a stream. The standard descriptors stay open;
+ * closing one side of a ring wakes the other side.
+ */
+void streamClose(Stream *s) {
+    if (s == output.target) {
+        shellFlush();
+        output.target = NULL;
+    }
+    if (s->kind == STREAM_FD) {
+        if (s->fd > STDERR_FILENO)
+            close(s->fd);
+    } else if (s->output) {
+        STORE(&s->ring->writerClosed, 1);
+        notify(&s->ring->consumerWaiting, &s->ring->dataEvent);
+        releaseRing(s->ring);
+    } else {
+        STORE(&s->ring->readerClosed, 1);
+        notify(&s->ring->producerWaiting, &s->ring->spaceEvent);
+        releaseRing(s->ring);
+    }
+    s->fd = -1;
+    s->ring = NULL;
+}
+
+/**
+ * The function shellPrintf is the printf of builtins: it writes to the stdout of
+ * the builtin running on the calling thread, which may be a pipe or a ring buffer.
+ * The text is formatted straight into the output buffer of the thread; text that
+ * does not fit is written together with the buffer by one writev.
+ * @return the number of characters written, or a negative value on error.
+ */
+int shellPrintf(const char *format, ...) {
+    if (output.target != shellOut) {
+        if (shellFlush() == -1)
+            return -1;
+        output.target = shellOut;
+    }
+
+    size_t space = OUTPUT_BUFFER_SIZE - output.length;
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(output.data + output.length, space, format, ap);
+    va_end(ap);
+    if (n < 0)
+        return n;
+    if ((size_t)n < space) {
+        output.length += n;
+        return n;
+    }
+
+    char local[512];
+    char *buf = n < (int)sizeof(local) ? local : malloc(n + 1);
+    assert(buf != NULL);
+    va_start(ap, format);
+    vsnprintf(buf, n + 1, format, ap);
+    va_end(ap);
+    bool ok = flushOutput(buf, n);
+    if (buf != local)
+        free(buf);
+    return ok ? n : -1;
+}
@@ -0,0 +1,58 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RING_BUFFER_SIZE (256 * 1024)
+#define OUTPUT_BUFFER_SIZE (32 * 1024)
+
+/*
+ * A RingBuffer connects two builtin stages of a pipeline that run as threads.
+ * It is a single-producer/single-consumer queue: the data path is lock-free and
+ * a side only sleeps (on a futex) when the buffer is full or empty.
+ */
+typedef struct RingBuffer {
+    char *data;
+    uint32_t capacity;          // power of two
+    uint32_t head;              // bytes written so far, advanced by the producer
+    uint32_t tail;              // bytes read so far, advanced by the consumer
+    uint32_t dataEvent;         // bumped to wake a waiting consumer
+    uint32_t spaceEvent;        // bumped to wake a waiting producer
+    uint32_t consumerWaiting;
+    uint32_t producerWaiting;
+    uint32_t writerClosed;
+    uint32_t readerClosed;
+    uint32_t refs;
+} RingBuffer;
+
+typedef enum StreamKind {
+    STREAM_FD,
+    STREAM_RING
+} StreamKind;
+
+/*
+ * A Stream is the stdin or stdout of a builtin: either a file descriptor
+ * (terminal, file or kernel pipe) or one end of a RingBuffer.
+ */
+typedef struct Stream {
+    StreamKind kind;
+    int fd;
+    RingBuffer *ring;
+    bool output;
+} Stream;
+
+extern __thread Stream *shellIn;
+extern __thread Stream *shellOut;
+
+RingBuffer *newRingBuffer();
+Stream fdStream(int fd, bool output);
+Stream ringStream(RingBuffer *ring, bool output);
+ssize_t streamWrite(Stream *s, const void *buf, size_t n);
+ssize_t streamRead(Stream *s, void *buf, size_t n);
+void streamClose(Stream *s);
+int shellPrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+int shellFlush();
+
+#endif
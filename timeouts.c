@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "record.h"
+#include "spawn.h"
+#include "timeouts.h"
+
+typedef struct Deadline {
+    int64_t when;               // CLOCK_MONOTONIC
+    int64_t killAfter;
+    pid_t pgid;
+    bool used;
+    bool terminated;            // SIGTERM has been sent, when is the time for SIGKILL
+    bool fired;
+    int heapIndex;              // position in the heap, -1 when not in it
+} Deadline;
+
+static Deadline deadlines[MAX_DEADLINES];   // indexed by id
+static bool finished[MAX_DEADLINES];        // set by the SIGCHLD handler, see finishDeadline
+static int deadlineCount = 0;
+static int freeIds[MAX_DEADLINES];
+static int freeCount = 0;
+static int heap[MAX_DEADLINES];             // ids, the earliest deadline first
+static int heapLength = 0;
+static int timerFd = -1;
+static pthread_mutex_t deadlineLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * The function parseDuration reads a duration: a number with an optional unit, ms, s
+ * (the default), m, h or d, e.g. "1.5", "500ms" or "2m".
+ * @param ns set to the duration in nanoseconds.
+ * @return a bool denoting whether \param s was a valid duration.
+ */
+bool parseDuration(const char *s, int64_t *ns) {
+    char *end;
+    errno = 0;
+    double value = strtod(s, &end);
+    double unit;
+    if (end == s || errno != 0 || value < 0)
+        return false;
+    if (strcmp(end, "ms") == 0)
+        unit = 1e6;
+    else if (*end == '\0' || strcmp(end, "s") == 0)
+        unit = 1e9;
+    else if (strcmp(end, "m") == 0)
+        unit = 60e9;
+    else if (strcmp(end, "h") == 0)
+        unit = 3600e9;
+    else if (strcmp(end, "d") == 0)
+        unit = 86400e9;
+    else
+        return false;
+    if (value * unit > 9e18)
+        return false;
+    *ns = (int64_t)(value * unit);
+    return true;
+}
+
+static void swapEntries(int i, int j) {
+    int id = heap[i];
+    heap[i] = heap[j];
+    heap[j] = id;
+    deadlines[heap[i]].heapIndex = i;
+    deadlines[heap[j]].heapIndex = j;
+}
+
+static void siftUp(int i) {
+    while (i > 0 && deadlines[heap[(i - 1) / 2]].when > deadlines[heap[i]].when) {
+        swapEntries(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void siftDown(int i) {
+    while (true) {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < heapLength; child++) {
+            if (deadlines[heap[child]].when < deadlines[heap[smallest]].when)
+                smallest = child;
+        }
+        if (smallest == i)
+            return;
+        swapEntries(i, smallest);
+        i = smallest;
+    }
+}
+
+static void heapPush(int id) {
+    heap[heapLength] = id;
+    deadlines[id].heapIndex = heapLength++;
+    siftUp(heapLength - 1);
+}
+
+static void heapRemove(int id) {
+    int i = deadlines[id].heapIndex;
+    deadlines[id].heapIndex = -1;
+    if (--heapLength == i)
+        return;
+    heap[i] = heap[heapLength];
+    deadlines[heap[i]].heapIndex = i;
+    siftUp(i);
+    siftDown(deadlines[heap[i]].heapIndex);
+}
+
+/**
+ * The function armTimer sets the timerfd to the earliest deadline, or disarms it.
+ * Called with deadlineLock held.
+ */
+static void armTimer() {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (heapLength > 0) {
+        int64_t when = deadlines[heap[0]].when;
+        spec.it_value.tv_sec = when / 1000000000;
+        spec.it_value.tv_nsec = when % 1000000000;
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;          // zero would disarm it
+    }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * The function expireDeadlines signals the process groups whose deadline has passed:
+ * SIGTERM first, then SIGKILL after the grace period. Called with deadlineLock held.
+ */
+static void expireDeadlines() {
+    int64_t now = monotonicNow();
+    while (heapLength > 0 && deadlines[heap[0]].when <= now) {
+        int id = heap[0];
+        Deadline *d = &deadlines[id];
+        heapRemove(id);
+        if (__atomic_load_n(&finished[id], __ATOMIC_SEQ_CST)) {
+            continue;                                   // the job has ended, its pgid may be reused
+        } else if (d->terminated) {
+            kill(-d->pgid, SIGKILL);
+        } else if (kill(-d->pgid, SIGTERM) == 0) {      // fails once the job has ended
+            kill(-d->pgid, SIGCONT);
+            d->fired = true;
+            d->terminated = true;
+            d->when = now + d->killAfter;
+            heapPush(id);
+        }
+    }
+    armTimer();
+}
+
+static void *timerThread(void *arg) {
+    (void)arg;
+    while (true) {
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) == -1 && errno != EINTR && errno != EAGAIN)
+            return NULL;
+        pthread_mutex_lock(&deadlineLock);
+        expireDeadlines();
+        pthread_mutex_unlock(&deadlineLock);
+    }
+}
+
+/**
+ * The function forgetInChild drops the deadlines of the shell in a forked copy of it,
+ * which has no timer thread; a deadline set there starts one of its own.
+ */
+static void forgetInChild() {
+    if (timerFd != -1)
+        close(timerFd);
+    timerFd = -1;
+    heapLength = 0;
+    deadlineCount = 0;
+    freeCount = 0;
+}
+
+/**
+ * The function startTimerThread creates the timerfd and the thread that waits on it,
+ * with every signal blocked so they stay with the shell. Called with deadlineLock held.
+ */
+static bool startTimerThread() {
+    guardAcrossFork(&deadlineLock, forgetInChild);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timerFd == -1)
+        return false;
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    pthread_t thread;
+    bool started = pthread_create(&thread, NULL, timerThread, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (!started) {
+        close(timerFd);
+        timerFd = -1;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/**
+ * The function addDeadline sets a deadline for process group \param pgid.
+ * @param timeout time from now until SIGTERM, in nanoseconds.
+ * @param killAfter time from SIGTERM until SIGKILL.
+ * @return the id of the deadline, or -1 if it could not be set.
+ */
+int addDeadline(pid_t pgid, int64_t timeout, int64_t killAfter) {
+    pthread_mutex_lock(&deadlineLock);
+    if (timerFd == -1 && !startTimerThread()) {
+        pthread_mutex_unlock(&deadlineLock);
+        perror("timerfd");
+        return -1;
+    }
+    if (freeCount == 0 && deadlineCount == MAX_DEADLINES) {
+        pthread_mutex_unlock(&deadlineLock);
+        printf("Error: too many deadlines!\n");
+        return -1;
+    }
+    int id = freeCount > 0 ? freeIds[--freeCount] : deadlineCount++;
+    Deadline *d = &deadlines[id];
+    d->when = monotonicNow() + timeout;
+    d->killAfter = killAfter;
+    d->pgid = pgid;
+    d->used = true;
+    d->terminated = false;
+    d->fired = false;
+    __atomic_store_n(&finished[id], false, __ATOMIC_SEQ_CST);
+    heapPush(id);
+    if (heap[0] == id)
+        armTimer();
+    pthread_mutex_unlock(&deadlineLock);
+    return id;
+}
+
+/**
+ * The function cancelDeadline removes deadline \param id, once its job has ended or
+ * gets another deadline.
+ * @return a bool denoting whether the deadline had passed (and SIGTERM was sent).
+ */
+bool cancelDeadline(int id) {
+    pthread_mutex_lock(&deadlineLock);
+    bool fired = false;
+    if (id >= 0 && id < deadlineCount && deadlines[id].used) {
+        Deadline *d = &deadlines[id];
+        fired = d->fired;
+        if (d->heapIndex != -1) {
+            bool first = heap[0] == id;
+            heapRemove(id);
+            if (first)
+                armTimer();
+        }
+        d->used = false;
+        freeIds[freeCount++] = id;
+    }
+    pthread_mutex_unlock(&deadlineLock);
+    return fired;
+}
+
+/**
+ * The function finishDeadline marks that the job of deadline \param id has ended, so
+ * its process group is not signalled any more. The deadline stays allocated until
+ * cancelDeadline. Async-signal-safe: called from the SIGCHLD handler.
+ */
+void finishDeadline(int id) {
+    if (id >= 0 && id < MAX_DEADLINES)
+        __atomic_store_n(&finished[id], true, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * The function deadlineLeft tells how long deadline \param id has to go.
+ * @param left set to the time until SIGTERM, or until SIGKILL once SIGTERM was sent.
+ * @param terminated set to whether SIGTERM was sent.
+ * @return a bool denoting whether the deadline is still pending.
+ */
+bool deadlineLeft(int id, int64_t *left, bool *terminated) {
+    pthread_mutex_lock(&deadlineLock);
+    bool pending = id >= 0 && id < deadlineCount && deadlines[id].used && deadlines[id].heapIndex != -1;
+    if (pending) {
+        *left = deadlines[id].when - monotonicNow();
+        *terminated = deadlines[id].terminated;
+    }
+    pthread_mutex_unlock(&deadlineLock);
+    return pending;
+}
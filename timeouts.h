@@ -0,0 +1,33 @@
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DEFAULT_KILL_AFTER_SECONDS 5    // from SIGTERM to SIGKILL, unless -k says otherwise
+#define TIMEOUT_STATUS 124              // exit code of a pipeline stopped by its deadline, as timeout(1)
+#define MAX_DEADLINES 256               // the bg jobs and their finished jobs not cancelled yet, and more
+
+/*
+ * A deadline belongs to the process group of a job. When it passes, the group gets
+ * SIGTERM (and SIGCONT, in case it is stopped), and SIGKILL once the grace period
+ * after that has passed too.
+ *
+ * All deadlines are kept in one min-heap by time and one timerfd is armed for the
+ * earliest; a thread of the shell sleeps on it and sends the signals. Adding or
+ * cancelling a deadline is O(log n), whatever the number of jobs, and needs no
+ * process of its own.
+ *
+ * The job of a deadline may end long before the deadline is cancelled. The SIGCHLD
+ * handler cannot take the lock, so it marks the deadline finished instead; the timer
+ * skips it rather than signal a process group whose id may have been reused.
+ */
+
+bool parseDuration(const char *s, int64_t *ns);
+int addDeadline(pid_t pgid, int64_t timeout, int64_t killAfter);
+bool cancelDeadline(int id);
+void finishDeadline(int id);
+bool deadlineLeft(int id, int64_t *left, bool *terminated);
+
+#endif
@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <unistd.h>
+#include "scanner.h"
+#include "shell.h"
+#include "vars.h"
+#include "arith.h"
+
+#define INITIAL_VARIABLE_SLOTS 64
+#define ARENA_CHUNK_SIZE 65536
+
+typedef struct Variable {
+    char *name;             // NULL for an empty slot
+    char *value;
+    size_t capacity;        // size of the value buffer, reused on reassignment
+} Variable;
+
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+static Variable *variables = NULL;          // open addressing hash table
+static int variableSlots = 0;
+static int variableCount = 0;
+
+static char *scriptName = "shell";
+static char **positional = NULL;            // $1 ... $n
+static int positionalLength = 0;
+
+static __thread ArenaChunk *arenaHead = NULL;
+static __thread ArenaChunk *arenaCurrent = NULL;
+static __thread char *scratch = NULL;       // expansion is built here, then copied to the arena
+static __thread size_t scratchCapacity = 0;
+
+static unsigned long hashName(const char *s) {
+    unsigned long h = 5381;
+    while (*s != '\0')
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+static Variable *findSlot(Variable *table, int slots, const char *name) {
+    unsigned long i = hashName(name) & (slots - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0)
+        i = (i + 1) & (slots - 1);
+    return &table[i];
+}
+
+static void growVariables() {
+    int slots = variableSlots == 0 ? INITIAL_VARIABLE_SLOTS : 2 * variableSlots;
+    Variable *table = calloc(slots, sizeof(*table));
+    assert(table != NULL);
+    for (int i = 0; i < variableSlots; i++) {
+        if (variables[i].name != NULL)
+            *findSlot(table, slots, variables[i].name) = variables[i];
+    }
+    free(variables);
+    variables = table;
+    variableSlots = slots;
+}
+
+/**
+ * The function setVariable assigns \param value to shell variable \param name.
+ * The value buffer of an existing variable is reused when it is large enough.
+ */
+void setVariable(const char *name, const char *value) {
+    if (4 * (variableCount + 1) > 3 * variableSlots)
+        growVariables();
+
+    Variable *v = findSlot(variables, variableSlots, name);
+    size_t len = strlen(value);
+    if (v->name == NULL) {
+        v->name = strdup(name);
+        assert(v->name != NULL);
+        v->value = NULL;
+        v->capacity = 0;
+        variableCount++;
+    }
+    if (len + 1 > v->capacity) {
+        v->capacity = len + 1 < 16 ? 16 : len + 1;
+        free(v->value);
+        v->value = malloc(v->capacity);
+        assert(v->value != NULL);
+    }
+    memcpy(v->value, value, len + 1);
+}
+
+/**
+ * The function getVariable looks up a shell variable, falling back to the environment.
+ * @return the value, or NULL if the variable is not set.
+ */
+const char *getVariable(const char *name) {
+    if (variableSlots > 0) {
+        Variable *v = findSlot(variables, variableSlots, name);
+        if (v->name != NULL)
+            return v->value;
+    }
+    return getenv(name);
+}
+
+static bool isNameStart(char c) {
+    return isalpha((unsigned char)c) || c == '_';
+}
+
+static bool isNameCharacter(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/**
+ * The function isAssignment checks whether \param word has the form NAME=value.
+ */
+bool isAssignment(const char *word) {
+    if (!isNameStart(*word))
+        return false;
+    while (isNameCharacter(*word))
+        word++;
+    return *word == '=';
+}
+
+/**
+ * The function assignVariable performs an assignment NAME=value; the value is expanded.
+ * @return a bool denoting whether the variable was assigned: false if \param assignment
+ * was no assignment, or if its value could not be expanded.
+ */
+bool assignVariable(char *assignment) {
+    if (!isAssignment(assignment))
+        return false;
+    char *eq = strchr(assignment, '=');
+    *eq = '\0';
+    ExpansionMark mark = expansionMark();
+    char *value = expandWord(eq + 1);
+    if (value != NULL)
+        setVariable(assignment, value);
+    expansionRelease(mark);
+    *eq = '=';
+    return value != NULL;
+}
+
+/**
+ * The function setPositionalParameters sets $0 and $1 ... $n. The strings are not copied.
+ */
+void setPositionalParameters(char *name, int count, char **values) {
+    if (name != NULL)
+        scriptName = name;
+    positionalLength = count;
+    positional = values;
+}
+
+int positionalCount() {
+    return positionalLength;
+}
+
+/**
+ * The function positionalValues returns the array that holds $1 ... $n, to restore them
+ * with setPositionalParameters later.
+ */
+char **positionalValues() {
+    return positional;
+}
+
+/**
+ * The function positionalParameter returns $i, or an empty string when it is not set.
+ */
+char *positionalParameter(int i) {
+    if (i == 0)
+        return scriptName;
+    return i <= positionalLength ? positional[i - 1] : "";
+}
+
+ExpansionMark expansionMark() {
+    ExpansionMark mark = { arenaCurrent, arenaCurrent == NULL ? 0 : arenaCurrent->used };
+    return mark;
+}
+
+/**
+ * The function expansionRelease frees everything expanded since \param mark was taken.
+ * The chunks are kept for reuse.
+ */
+void expansionRelease(ExpansionMark mark) {
+    arenaCurrent = mark.chunk != NULL ? mark.chunk : arenaHead;
+    if (arenaCurrent == NULL)
+        return;
+    arenaCurrent->used = mark.chunk != NULL ? mark.used : 0;
+    for (ArenaChunk *c = arenaCurrent->next; c != NULL; c = c->next)
+        c->used = 0;
+}
+
+static void *arenaAllocate(size_t n) {
+    n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    while (arenaCurrent != NULL && arenaCurrent->size - arenaCurrent->used < n) {
+        if (arenaCurrent->next == NULL)
+            break;
+        arenaCurrent = arenaCurrent->next;      // chunks after the current one are empty
+    }
+    if (arenaCurrent == NULL || arenaCurrent->size - arenaCurrent->used < n) {
+        size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+        ArenaChunk *chunk = malloc(sizeof(*chunk) + size);
+        assert(chunk != NULL);
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = NULL;
+        if (arenaCurrent == NULL) {
+            arenaHead = chunk;
+        } else {
+            chunk->next = arenaCurrent->next;
+            arenaCurrent->next = chunk;
+        }
+        arenaCurrent = chunk;
+    }
+    void *p = arenaCurrent->data + arenaCurrent->used;
+    arenaCurrent->used += n;
+    return p;
+}
+
+/**
+ * The function expansionAllocate allocates \param n bytes that stay valid until the
+ * enclosing expansion mark is released.
+ */
+void *expansionAllocate(size_t n) {
+    return arenaAllocate(n);
+}
+
+static char *arenaCopy(const char *s, size_t n) {
+    char *p = arenaAllocate(n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+static void appendScratch(size_t *len, const char *s, size_t n) {
+    if (*len + n + 1 > scratchCapacity) {
+        while (*len + n + 1 > scratchCapacity)
+            scratchCapacity = scratchCapacity == 0 ? 256 : 2 * scratchCapacity;
+        scratch = realloc(scratch, scratchCapacity);
+        assert(scratch != NULL);
+    }
+    memcpy(scratch + *len, s, n);
+    *len += n;
+}
+
+/**
+ * The function findArithmeticEnd finds the "))" that ends an arithmetic expansion.
+ * @param s the text after "$((".
+ * @return a pointer to the first ')' of the "))", or NULL if there is none.
+ */
+static char *findArithmeticEnd(char *s) {
+    int depth = 0;
+    for (; *s != '\0'; s++) {
+        if (*s == '(')
+            depth++;
+        else if (*s == ')' && depth > 0)
+            depth--;
+        else if (*s == ')')
+            return s[1] == ')' ? s : NULL;
+    }
+    return NULL;
+}
+
+/**
+ * The function expandWord substitutes the variables in \param word:
+ * $NAME, ${NAME}, $0-$9, $# (number of parameters), $@ and $* (all parameters),
+ * $? (most recent exit code) and $$ (pid of the shell), and the value of arithmetic
+ * expressions $((...)) (see arith.h).
+ * @return \param word itself if it contains no '$', otherwise the expansion,
+ * which stays valid until the enclosing expansion mark is released, or NULL if an
+ * arithmetic expression was invalid (its error has been printed).
+ */
+char *expandWord(char *word) {
+    if (strchr(word, '$') == NULL)
+        return word;
+
+    char number[24];
+    size_t len = 0;
+    for (char *p = word; *p != '\0';) {
+        if (*p != '$') {
+            char *next = strchr(p, '$');
+            size_t n = next == NULL ? strlen(p) : (size_t)(next - p);
+            appendScratch(&len, p, n);
+            p += n;
+            continue;
+        }
+
+        p++;
+        const char *value = NULL;
+        if (p[0] == '(' && p[1] == '(') {
+            char *close = findArithmeticEnd(p + 2);
+            if (close == NULL) {
+                appendScratch(&len, "$((", 3);
+                p += 2;
+                continue;
+            }
+            int64_t result;
+            *close = '\0';
+            bool valid = evaluateArithmetic(p + 2, &result);
+            *close = ')';
+            if (!valid)
+                return NULL;
+            snprintf(number, sizeof(number), "%lld", (long long)result);
+            value = number;
+            p = close + 2;
+        } else if (*p == '{') {
+            char *close = strchr(p, '}');
+            if (close == NULL) {
+                appendScratch(&len, "${", 2);
+                p++;
+                continue;
+            }
+            *close = '\0';
+            value = getVariable(p + 1);
+            *close = '}';
+            p = close + 1;
+        } else if (isNameStart(*p)) {
+            char *end = p;
+            while (isNameCharacter(*end))
+                end++;
+            char saved = *end;
+            *end = '\0';
+            value = getVariable(p);
+            *end = saved;
+            p = end;
+        } else if (isdigit((unsigned char)*p)) {
+            value = positionalParameter(*p++ - '0');
+        } else if (*p == '?' || *p == '#' || *p == '$') {
+            snprintf(number, sizeof(number), "%d", *p == '?' ? exitCode : *p == '#' ? positionalLength : (int)getpid());
+            value = number;
+            p++;
+        } else if (*p == '@' || *p == '*') {
+            for (int i = 0; i < positionalLength; i++) {
+                if (i > 0)
+                    appendScratch(&len, " ", 1);
+                appendScratch(&len, positional[i], strlen(positional[i]));
+            }
+            p++;
+            continue;
+        } else {
+            value = "$";
+        }
+        if (value != NULL)
+            appendScratch(&len, value, strlen(value));
+    }
+    return arenaCopy(len == 0 ? "" : scratch, len);
+}
@@ -0,0 +1,30 @@
+#ifndef VARS_H
+#define VARS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Expanded words live in a per-thread arena. Code that expands words takes a mark
+ * before and releases it when the words are no longer needed, so that running the
+ * same commands over and over (in a loop) reuses the same memory.
+ */
+typedef struct ExpansionMark {
+    void *chunk;
+    size_t used;
+} ExpansionMark;
+
+void setVariable(const char *name, const char *value);
+const char *getVariable(const char *name);
+bool isAssignment(const char *word);
+bool assignVariable(char *assignment);
+void setPositionalParameters(char *name, int count, char **values);
+int positionalCount();
+char **positionalValues();
+char *positionalParameter(int i);
+char *expandWord(char *word);
+void *expansionAllocate(size_t n);
+ExpansionMark expansionMark();
+void expansionRelease(ExpansionMark mark);
+
+#endif